@@ -4,26 +4,10 @@
 #include <time.h>
 #include "emufs.h"
 #include "emufs_disk.h"
+#include "emufs_log.h"
 
 #define MAX_PATH_LENGTH 256
 
-FILE *log_file;
-
-// Function to get the current timestamp
-void log_timestamp(char *buffer, size_t size) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", t);
-}
-
-// Function to log a message
-void log_transaction(const char *message) {
-    char timestamp[64];
-    log_timestamp(timestamp, sizeof(timestamp));
-    fprintf(log_file, "[%s] %s\n", timestamp, message);
-    fflush(log_file);  // Ensure the message is written to the file immediately
-}
-
 void display_menu() {
     printf("\nFile System Manager\n");
     printf("1. Create New Device\n");
@@ -41,19 +25,18 @@ void display_menu() {
 }
 
 int main() {
-    int choice, mount_point = -1, handle = -1, file_handle = -1, fileop = -1, fs_number = 0;
+    int choice, mount_point = -1, handle = -1, file_handle = -1, fileop = -1, fs_number = 0, block_size = 0;
     char device_name[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH];
     char buffer[BLOCKSIZE];
     int size = 1;
 
-    // Open log file
-    log_file = fopen("file_system_log.txt", "a");
-    if (!log_file) {
+    // Open log file (EMUFS_LOG_LEVEL: 0 = debug, 1 = info, 2 = warnings, 3 = errors)
+    if (emufs_log_open(EMUFS_LOG_FILE, getenv("EMUFS_LOG_LEVEL") ? atoi(getenv("EMUFS_LOG_LEVEL")) : EMUFS_LOG_INFO) == -1) {
         perror("Failed to open log file");
         return EXIT_FAILURE;
     }
 
-    log_transaction("File System Manager started.");
+    emufs_log(EMUFS_LOG_INFO, "File System Manager started.");
 
     while (1) {
         display_menu();
@@ -66,21 +49,23 @@ int main() {
                 fgets(device_name, MAX_PATH_LENGTH, stdin);
                 device_name[strcspn(device_name, "\n")] = 0;  // Remove newline
                 mount_point = opendevice(device_name, MAX_BLOCKS);
-                printf("Enter file system number (0 = non-encrypted, 1 = encrypted): ");
+                printf("Enter file system number (0 = non-encrypted, 1 = encrypted, 2 = compressed): ");
                 scanf("%d", &choice);
+                printf("Enter block size in bytes (0 = default %d, up to %d): ", BLOCKSIZE, MAX_BLOCKSIZE);
+                scanf("%d", &block_size);
                 if (mount_point == -1) {
                     printf("Failed to mount device.\n");
-                    log_transaction("Failed to mount device.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to mount device.");
                 } else {
                     int handle = open_root(mount_point);
                     printf("Device mounted at mount point %d.\n", mount_point);
-                    log_transaction("Device mounted successfully.");
-                    if (create_file_system(mount_point, choice) != -1) {
+                    emufs_log(EMUFS_LOG_INFO, "Device mounted successfully.");
+                    if (create_file_system(mount_point, choice, block_size) != -1) {
                         printf("File system created successfully.\n");
-                        log_transaction("File system created successfully.");
+                        emufs_log(EMUFS_LOG_INFO, "File system created successfully.");
                     } else {
                         printf("Failed to create file system.\n");
-                        log_transaction("Failed to create file system.");
+                        emufs_log(EMUFS_LOG_WARN, "Failed to create file system.");
                     }
                 }
                 break;
@@ -92,21 +77,21 @@ int main() {
                 mount_point = opendevice(device_name, MAX_BLOCKS);
                 if (mount_point == -1) {
                     printf("Failed to mount device.\n");
-                    log_transaction("Failed to mount device.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to mount device.");
                 } else {
                     int handle = open_root(mount_point);
                     printf("Device mounted at mount point %d.\n", mount_point);
-                    log_transaction("Device mounted successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "Device mounted successfully.");
                 }
                 break;
 
             case 3:
                 if (closedevice(mount_point) == -1) {
                     printf("Failed to unmount device.\n");
-                    log_transaction("Failed to unmount device.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to unmount device.");
                 } else {
                     printf("Device unmounted successfully.\n");
-                    log_transaction("Device unmounted successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "Device unmounted successfully.");
                     mount_point = -1;
                 }
                 break;
@@ -114,10 +99,10 @@ int main() {
             case 4:
                 if (mount_point != -1) {
                     fsdump(mount_point);
-                    log_transaction("File system metadata viewed.");
+                    emufs_log(EMUFS_LOG_INFO, "File system metadata viewed.");
                 } else {
                     printf("No disk mounted\n");
-                    log_transaction("Failed to view metadata: No disk mounted.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to view metadata: No disk mounted.");
                 }
                 break;
 
@@ -127,10 +112,10 @@ int main() {
                 path[strcspn(path, "\n")] = 0;  // Remove newline
                 if (change_dir(handle, path) == 1) {
                     printf("Directory changed successfully.\n");
-                    log_transaction("Directory changed successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "Directory changed successfully.");
                 } else {
                     printf("Failed to change directory.\n");
-                    log_transaction("Failed to change directory.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to change directory.");
                 }
                 break;
 
@@ -140,10 +125,10 @@ int main() {
                 path[strcspn(path, "\n")] = 0;  // Remove newline
                 if (emufs_create(handle, path, 1) == 1) {
                     printf("Directory created successfully.\n");
-                    log_transaction("Directory created successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "Directory created successfully.");
                 } else {
                     printf("Failed to create directory.\n");
-                    log_transaction("Failed to create directory.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to create directory.");
                 }
                 break;
 
@@ -153,10 +138,10 @@ int main() {
                 path[strcspn(path, "\n")] = 0;  // Remove newline
                 if (emufs_create(handle, path, 0) == 1) {
                     printf("File created successfully.\n");
-                    log_transaction("File created successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "File created successfully.");
                 } else {
                     printf("Failed to create file.\n");
-                    log_transaction("Failed to create file.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to create file.");
                 }
                 break;
 
@@ -166,10 +151,10 @@ int main() {
                 path[strcspn(path, "\n")] = 0;  // Remove newline
                 if (emufs_delete(handle, path) == 1) {
                     printf("File deleted successfully.\n");
-                    log_transaction("File deleted successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "File deleted successfully.");
                 } else {
                     printf("Failed to delete file.\n");
-                    log_transaction("Failed to delete file.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to delete file.");
                 }
                 break;
 
@@ -182,10 +167,10 @@ int main() {
                 scanf("%d", &size);
                 if (emufs_read(fileop, buffer, size) != -1) {
                     printf("Data read: %s\n", buffer);
-                    log_transaction("File read successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "File read successfully.");
                 } else {
                     printf("Failed to read file.\n");
-                    log_transaction("Failed to read file.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to read file.");
                 }
                 break;
 
@@ -199,22 +184,22 @@ int main() {
                 buffer[strcspn(buffer, "\n")] = 0;  // Remove newline
                 if (emufs_write(fileop, buffer, strlen(buffer)) != -1) {
                     printf("Data written successfully.\n");
-                    log_transaction("File written successfully.");
+                    emufs_log(EMUFS_LOG_INFO, "File written successfully.");
                 } else {
                     printf("Failed to write to file.\n");
-                    log_transaction("Failed to write to file.");
+                    emufs_log(EMUFS_LOG_WARN, "Failed to write to file.");
                 }
                 break;
 
             case 11:
-                log_transaction("File System Manager exited.");
-                fclose(log_file);
+                emufs_log(EMUFS_LOG_INFO, "File System Manager exited.");
+                emufs_log_close();
                 printf("Exiting File System Manager.\n");
                 return 0;
 
             default:
                 printf("Invalid choice. Please try again.\n");
-                log_transaction("Invalid choice entered.");
+                emufs_log(EMUFS_LOG_WARN, "Invalid choice entered.");
         }
     }
 }
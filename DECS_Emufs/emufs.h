@@ -12,16 +12,117 @@
 #define MAX_MOUNT_POINTS 10  // Maximum number of mount points supported
 #define MAX_ENTITY_NAME 8    // Maximum length of a file or directory name
 
+// Entry returned by emufs_readdir
+struct emufs_dirent_t
+{
+    char name[MAX_ENTITY_NAME + 1];  // Name of the file or directory (NUL-terminated)
+    int type;                        // 0 = file, 1 = directory
+    int size;                        // File size in bytes, or number of entries for a directory
+};
+
+// Record of one API call in an operation trace (see emufs_trace_start)
+struct emufs_trace_t
+{
+    unsigned char op;           // EMUFS_TRACE_*
+    char type;                  // Entity or handle type (0 = file, 1 = directory); fs_number for EMUFS_TRACE_MKFS
+    short mount_point;          // Mount the call worked on (-1 = unknown)
+    int handle;                 // Handle the call was made on (the mount point for mkfs and open_root)
+    int result;                 // Return value of the call
+    int offset;                 // File offset before the call (file handle calls)
+    int size;                   // Bytes read or written, seek distance, new size; block size for mkfs
+    int dst_handle;             // Destination file handle of copy_range
+    long long timestamp_ns;     // Start of the call, since the trace was started
+    long long latency_ns;       // Duration of the call
+    char path[32];              // Path or name argument (truncated, NUL-terminated); rename's target follows its NUL
+};
+
+// Traced calls
+#define EMUFS_TRACE_MKFS 1
+#define EMUFS_TRACE_OPEN_ROOT 2
+#define EMUFS_TRACE_CHANGE_DIR 3
+#define EMUFS_TRACE_OPEN_FILE 4
+#define EMUFS_TRACE_CREATE 5
+#define EMUFS_TRACE_DELETE 6
+#define EMUFS_TRACE_CLOSE 7
+#define EMUFS_TRACE_READ 8
+#define EMUFS_TRACE_WRITE 9
+#define EMUFS_TRACE_SEEK 10
+#define EMUFS_TRACE_SYNC 11
+#define EMUFS_TRACE_TRUNCATE 12
+#define EMUFS_TRACE_FALLOCATE 13
+#define EMUFS_TRACE_RENAME 14
+#define EMUFS_TRACE_COPY_RANGE 15
+
+// Device and metadata I/O of a mount (see emufs_stats)
+struct emufs_io_stats_t
+{
+    long block_reads;       // Blocks read from the device (cache misses and prefetched blocks)
+    long block_writes;      // Blocks written to the device
+    long cache_hits;        // Block reads served by the block cache
+    long cache_misses;      // Block reads that went to the device
+    long superblock_reads;
+    long superblock_writes;
+    long inode_reads;       // Single inodes and whole inode tables
+    long inode_writes;
+    long inode_allocs;
+    long inode_frees;
+    long block_allocs;      // Data blocks allocated
+    long block_frees;
+};
+
+// Latency histogram of a call. Buckets are log-linear like an HDR histogram: values below 8 ns
+// have a bucket each, then every power of two is split into 8 buckets (at most 12.5% apart).
+#define EMUFS_HIST_BUCKETS 304
+struct emufs_histogram_t
+{
+    long count;                     // Calls recorded
+    long long total_ns;
+    long long max_ns;
+    long device_ios;                // Blocks read and written by the calls, in total
+    long buckets[EMUFS_HIST_BUCKETS];
+};
+
+// Calls with a latency histogram
+#define EMUFS_STAT_READ 0
+#define EMUFS_STAT_WRITE 1
+#define EMUFS_STAT_OPEN_FILE 2
+#define EMUFS_STAT_CREATE 3
+#define EMUFS_STAT_DELETE 4
+#define EMUFS_STAT_CALLS 5
+
+// Statistics of a mount, kept from the time it was mounted
+struct emufs_stats_t
+{
+    struct emufs_io_stats_t io;
+    struct emufs_histogram_t calls[EMUFS_STAT_CALLS];   // Indexed by EMUFS_STAT_*
+};
+
 /*-----------DEVICE------------*/
 
 // Function to open a device
 // `device_name` specifies the name of the device, `size` is the size of the device.
-// Returns an integer representing the mount point of the device.
+// A name ending in "@snap" mounts the device's snapshot read-only.
+// A name starting with "mem:" is a RAM disk. "mem:" alone is discarded on unmount;
+// "mem:<path>" is loaded from the image at <path> if it exists and saved back to it on unmount.
+// A device can only be mounted once at a time (its snapshot can be mounted alongside).
+// Returns an integer representing the mount point of the device, or -1 on failure.
 int opendevice(char *device_name, int size);
 
+// Function to open a volume striped over several image files (RAID-0)
+// `member_names`/`count` are the image files (2 to 8) in stripe order, created if the volume is new.
+// `stripe_blocks` is the stripe unit in blocks (0 = 1, or what the existing volume uses), `size`
+// the size of a new volume in blocks. Returns the mount point of the volume, or -1 on failure.
+int openvolume(char **member_names, int count, int stripe_blocks, int size);
+
+// Function to set the encryption key used by opendevice, openvolume and create_file_system
+// Programs that cannot prompt (servers, scripts) set it before opening an encrypted device.
+// `key` is a positive key, 0 to prompt for the key again (the default), or negative to never
+// prompt (encrypted devices then fail to open).
+void emufs_set_key(int key);
+
 // Function to close a device
 // `mount_point` specifies the mount point to close.
-// Returns 0 on success or -1 on failure.
+// Returns 0 on success or -1 on failure (e.g., buffered appends that cannot be written: the device stays mounted).
 int closedevice(int mount_point);
 
 // Function to display information about currently mounted devices.
@@ -31,8 +132,26 @@ void mount_dump(void);
 
 // Function to create a file system on a specified mount point
 // `mount_point` specifies the mount point, and `fs_number` identifies the file system type.
-// Returns 0 on success or -1 on failure.
-int create_file_system(int mount_point, int fs_number);
+// `block_size` is the block size in bytes: a power of two from 256 to 65536 (0 = 256).
+// Files hold at most 4 blocks and 65535 bytes.
+// Returns 1 on success or -1 on failure.
+int create_file_system(int mount_point, int fs_number, int block_size);
+
+// Function to turn on block deduplication for the file system on a mount point
+// Identical full blocks written afterwards are stored once and shared copy-on-write.
+// Returns 1 on success or -1 on failure (no free block for the index, or a compressed file system).
+int enable_dedup(int mount_point);
+
+// Function to take a snapshot of the file system on a mount point
+// Freezes the inode table; data blocks are shared with the live file system and copied on write.
+// Only one snapshot exists at a time. Mount it read-only by opening "<device>@snap".
+// Returns 1 on success or -1 on failure.
+int emufs_snapshot(int mount_point);
+
+// Function to drop the snapshot of the file system on a mount point
+// Releases the snapshot's references to data blocks and its inode table blocks.
+// Returns 1 on success or -1 if there is no snapshot or it is mounted ("<device>@snap" must be closed first).
+int emufs_drop_snapshot(int mount_point);
 
 // Function to dump the file system's structure and metadata for debugging purposes
 // `mount_point` specifies the mount point to dump.
@@ -63,9 +182,38 @@ int emufs_create(int dir_handle, char* name, int type);
 // Returns 0 on success or -1 on failure.
 int emufs_delete(int dir_handle, char* path);
 
+// Function to create several entities in the current directory at once
+// `names` and `types` hold `count` names and types (0 = file, 1 = directory). All are created or none is;
+// the parent and the new inodes are stored with one inode table write.
+// Returns `count` on success or -1 on failure.
+int emufs_create_batch(int dir_handle, char** names, int* types, int count);
+
+// Function to delete several entities (files or directories, with their subtrees) at once
+// `paths` holds `count` paths relative to the current directory. All must exist or nothing is deleted;
+// the blocks and inodes are freed with one superblock update and the parents stored with one inode table write.
+// Returns `count` on success or -1 on failure.
+int emufs_delete_batch(int dir_handle, char** paths, int count);
+
+// Function to rename or move an entity (file or directory, with its subtree)
+// `from` is its path and `to` its new path, both relative to `dir_handle`. Only directory entries change:
+// the data stays where it is and open handles stay valid.
+// Returns 1 on success or -1 on failure (e.g., an entity of the same name and type at `to`, target directory full).
+int emufs_rename(int dir_handle, char* from, char* to);
+
+// Function to list a directory with the type and size of every entry
+// `dir_handle` specifies the current directory, `path` the directory to list (NULL or "" for the current one),
+// `entries` receives at most `max_entries` entries.
+// Returns the number of entries in the directory or -1 on failure.
+int emufs_readdir(int dir_handle, char* path, struct emufs_dirent_t* entries, int max_entries);
+
 // Function to close a file or directory handle
 // `handle` specifies the handle to close, `type` indicates whether it's a file or directory.
-void emufs_close(int handle, int type);
+// Returns 1 on success or -1 if the file's buffered appends cannot be written (the handle then stays open).
+int emufs_close(int handle, int type);
+
+// Function to close a file handle and drop its buffered appends, for a handle that emufs_close cannot close
+// The reserved blocks of the appends are freed; the file keeps what reached the disk before.
+void emufs_discard(int file_handle);
 
 // Function to read data from a file
 // `file_handle` specifies the file, `buf` is the buffer to store data, `size` is the number of bytes to read.
@@ -77,11 +225,64 @@ int emufs_read(int file_handle, char* buf, int size);
 // Returns the number of bytes written or -1 on failure.
 int emufs_write(int file_handle, char* buf, int size);
 
+// Function to flush a file handle's buffered appends to disk
+// Appends are buffered per handle, with their blocks allocated only when the buffer is flushed:
+// on this call, on close or unmount, or when a read, seek or overwrite needs the data on disk.
+// Returns 1 on success or -1 on failure.
+int emufs_sync(int file_handle);
+
 // Function to move the file pointer
 // `file_handle` specifies the file, `nseek` is the number of bytes to move the pointer.
+// The pointer may move past the end of the file; writing there leaves a hole that reads as zeros.
 // Returns the new pointer position or -1 on failure.
 int emufs_seek(int file_handle, int nseek);
 
+// Function to set the size of a file
+// Shrinking frees the blocks past the new end; growing adds a hole (no blocks, reads as zeros).
+// Returns 1 on success or -1 on failure.
+int emufs_truncate(int file_handle, int size);
+
+// Function to preallocate the blocks of a file
+// Allocates every missing block of the first `size` bytes in one allocator transaction, contiguously
+// when possible, and grows the file to `size` if it is smaller. Later writes in the range need no allocation.
+// Returns 1 on success or -1 on failure (e.g., not enough free blocks).
+int emufs_fallocate(int file_handle, int size);
+
+// Function to copy up to `size` bytes from the offset of `src_handle` to the offset of `dst_handle` inside
+// the file system (like copy_file_range); both offsets advance. On the same mount, whole blocks at matching
+// positions are shared (copy-on-write) instead of copied, except on compressed file systems.
+// Returns the number of bytes copied (less than `size` at the end of the source) or -1 on failure.
+int emufs_copy_range(int src_handle, int dst_handle, int size);
+
+/*-----------TRACING------------*/
+
+// Function to start recording the file system calls of this process to a binary trace file
+// Every call of the file system API above (create_file_system to emufs_copy_range, but not emufs_readdir)
+// appends a struct emufs_trace_t; the batch calls append one per entity.
+// Start the trace before the workload creates its files so that emufs_replay can re-run it on a fresh image.
+// Returns 1 on success or -1 if the file cannot be created.
+int emufs_trace_start(const char *path);
+
+// Function to stop recording and close the trace file
+void emufs_trace_stop(void);
+
+/*-----------STATISTICS------------*/
+
+// Function to copy the statistics of a mount into `stats`
+// Returns 1 on success or -1 if nothing is mounted there.
+int emufs_stats(int mount_point, struct emufs_stats_t *stats);
+
+// Function to clear the statistics of a mount
+void emufs_stats_reset(int mount_point);
+
+// Function to get the latency below which `percent` % of the calls of a histogram completed
+// The value is the upper bound of the bucket the percentile falls in (0 if the histogram is empty).
+long long emufs_histogram_percentile(const struct emufs_histogram_t *hist, double percent);
+
+// Function to print the statistics of a mount: I/O counters, then count, latency percentiles
+// and device I/Os per call of every call with a histogram
+void emufs_stats_dump(int mount_point, FILE *out);
+
 // Uncomment these if AES encryption or decryption is needed
 // void aes_encrypt_data(char* buf, int size, unsigned char* key); // Encrypt data using AES
 // void aes_decrypt_data(char* buf, int size, unsigned char* key); // Decrypt data using AES
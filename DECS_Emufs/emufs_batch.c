@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emufs.h"
+#include "emufs_disk.h"
+
+/*
+	* Non-interactive driver: executes a script of file system commands, one per line,
+	* from a file or stdin, without prompting.
+	*
+	* Usage: emufs_batch [-k key] [-t] [-q] [-e] [-T trace] [-S spans] [script]
+	*   -k key   key for encrypted devices (else $EMUFS_KEY; without a key they fail to open)
+	*   -t       print the time every command took (the average for a repeated one)
+	*   -q       silence the file system's own messages
+	*   -e       stop at the first failing command
+	*   -T trace record the file system calls of the script (see emufs_replay)
+	*   -S spans write the spans of the script's calls as Chrome trace JSON (needs -DEMUFS_SPANS)
+	*
+	* Commands (paths are relative to the current directory):
+	*   mkfs <device> <fs_number> [block size] [blocks]   create and mount a device with a file system
+	*   mount <device>                                     mount an existing device
+	*   umount                                             unmount the current device
+	*   cd <path>            mkdir <name>...         create <name>...         delete <path>...
+	*   write <path> <text>  fill <path> <bytes>     read <path> [bytes]      ls [path]
+	*   dump                 stats [reset]           repeat <count> <command>
+	*   move <path> <path>   copy <path> <path>
+	* mkdir, create and delete with several names make one batch call (emufs_create_batch, emufs_delete_batch).
+	* Lines starting with '#' are comments.
+*/
+
+#define MAX_LINE_LENGTH 1024
+
+static FILE *out;               // Results (stdout, or the original stdout with -q)
+static int timing = 0;
+static int mount_point = -1;    // Current device
+static int handle = -1;         // Current directory
+static int have_key = 0;
+static char data[MAX_FILE_BYTES + 1];
+
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int unmount(void)
+{
+	if(mount_point == -1)
+		return 1;
+	emufs_close(handle, 1);
+	int ret = closedevice(mount_point);
+	mount_point = handle = -1;
+	return ret;
+}
+
+static int mount(char *device, int size)
+{
+	unmount();
+	mount_point = opendevice(device, size);
+	return mount_point;
+}
+
+static int file_op(char *path, int write, char *buf, int size)
+{
+	// Opens the file, transfers `size` bytes from its start and closes it again
+	int file = open_file(handle, path);
+	if(file == -1)
+		return -1;
+	int ret = write ? emufs_write(file, buf, size) : emufs_read(file, buf, size);
+	if(emufs_close(file, 0) == -1)
+		ret = -1;
+	return ret;
+}
+
+static int execute(char **argv, int argc)
+{
+	/*
+		* Executes one command
+
+		* Return value: -1, the command failed
+						 1, success
+	*/
+
+	char *cmd = argv[0];
+
+	if(strcmp(cmd, "mkfs") == 0 && argc >= 3)
+	{
+		int fs_number = atoi(argv[2]);
+		if(fs_number == EMUFS_ENCRYPTED && !have_key)
+		{
+			fprintf(out, "mkfs: an encrypted file system needs a key (-k or EMUFS_KEY)\n");
+			return -1;
+		}
+		if(mount(argv[1], argc > 4 ? atoi(argv[4]) : MAX_BLOCKS) == -1)
+			return -1;
+		if(create_file_system(mount_point, fs_number, argc > 3 ? atoi(argv[3]) : 0) == -1)
+			return -1;
+		handle = open_root(mount_point);
+		return handle == -1 ? -1 : 1;
+	}
+	if(strcmp(cmd, "mount") == 0 && argc == 2)
+	{
+		if(mount(argv[1], MAX_BLOCKS) == -1)
+			return -1;
+		handle = open_root(mount_point);
+		return handle == -1 ? -1 : 1;
+	}
+	if(strcmp(cmd, "umount") == 0)
+		return unmount();
+	if(strcmp(cmd, "dump") == 0 && mount_point != -1)
+	{
+		fsdump(mount_point);
+		return 1;
+	}
+	if(strcmp(cmd, "stats") == 0 && mount_point != -1)
+	{
+		// I/O counters and call latencies of the current device since it was mounted (or reset)
+		if(argc == 2 && strcmp(argv[1], "reset") == 0)
+			emufs_stats_reset(mount_point);
+		else
+			emufs_stats_dump(mount_point, out);
+		return 1;
+	}
+
+	// The remaining commands work in the current directory
+	if(handle == -1)
+	{
+		fprintf(out, "%s: no device mounted\n", cmd);
+		return -1;
+	}
+
+	if(strcmp(cmd, "cd") == 0 && argc == 2)
+		return change_dir(handle, argv[1]);
+	if(strcmp(cmd, "mkdir") == 0 && argc == 2)
+		return emufs_create(handle, argv[1], 1);
+	if(strcmp(cmd, "create") == 0 && argc == 2)
+		return emufs_create(handle, argv[1], 0);
+	if(strcmp(cmd, "delete") == 0 && argc == 2)
+		return emufs_delete(handle, argv[1]);
+	if((strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "create") == 0) && argc > 2)
+	{
+		// Several names: one batch call
+		int types[MAX_INODES];
+		for(int i=1; i<argc; i++)
+			types[i - 1] = cmd[0] == 'm';
+		return emufs_create_batch(handle, argv + 1, types, argc - 1);
+	}
+	if(strcmp(cmd, "delete") == 0 && argc > 2)
+		return emufs_delete_batch(handle, argv + 1, argc - 1);
+	if(strcmp(cmd, "move") == 0 && argc == 3)
+		return emufs_rename(handle, argv[1], argv[2]);
+	if(strcmp(cmd, "copy") == 0 && argc == 3)
+	{
+		// Replaces the content of the target (created in the current directory if missing) inside the file system;
+		// it is cut to the copied size afterwards, so a file copied onto itself stays intact
+		int src = open_file(handle, argv[1]);
+		if(src == -1)
+			return -1;
+		int dst = open_file(handle, argv[2]);
+		if(dst == -1 && !strchr(argv[2], '/') && emufs_create(handle, argv[2], 0) != -1)
+			dst = open_file(handle, argv[2]);
+		int ret = dst == -1 ? -1 : emufs_copy_range(src, dst, MAX_FILE_BYTES);
+		if(ret != -1 && emufs_truncate(dst, ret) == -1)
+			ret = -1;
+		emufs_close(src, 0);
+		if(dst != -1 && emufs_close(dst, 0) == -1)
+			ret = -1;
+		return ret;
+	}
+	if(strcmp(cmd, "write") == 0 && argc == 3)
+		return file_op(argv[1], 1, argv[2], strlen(argv[2]));
+	if(strcmp(cmd, "fill") == 0 && argc == 3)
+	{
+		int size = atoi(argv[2]);
+		if(size < 0 || size > MAX_FILE_BYTES)
+			return -1;
+		for(int i=0; i<size; i++)
+			data[i] = 'a' + i % 26;
+		return file_op(argv[1], 1, data, size);
+	}
+	if(strcmp(cmd, "read") == 0 && (argc == 2 || argc == 3))
+	{
+		int size = argc == 3 ? atoi(argv[2]) : -1;
+		if(size == -1)
+		{
+			// Whole file: its size comes from the parent's listing
+			struct emufs_dirent_t entries[MAX_INODES];
+			char *name = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+			char parent[MAX_LINE_LENGTH];
+			snprintf(parent, sizeof(parent), "%.*s", (int)(name - argv[1]), argv[1]);
+			int n = emufs_readdir(handle, parent, entries, MAX_INODES);
+			for(int i=0; i<n && i<MAX_INODES; i++)
+				if(entries[i].type == 0 && strcmp(entries[i].name, name) == 0)
+					size = entries[i].size;
+		}
+		if(size < 0 || size > MAX_FILE_BYTES || file_op(argv[1], 0, data, size) == -1)
+			return -1;
+		fprintf(out, "%.*s\n", size, data);
+		return 1;
+	}
+	if(strcmp(cmd, "ls") == 0 && argc <= 2)
+	{
+		struct emufs_dirent_t entries[MAX_INODES];
+		int n = emufs_readdir(handle, argc == 2 ? argv[1] : NULL, entries, MAX_INODES);
+		for(int i=0; i<n && i<MAX_INODES; i++)
+			fprintf(out, "%-8s %s %6d\n", entries[i].name, entries[i].type ? "dir " : "file", entries[i].size);
+		return n == -1 ? -1 : 1;
+	}
+
+	fprintf(out, "%s: unknown command or wrong arguments\n", cmd);
+	return -1;
+}
+
+static int split(char *line, char **argv, int max)
+{
+	// Splits on blanks; the last argument of "write" keeps its blanks (it is the text)
+	int argc = 0;
+	char *p = line;
+	while(argc < max)
+	{
+		while(*p == ' ' || *p == '\t')
+			p++;
+		if(!*p)
+			break;
+		argv[argc++] = p;
+		if(argc == 3 && strcmp(argv[0], "write") == 0)
+			break;
+		while(*p && *p != ' ' && *p != '\t')
+			p++;
+		if(*p)
+			*p++ = 0;
+	}
+	return argc;
+}
+
+int main(int argc, char **argv)
+{
+	char line[MAX_LINE_LENGTH];
+	FILE *script = stdin;
+	int stop_on_error = 0, quiet = 0, failures = 0, lineno = 0;
+	int key = getenv("EMUFS_KEY") ? atoi(getenv("EMUFS_KEY")) : 0;
+	char *spans = NULL;
+
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			key = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-t") == 0)
+			timing = 1;
+		else if(strcmp(argv[i], "-q") == 0)
+			quiet = 1;
+		else if(strcmp(argv[i], "-e") == 0)
+			stop_on_error = 1;
+		else if(strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+		{
+			if(emufs_trace_start(argv[++i]) == -1)
+			{
+				perror(argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+		{
+			spans = argv[++i];
+			if(emufs_span_start() == -1)
+			{
+				fprintf(stderr, "Spans are not compiled in (build with -DEMUFS_SPANS)\n");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(argv[i][0] != '-' && script == stdin)
+		{
+			script = fopen(argv[i], "r");
+			if(!script)
+			{
+				perror(argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-k key] [-t] [-q] [-e] [-T trace] [-S spans] [script]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Never prompt: without a key, encrypted devices fail to open
+	have_key = key > 0;
+	emufs_set_key(have_key ? key : -1);
+
+	out = stdout;
+	if(quiet)
+	{
+		out = fdopen(dup(fileno(stdout)), "w");
+		if(!out || !freopen("/dev/null", "w", stdout))
+			return EXIT_FAILURE;
+	}
+
+	while(fgets(line, sizeof(line), script))
+	{
+		char *args[8];
+		int count = 1;
+
+		lineno++;
+		line[strcspn(line, "\r\n")] = 0;
+
+		// "repeat <count> <command>" runs the command count times
+		char *cmdline = line + strspn(line, " \t");
+		if(strncmp(cmdline, "repeat", 6) == 0 && (cmdline[6] == ' ' || cmdline[6] == '\t'))
+			count = strtol(cmdline + 6, &cmdline, 10);
+
+		int n = split(cmdline, args, 8);
+		if(n == 0 || args[0][0] == '#')
+			continue;
+
+		double start = now_us();
+		int ok = 0;
+		for(int i=0; i<count; i++)
+			ok += execute(args, n) != -1;
+		double elapsed = now_us() - start;
+
+		if(timing)
+			fprintf(out, "[%10.1f us] ", elapsed / (count > 0 ? count : 1));
+		if(ok != count)
+			fprintf(out, "line %d: %s FAILED (%d of %d)\n", lineno, args[0], count - ok, count);
+		else if(timing)
+			fprintf(out, "line %d: %s ok\n", lineno, args[0]);
+		fflush(out);
+
+		if(ok != count)
+		{
+			failures++;
+			if(stop_on_error)
+				break;
+		}
+	}
+
+	unmount();
+	emufs_trace_stop();
+	if(spans)
+	{
+		emufs_span_stop();
+		if(emufs_span_write(spans) == -1)
+			perror(spans);
+	}
+	if(script != stdin)
+		fclose(script);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
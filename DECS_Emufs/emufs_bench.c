@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emufs.h"
+#include "emufs_disk.h"
+
+/*
+	* Microbenchmarks of the EMUFS layers: block I/O, allocator, path lookup and file I/O,
+	* for every file system type and block size. Results are written as JSON, one object
+	* per benchmark with ops/s, MB/s and latency percentiles in nanoseconds.
+	*
+	* Usage: emufs_bench [-n ops] [-b block size]... [-m] [-o file]
+	*   -n ops   operations timed per benchmark (default 2000)
+	*   -b size  block size to test (repeatable; default 256 and 4096)
+	*   -m       run on a RAM disk instead of an image file, to leave the host file system out
+	*   -o file  write the JSON there instead of stdout
+*/
+
+#define BENCH_KEY 7                 // Key of the encrypted file systems
+#define BENCH_IMAGE "bench.img"
+#define MAX_BENCH_SIZES 8
+
+// Path resolution, from emufs_ops.c (not part of the public API)
+int return_inode(int mount_point, int inodenum, char* path);
+
+static FILE *out;
+static int first_result = 1;
+static int ops = 2000;
+static char *device = BENCH_IMAGE;
+static double *lat;                 // Latency of every operation of the current benchmark (ns)
+static char buf[MAX_FILE_BYTES + 1];
+
+
+/*-----------MEASUREMENT------------*/
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, int fs_number, int block_size, int param, int n, long bytes_per_op)
+{
+	/*
+		* Writes the result of a benchmark from the latencies in lat[0..n)
+		* `param` is the benchmark's parameter (transfer size, path depth; 0 = none)
+	*/
+
+	double total = 0;
+	for(int i=0; i<n; i++)
+		total += lat[i];
+	qsort(lat, n, sizeof(double), cmp_double);
+
+	double secs = total / 1e9;
+	fprintf(out, "%s\n  {\"name\": \"%s\", \"fs_number\": %d, \"block_size\": %d, \"param\": %d, \"ops\": %d, "
+			"\"ops_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+			"\"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f}",
+			first_result ? "" : ",", name, fs_number, block_size, param, n,
+			secs > 0 ? n / secs : 0, secs > 0 ? (double)bytes_per_op * n / secs / 1e6 : 0,
+			lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100], lat[n - 1]);
+	first_result = 0;
+	fflush(out);
+}
+
+static int setup(int fs_number, int block_size)
+{
+	// A fresh device with an empty file system; returns its mount point
+	if(strcmp(device, BENCH_IMAGE) == 0)
+		unlink(BENCH_IMAGE);
+	int mp = opendevice(device, MAX_BLOCKS);
+	if(mp == -1 || create_file_system(mp, fs_number, block_size) == -1)
+	{
+		fprintf(stderr, "Failed to create the benchmark file system (fs %d, block size %d)\n", fs_number, block_size);
+		exit(EXIT_FAILURE);
+	}
+	return mp;
+}
+
+
+/*-----------BENCHMARKS------------*/
+static void bench_blocks(int block_size)
+{
+	// Raw block I/O on the device, cycling over its blocks (no cache, no file system)
+	int mp = setup(EMUFS_NON_ENCRYPTED, block_size);
+	int fd = mounts[mp].device_fd;
+	int disk = MAX_BLOCKS;
+
+	if(mounts[mp].mem)
+	{
+		// readblock/writeblock work on a host file; a RAM disk has no such layer
+		closedevice(mp);
+		return;
+	}
+	memset(buf, 'x', block_size);
+	for(int i=0; i<ops; i++)
+	{
+		double t = now_ns();
+		writeblock(fd, i % disk, block_size, buf);
+		lat[i] = now_ns() - t;
+	}
+	report("writeblock", -1, block_size, 0, ops, block_size);
+	for(int i=0; i<ops; i++)
+	{
+		double t = now_ns();
+		readblock(fd, i % disk, block_size, buf);
+		lat[i] = now_ns() - t;
+	}
+	report("readblock", -1, block_size, 0, ops, block_size);
+	closedevice(mp);
+}
+
+static void bench_alloc(int mp, int fs_number, int block_size)
+{
+	// Allocation churn: every operation allocates and frees one object
+	for(int i=0; i<ops; i++)
+	{
+		double t = now_ns();
+		int b = alloc_datablock(mp);
+		free_datablock(mp, b);
+		lat[i] = now_ns() - t;
+	}
+	report("alloc_datablock", fs_number, block_size, 0, ops, 0);
+	for(int i=0; i<ops; i++)
+	{
+		double t = now_ns();
+		int inodenum = alloc_inode(mp);
+		free_inode(mp, inodenum);
+		lat[i] = now_ns() - t;
+	}
+	report("alloc_inode", fs_number, block_size, 0, ops, 0);
+}
+
+static void bench_lookup(int mp, int fs_number, int block_size)
+{
+	// Resolution of "d/d/.../f" for growing depths
+	int handle = open_root(mp);
+	char path[64] = "";
+	int depth = 0;
+
+	for(int target = 1; target <= 8; target *= 2)
+	{
+		for(; depth < target; depth++)
+		{
+			if(emufs_create(handle, "d", 1) == -1 || change_dir(handle, "d") == -1)
+				return;
+			strcat(path, "d/");
+		}
+		emufs_create(handle, "f", 0);
+
+		char full[sizeof(path) + 2];
+		snprintf(full, sizeof(full), "/%sf", path);
+		for(int i=0; i<ops; i++)
+		{
+			double t = now_ns();
+			int inodenum = return_inode(mp, 0, full);
+			lat[i] = now_ns() - t;
+			if(inodenum == -1)
+				return;
+		}
+		report("return_inode", fs_number, block_size, depth, ops, 0);
+	}
+	emufs_close(handle, 1);
+}
+
+static void bench_file_io(int mp, int fs_number, int block_size)
+{
+	// Whole transfers from the start of a file, for growing transfer sizes
+	int handle = open_root(mp);
+	int sizes[] = {16, 256, 4096, mounts[mp].max_file_size};
+
+	emufs_create(handle, "io", 0);
+	int file = open_file(handle, "io");
+	for(int i=0; i<(int)sizeof(buf); i++)
+		buf[i] = 'a' + i % 26;
+
+	for(int s=0, last = 0; s<4; s++)
+	{
+		int size = sizes[s] < mounts[mp].max_file_size ? sizes[s] : mounts[mp].max_file_size;
+		if(size == last)
+			continue;
+		last = size;
+
+		// A write is timed until it is on the device (appends are otherwise only buffered)
+		for(int i=0; i<ops; i++)
+		{
+			double t = now_ns();
+			emufs_write(file, buf, size);
+			emufs_sync(file);
+			lat[i] = now_ns() - t;
+			emufs_seek(file, -size);
+		}
+		report("emufs_write", fs_number, block_size, size, ops, size);
+
+		for(int i=0; i<ops; i++)
+		{
+			double t = now_ns();
+			emufs_read(file, buf, size);
+			lat[i] = now_ns() - t;
+			emufs_seek(file, -size);
+		}
+		report("emufs_read", fs_number, block_size, size, ops, size);
+	}
+	emufs_close(file, 0);
+	emufs_close(handle, 1);
+}
+
+
+int main(int argc, char **argv)
+{
+	int sizes[MAX_BENCH_SIZES], nsizes = 0;
+	char *output = NULL;
+
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			ops = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc && nsizes < MAX_BENCH_SIZES)
+			sizes[nsizes++] = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-m") == 0)
+			device = MEM_PREFIX;
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			output = argv[++i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [-n ops] [-b block size]... [-m] [-o file]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(ops < 1)
+		ops = 1;
+	if(nsizes == 0)
+	{
+		sizes[nsizes++] = BLOCKSIZE;
+		sizes[nsizes++] = 4096;
+	}
+
+	// The file system's messages would drown the results
+	out = output ? fopen(output, "w") : fdopen(dup(fileno(stdout)), "w");
+	lat = (double*)malloc(ops * sizeof(double));
+	if(!out || !lat || !freopen("/dev/null", "w", stdout))
+		return EXIT_FAILURE;
+	emufs_set_key(BENCH_KEY);
+
+	fprintf(out, "[");
+	for(int b=0; b<nsizes; b++)
+	{
+		bench_blocks(sizes[b]);
+		for(int fs_number = EMUFS_NON_ENCRYPTED; fs_number <= EMUFS_COMPRESSED; fs_number++)
+		{
+			int mp = setup(fs_number, sizes[b]);
+			bench_alloc(mp, fs_number, sizes[b]);
+			bench_lookup(mp, fs_number, sizes[b]);
+			closedevice(mp);
+
+			mp = setup(fs_number, sizes[b]);
+			bench_file_io(mp, fs_number, sizes[b]);
+			closedevice(mp);
+		}
+	}
+	fprintf(out, "\n]\n");
+
+	if(strcmp(device, BENCH_IMAGE) == 0)
+		unlink(BENCH_IMAGE);
+	fclose(out);
+	free(lat);
+	return 0;
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE             // memfd_create()
+#include "emufs_client.h"
+#include <sys/mman.h>           // mmap and memfd_create, for the shared data buffer
+
+
+/*-----------CONNECTION------------*/
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if(n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int read_all(int fd, char *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = read(fd, buf, len);
+		if(n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+struct emufs_client_t* emufs_client_connect(const char *path)
+{
+	/*
+		* Connects to the server's Unix domain socket
+
+		* Return value: NULL,			error
+						 connection,	success
+	*/
+
+	struct sockaddr_un addr;
+	struct emufs_client_t *client;
+
+	if(!path)
+		path = EMUFS_SOCKET;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+
+	client = (struct emufs_client_t*)calloc(1, sizeof(struct emufs_client_t));
+	if(!client)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(client->fd == -1 || connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		printf("Error: Server at %s NOT reachable \n", path);
+		if(client->fd != -1)
+			close(client->fd);
+		free(client);
+		return NULL;
+	}
+	return client;
+}
+
+void emufs_client_close(struct emufs_client_t *client)
+{
+	if(!client)
+		return;
+	close(client->fd);
+	if(client->shm)
+		munmap(client->shm, EMUFS_SHM_SIZE);
+	free(client);
+}
+
+int emufs_client_attach_shm(struct emufs_client_t *client)
+{
+	/*
+		* Creates the shared data buffer and passes its descriptor to the server
+		* along with an EMUFS_REQ_ATTACH_SHM request
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct emufs_msg_t msg;
+	struct msghdr mh;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	int fd;
+
+	if(client->shm)
+		return 1;
+	if(emufs_client_flush(client) == -1)
+		return -1;
+
+	fd = memfd_create("emufs-shm", 0);
+	if(fd == -1 || ftruncate(fd, EMUFS_SHM_SIZE) == -1)
+	{
+		if(fd != -1)
+			close(fd);
+		return -1;
+	}
+	client->shm = mmap(NULL, EMUFS_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(client->shm == MAP_FAILED)
+	{
+		client->shm = NULL;
+		close(fd);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = EMUFS_REQ_ATTACH_SHM;
+	msg.id = client->next_id++;
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	// The server keeps its own reference to the memory
+	int sent = sendmsg(client->fd, &mh, 0) == sizeof(msg);
+	close(fd);
+	if(!sent)
+		return -1;
+	client->pending++;
+	return emufs_client_reply(client, &msg, NULL, 0);
+}
+
+
+/*-----------REQUESTS------------*/
+int emufs_client_queue(struct emufs_client_t *client, int op, int a0, int a1, int a2, const char *payload, int len)
+{
+	/*
+		* Appends the request to the connection's queue; a full queue is sent first
+
+		* Return value: -1,			error
+						 request id,	success
+	*/
+
+	struct emufs_msg_t msg;
+
+	if(len < 0 || len > 256)
+		return -1;
+	if(client->queued == EMUFS_CLIENT_QUEUE && emufs_client_flush(client) == -1)
+		return -1;
+
+	msg.op = op;
+	msg.id = client->next_id++;
+	msg.args[0] = a0;
+	msg.args[1] = a1;
+	msg.args[2] = a2;
+	msg.len = len;
+	memcpy(client->out + client->out_len, &msg, sizeof(msg));
+	client->out_len += sizeof(msg);
+	if(len)
+		memcpy(client->out + client->out_len, payload, len);
+	client->out_len += len;
+	client->queued++;
+	return msg.id;
+}
+
+int emufs_client_flush(struct emufs_client_t *client)
+{
+	/*
+		* Sends every queued request with a single write
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	if(client->queued == 0)
+		return 1;
+	if(write_all(client->fd, client->out, client->out_len) == -1)
+		return -1;
+	client->pending += client->queued;
+	client->queued = 0;
+	client->out_len = 0;
+	return 1;
+}
+
+static int next_reply(struct emufs_client_t *client, struct emufs_msg_t *reply, char *buf, int cap)
+{
+	/*
+		* Reads the next reply. Payload beyond `cap` is read and dropped.
+
+		* Return value: -1, connection failed
+						 1, success
+	*/
+
+	char discard[256];
+	int left;
+
+	if(client->pending == 0 && emufs_client_flush(client) == -1)
+		return -1;
+	if(client->pending == 0 || read_all(client->fd, (char*)reply, sizeof(*reply)) == -1)
+		return -1;
+	client->pending--;
+
+	left = reply->len;
+	if(buf && cap > 0)
+	{
+		int n = left < cap ? left : cap;
+		if(read_all(client->fd, buf, n) == -1)
+			return -1;
+		left -= n;
+	}
+	while(left > 0)
+	{
+		int n = left < (int)sizeof(discard) ? left : (int)sizeof(discard);
+		if(read_all(client->fd, discard, n) == -1)
+			return -1;
+		left -= n;
+	}
+	return 1;
+}
+
+int emufs_client_reply(struct emufs_client_t *client, struct emufs_msg_t *reply, char *buf, int cap)
+{
+	if(next_reply(client, reply, buf, cap) == -1)
+		return -1;
+	return reply->args[0];
+}
+
+int emufs_client_call(struct emufs_client_t *client, int op, int a0, int a1, int a2, const char *payload, int len, char *buf, int cap)
+{
+	/*
+		* Executes one request synchronously
+		* Replies of earlier pipelined requests are skipped
+
+		* Return value: -1,			error
+						 args[0],		the call's return value
+	*/
+
+	struct emufs_msg_t msg;
+
+	if(len < 0 || len > EMUFS_MAX_PAYLOAD || emufs_client_flush(client) == -1)
+		return -1;
+	while(client->pending > 0)
+		if(next_reply(client, &msg, NULL, 0) == -1)
+			return -1;
+
+	// Header and payload go out in one write
+	char *out = (char*)malloc(sizeof(msg) + len);
+	if(!out)
+		return -1;
+	msg.op = op;
+	msg.id = client->next_id++;
+	msg.args[0] = a0;
+	msg.args[1] = a1;
+	msg.args[2] = a2;
+	msg.len = len;
+	memcpy(out, &msg, sizeof(msg));
+	if(len)
+		memcpy(out + sizeof(msg), payload, len);
+	int ret = write_all(client->fd, out, sizeof(msg) + len);
+	free(out);
+	if(ret == -1)
+		return -1;
+	client->pending++;
+
+	return emufs_client_reply(client, &msg, buf, cap);
+}
+
+
+/*-----------FILE SYSTEM API------------*/
+static int path_len(const char *path)
+{
+	// Paths travel with their terminating NUL
+	return path ? strlen(path) + 1 : 0;
+}
+
+int emufsc_opendevice(struct emufs_client_t *client, char *device_name, int size, int key)
+{
+	return emufs_client_call(client, EMUFS_REQ_OPEN_DEVICE, size, key, 0, device_name, path_len(device_name), NULL, 0);
+}
+
+int emufsc_closedevice(struct emufs_client_t *client, int mount_point)
+{
+	return emufs_client_call(client, EMUFS_REQ_CLOSE_DEVICE, mount_point, 0, 0, NULL, 0, NULL, 0);
+}
+
+int emufsc_create_file_system(struct emufs_client_t *client, int mount_point, int fs_number, int block_size)
+{
+	return emufs_client_call(client, EMUFS_REQ_MKFS, mount_point, fs_number, block_size, NULL, 0, NULL, 0);
+}
+
+int emufsc_open_root(struct emufs_client_t *client, int mount_point)
+{
+	return emufs_client_call(client, EMUFS_REQ_OPEN_ROOT, mount_point, 0, 0, NULL, 0, NULL, 0);
+}
+
+int emufsc_change_dir(struct emufs_client_t *client, int dir_handle, char *path)
+{
+	return emufs_client_call(client, EMUFS_REQ_CHANGE_DIR, dir_handle, 0, 0, path, path_len(path), NULL, 0);
+}
+
+int emufsc_open_file(struct emufs_client_t *client, int dir_handle, char *path)
+{
+	return emufs_client_call(client, EMUFS_REQ_OPEN_FILE, dir_handle, 0, 0, path, path_len(path), NULL, 0);
+}
+
+int emufsc_create(struct emufs_client_t *client, int dir_handle, char *name, int type)
+{
+	return emufs_client_call(client, EMUFS_REQ_CREATE, dir_handle, type, 0, name, path_len(name), NULL, 0);
+}
+
+int emufsc_delete(struct emufs_client_t *client, int dir_handle, char *path)
+{
+	return emufs_client_call(client, EMUFS_REQ_DELETE, dir_handle, 0, 0, path, path_len(path), NULL, 0);
+}
+
+void emufsc_close(struct emufs_client_t *client, int handle, int type)
+{
+	emufs_client_call(client, EMUFS_REQ_CLOSE, handle, type, 0, NULL, 0, NULL, 0);
+}
+
+int emufsc_read(struct emufs_client_t *client, int file_handle, char *buf, int size)
+{
+	// With a shared buffer the server copies the data there instead of into the reply
+	if(client->shm && size > 0 && size <= EMUFS_SHM_SIZE)
+	{
+		int ret = emufs_client_call(client, EMUFS_REQ_READ, file_handle, size, 0, NULL, 0, NULL, 0);
+		if(ret != -1)
+			memcpy(buf, client->shm, size);
+		return ret;
+	}
+	return emufs_client_call(client, EMUFS_REQ_READ, file_handle, size, -1, NULL, 0, buf, size);
+}
+
+int emufsc_write(struct emufs_client_t *client, int file_handle, char *buf, int size)
+{
+	if(client->shm && size > 0 && size <= EMUFS_SHM_SIZE)
+	{
+		memcpy(client->shm, buf, size);
+		return emufs_client_call(client, EMUFS_REQ_WRITE, file_handle, size, 0, NULL, 0, NULL, 0);
+	}
+	return emufs_client_call(client, EMUFS_REQ_WRITE, file_handle, size, -1, buf, size, NULL, 0);
+}
+
+int emufsc_seek(struct emufs_client_t *client, int file_handle, int nseek)
+{
+	return emufs_client_call(client, EMUFS_REQ_SEEK, file_handle, nseek, 0, NULL, 0, NULL, 0);
+}
+
+int emufsc_sync(struct emufs_client_t *client, int file_handle)
+{
+	return emufs_client_call(client, EMUFS_REQ_SYNC, file_handle, 0, 0, NULL, 0, NULL, 0);
+}
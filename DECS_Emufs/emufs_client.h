@@ -0,0 +1,102 @@
+#include <stdio.h>      // Standard I/O functions
+#include <stdlib.h>     // General utility functions
+#include <string.h>     // String manipulation functions
+#include <unistd.h>     // POSIX API for system calls like read, write, etc.
+#include <sys/types.h>  // Data types used in system calls
+#include <sys/socket.h> // Unix domain sockets and descriptor passing
+#include <sys/un.h>     // struct sockaddr_un
+
+#define EMUFS_SOCKET "emufs.sock"   // Default path of the server's socket
+#define EMUFS_MAX_PAYLOAD 65536     // Largest payload of a message (a whole file fits)
+#define EMUFS_SHM_SIZE (4 * EMUFS_MAX_PAYLOAD)  // Size of a client's shared data buffer
+#define EMUFS_CLIENT_QUEUE 64       // Requests a client can queue before it must flush
+
+/* ------------------- Protocol ------------------- */
+
+// Operations. A reply carries the operation of its request.
+#define EMUFS_REQ_OPEN_DEVICE 1     // payload: device name; args: size, key (0 = none) -> mount point
+#define EMUFS_REQ_CLOSE_DEVICE 2    // args: mount point
+#define EMUFS_REQ_MKFS 3            // args: mount point, fs_number, block size
+#define EMUFS_REQ_OPEN_ROOT 4       // args: mount point -> directory handle
+#define EMUFS_REQ_CHANGE_DIR 5      // args: directory handle; payload: path
+#define EMUFS_REQ_OPEN_FILE 6       // args: directory handle; payload: path -> file handle
+#define EMUFS_REQ_CREATE 7          // args: directory handle, type; payload: name
+#define EMUFS_REQ_DELETE 8          // args: directory handle; payload: path
+#define EMUFS_REQ_CLOSE 9           // args: handle, type (0 = file, 1 = directory)
+#define EMUFS_REQ_READ 10           // args: file handle, size, shared buffer offset (-1 = data in the reply)
+#define EMUFS_REQ_WRITE 11          // args: file handle, size, shared buffer offset (-1 = data in the payload)
+#define EMUFS_REQ_SEEK 12           // args: file handle, offset
+#define EMUFS_REQ_SYNC 13           // args: file handle
+#define EMUFS_REQ_ATTACH_SHM 14     // the shared buffer's descriptor is passed along (SCM_RIGHTS)
+
+// Header of every request and reply; `len` bytes of payload follow it
+// Requests on a connection are executed in order and answered in order, so a client
+// may send many of them before reading the replies (pipelining)
+struct emufs_msg_t
+{
+    int op;         // EMUFS_REQ_*
+    int id;         // Chosen by the client, echoed in the reply
+    int args[3];    // Arguments of a request; args[0] of a reply is the call's return value
+    int len;        // Bytes of payload after the header
+};
+
+/* ------------------- Client ------------------- */
+
+// Structure to represent a connection to the server
+struct emufs_client_t
+{
+    int fd;                     // Connected socket
+    int next_id;                // Id of the next request
+    int queued;                 // Requests written to `out` and not sent yet
+    int pending;                // Requests sent whose replies have not been read
+    char *shm;                  // Shared data buffer (NULL until emufs_client_attach_shm)
+    size_t out_len;             // Bytes in `out`
+    char out[EMUFS_CLIENT_QUEUE * (sizeof(struct emufs_msg_t) + 256)];  // Queued requests
+};
+
+// Function to connect to a server
+// `path` is the server's socket (NULL = EMUFS_SOCKET). Returns the connection or NULL on failure
+struct emufs_client_t* emufs_client_connect(const char *path);
+
+// Function to close a connection; the server closes the handles it opened
+void emufs_client_close(struct emufs_client_t *client);
+
+// Function to create a shared data buffer of EMUFS_SHM_SIZE bytes and pass it to the server
+// Reads and writes given an offset in it then move their data through memory instead of the socket
+// Returns 1 on success or -1 on failure
+int emufs_client_attach_shm(struct emufs_client_t *client);
+
+// Function to queue a request without waiting for it (pipelining)
+// `payload`/`len` is the request's payload (at most 256 bytes; larger data goes through
+// the shared buffer or emufs_client_call). Queued requests are sent together by emufs_client_flush,
+// or when the queue is full. Returns the request id or -1 on failure
+int emufs_client_queue(struct emufs_client_t *client, int op, int a0, int a1, int a2, const char *payload, int len);
+
+// Function to send the queued requests with one write
+// Returns 1 on success or -1 on failure
+int emufs_client_flush(struct emufs_client_t *client);
+
+// Function to wait for the reply to the oldest request sent
+// `reply` receives the header; `buf`/`cap` receives the payload (a read's data)
+// Returns the call's return value, or -1 if the connection failed
+int emufs_client_reply(struct emufs_client_t *client, struct emufs_msg_t *reply, char *buf, int cap);
+
+// Function to execute one request and wait for its reply
+// The payload may be up to EMUFS_MAX_PAYLOAD bytes. Requests queued before are sent first
+// and their replies skipped. Returns the call's return value, or -1 on failure
+int emufs_client_call(struct emufs_client_t *client, int op, int a0, int a1, int a2, const char *payload, int len, char *buf, int cap);
+
+// Functions mirroring the file system API (see emufs.h) over a connection
+int emufsc_opendevice(struct emufs_client_t *client, char *device_name, int size, int key);
+int emufsc_closedevice(struct emufs_client_t *client, int mount_point);
+int emufsc_create_file_system(struct emufs_client_t *client, int mount_point, int fs_number, int block_size);
+int emufsc_open_root(struct emufs_client_t *client, int mount_point);
+int emufsc_change_dir(struct emufs_client_t *client, int dir_handle, char *path);
+int emufsc_open_file(struct emufs_client_t *client, int dir_handle, char *path);
+int emufsc_create(struct emufs_client_t *client, int dir_handle, char *name, int type);
+int emufsc_delete(struct emufs_client_t *client, int dir_handle, char *path);
+void emufsc_close(struct emufs_client_t *client, int handle, int type);
+int emufsc_read(struct emufs_client_t *client, int file_handle, char *buf, int size);
+int emufsc_write(struct emufs_client_t *client, int file_handle, char *buf, int size);
+int emufsc_seek(struct emufs_client_t *client, int file_handle, int nseek);
+int emufsc_sync(struct emufs_client_t *client, int file_handle);
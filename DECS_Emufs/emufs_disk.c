@@ -1,22 +1,26 @@
-
+#define _GNU_SOURCE             // fallocate() and its FALLOC_FL_* flags
 #include "emufs_disk.h"
 #include "emufs.h"
 
 struct mount_t mounts[MAX_MOUNT_POINTS];
+static struct emufs_stats_t mount_stats[MAX_MOUNT_POINTS];	// Statistics of each mount (see STATISTICS)
+static int preset_key = 0;     // Key used instead of prompting (0 = prompt)
 
 
 /*-----------DEVICE------------*/
-int writeblock(int dev_fd, int block, char* buf)
+int writeblock(int dev_fd, int block, int block_size, char* buf)
 {
 	/*
-		* Writes the memory buffer to a block in the device
+		* Writes the memory buffer to a block of block_size bytes in the device
 
 		* Return value: -1, error
 						 1, success
 	*/
 
+	EMUFS_SPAN("writeblock");
+
 	int ret;
-	int offset;
+	off_t offset;
 
 	if(dev_fd < 0)
 	{
@@ -24,10 +28,10 @@ int writeblock(int dev_fd, int block, char* buf)
 		return -1;
 	}
 
-	offset = block * BLOCKSIZE;
+	offset = (off_t)block * block_size;
 	lseek(dev_fd, offset, SEEK_SET);
-	ret = write(dev_fd, buf, BLOCKSIZE);
-	if(ret != BLOCKSIZE)
+	ret = write(dev_fd, buf, block_size);
+	if(ret != block_size)
 	{
 		printf("Error: Disk write error. fd: %d. block: %d. buf: %p. ret: %d \n", dev_fd, block, buf, ret);
 		return -1;
@@ -36,27 +40,29 @@ int writeblock(int dev_fd, int block, char* buf)
 	return 1;
 }
 
-int readblock(int dev_fd, int block, char * buf)
+int readblock(int dev_fd, int block, int block_size, char * buf)
 {
 	/*
-		* Writes a block in the device to the memory buffer
+		* Writes a block of block_size bytes in the device to the memory buffer
 
 		* Return value: -1, error
 						 1, success
 	*/
 
+	EMUFS_SPAN("readblock");
+
 	int ret;
-	int offset;
+	off_t offset;
 
 	if(dev_fd < 0)
 	{
 		printf("Devices not found\n");
 		return -1;
 	}
-	offset = block * BLOCKSIZE;
+	offset = (off_t)block * block_size;
 	lseek(dev_fd, offset, SEEK_SET);
-	ret = read(dev_fd, buf, BLOCKSIZE);
-	if(ret != BLOCKSIZE)
+	ret = read(dev_fd, buf, block_size);
+	if(ret != block_size)
 	{
 		printf("Error: Disk read error. fd: %d. block: %d. buf: %p. ret: %d \n", dev_fd, block, buf, ret);
 		return -1;
@@ -65,288 +71,1573 @@ int readblock(int dev_fd, int block, char * buf)
 	return 1;
 }
 
-
-/*-----------ENCRYPTION------------*/
-void xor_encrypt(int key, char* buf, int size) {
-    for (int i = 0; i < size; i++) {
-        buf[i] ^= key; // XOR each byte with the key
-    }
-}
-
-void xor_decrypt(int key, char* buf, int size) {
-    for (int i = 0; i < size; i++) {
-        buf[i] ^= key; // XOR each byte with the same key (symmetric)
-    }
-}
-
-
-/*----------MOUNT-------*/
-int add_new_mount_point(int file_des, char *dev_name, int num_fs)
+int readblocks(int dev_fd, int block, int count, int block_size, char * buf)
 {
 	/*
-		* Creates a mount for the device
-		* Assigns an entry in the mount devices array
+		* Reads `count` consecutive blocks in the device to the memory buffer with one read
 
-		* Return value: -1,									error
-						array entry index (mount point)		success
+		* Return value: -1, error
+						 1, success
 	*/
 
-	struct mount_t* mount_point = NULL;
+	EMUFS_SPAN("readblocks");
 
-	for(int i=0; i<MAX_MOUNT_POINTS; i++)
-		if(mounts[i].device_fd <= 0 )
-		{
-			mount_point = &mounts[i];
-			mount_point->device_fd = file_des;
-			
-			strcpy(mount_point->device_name, dev_name);
-			mount_point->fs_number = num_fs;
+	int ret;
 
-			return i;
-		}
+	if(dev_fd < 0)
+	{
+		printf("Devices not found\n");
+		return -1;
+	}
+	ret = pread(dev_fd, buf, count * block_size, (off_t)block * block_size);
+	if(ret != count * block_size)
+	{
+		printf("Error: Disk read error. fd: %d. block: %d. count: %d. ret: %d \n", dev_fd, block, count, ret);
+		return -1;
+	}
 
-	return -1;
+	return 1;
 }
 
-
-int opendevice(char* dev_name, int sz)
+int writeblocks(int dev_fd, int block, int count, int block_size, char * buf)
 {
 	/*
-		* Opens a device if it exists and do some consistency checks
-		* Creates a device of given size if not present
-		* Assigns a mount point
+		* Writes the memory buffer to `count` consecutive blocks in the device with one write
 
-		* Return value: -1, 			error
-						 mount point,	success	
-	*/			
+		* Return value: -1, error
+						 1, success
+	*/
 
-	int fd;
-	FILE* fp;
-	char tempBuf[BLOCKSIZE];
-	struct superblock_t* superblock;
-	int mount_point;
-	int key;
+	EMUFS_SPAN("writeblocks");
 
-	//checking if a valid device name is passed
-	if(!dev_name || strlen(dev_name) == 0)
+	int ret;
+
+	if(dev_fd < 0)
 	{
-		printf("Error: Device name INVALID \n");
+		printf("Devices not found\n");
 		return -1;
 	}
-
-	//checking if size exceeds MAX BLOCK
-	if(sz > MAX_BLOCKS || sz < 3)
+	ret = pwrite(dev_fd, buf, count * block_size, (off_t)block * block_size);
+	if(ret != count * block_size)
 	{
-		printf("Error: Disk size INVALID \n");
+		printf("Error: Disk write error. fd: %d. block: %d. count: %d. ret: %d \n", dev_fd, block, count, ret);
 		return -1;
 	}
 
-	superblock = (struct superblock_t*)malloc(sizeof(struct superblock_t));
-	fp = fopen(dev_name, "r");
+	return 1;
+}
 
-	//What is file does not open
-	if(!fp)
-	{
-		//	Creating the device
-		printf("[%s] Creating the disk image \n", dev_name);
 
-		superblock->fs_number =  -1; 	//	No fs in the disk
-		strcpy(superblock->device_name, dev_name);
-		superblock->disk_size = sz;
-		superblock->magic_number = MAGIC_NUMBER;	
+/*-----------RAM DISK------------*/
+int open_memdevice(char *path, int *exists)
+{
+	/*
+		* Opens the memory of a RAM disk ("mem:" or "mem:<name>"):
+		* - a RAM disk that is already mounted under the same name is shared (this is how its snapshot is mounted)
+		* - otherwise a new anonymous memory file is created; if <name> is an image on the host
+		*   it is loaded from there (and saved back on unmount)
+		* *exists is 0 if the memory is still empty (a new device)
+
+		* Return value: -1,	error
+						 file descriptor of the memory,	success
+	*/
 
-		fp = fopen(dev_name, "w+");
-		if(!fp)
+	for(int i=0; i<MAX_MOUNT_POINTS; i++)
+		if(mounts[i].device_fd > 0 && mounts[i].mem && strcmp(mounts[i].device_name, path) == 0)
 		{
-			printf("Error : Device COULD NOT be created \n");
-			free(superblock);
-			return -1;
+			*exists = 1;
+			return dup(mounts[i].device_fd);
 		}
-		fd = fileno(fp);
-
-		// Disk size = Total size
-		fseek(fp, sz * BLOCKSIZE, SEEK_SET);
-		fputc('\0', fp);
-		fseek(fp, 0, SEEK_SET);
 
-		// Allocating disk to superblock
-		memcpy(tempBuf, superblock, sizeof(struct superblock_t));
-		writeblock(fd, 0, tempBuf);
+	int fd = memfd_create(path, MFD_CLOEXEC);
+	if(fd == -1)
+		return -1;
 
-		printf("[%s] Disk image SUCCESSFULLY created \n", dev_name);
+	*exists = 0;
+	const char *image = path + strlen(MEM_PREFIX);
+	int src = *image ? open(image, O_RDONLY) : -1;
+	if(src == -1)
+		return fd;
+
+	// Copy the image, leaving its all-zero (and sparse) parts as holes in memory
+	struct stat st;
+	char chunk[MAX_BLOCKSIZE];
+	fstat(src, &st);
+	if(ftruncate(fd, st.st_size) == -1)
+	{
+		close(src);
+		close(fd);
+		return -1;
 	}
-	
-	//YES file did open
-	else
+	for(off_t off = 0; off < st.st_size; )
 	{
-		fclose(fp);
-		fd = open(dev_name, O_RDWR);
+		ssize_t n = pread(src, chunk, sizeof(chunk), off);
+		if(n <= 0)
+			break;
+		for(ssize_t k = 0; k < n; k++)
+			if(chunk[k])
+			{
+				pwrite(fd, chunk, n, off);
+				break;
+			}
+		off += n;
+	}
+	close(src);
 
-		readblock(fd, 0, tempBuf);
-		memcpy(superblock, tempBuf, sizeof(struct superblock_t));
-		if(superblock->fs_number==EMUFS_ENCRYPTED){
-			printf("Input key: ");
-			scanf("%d",&key);
-			xor_decrypt(key, (char*)&(superblock->magic_number),4);
-		}
-		if(superblock->magic_number != MAGIC_NUMBER || superblock->disk_size < 3 || superblock->disk_size > MAX_BLOCKS)
-		{
-			printf("%d,%d,%d",superblock->magic_number,superblock->disk_size,superblock->disk_size);
-			printf("Error: Inconsistent super block on device. \n");
-			free(superblock);
-			return -1;
-		}
-		printf("[%s] Disk opened \n", dev_name);
+	*exists = 1;
+	return fd;
+}
 
-		if(superblock->fs_number == -1)
-			printf("[%s] File system found in the disk \n", dev_name);
-		else
-			printf("[%s] File system found. fs_number: %d \n", dev_name, superblock->fs_number);
-		
-	}	
+int map_memdevice(int mount_point)
+{
+	/*
+		* Maps the whole memory of a RAM disk, so that its blocks are accessed with memcpy
+		* Called when it is mounted and whenever its size changes
 
-	mount_point = add_new_mount_point(fd, dev_name, superblock->fs_number);
-	if(superblock->fs_number==1)
-		mounts[mount_point].key=key;
+		* Return value: -1, error
+						 1, success
+	*/
 
-	printf("[%s] Disk mount SUCCESS-> To infinity!!! \n", dev_name);
-	free(superblock);
+	struct mount_t *mount = &mounts[mount_point];
+	struct stat st;
 
-	return mount_point;	
+	if(mount->mem)
+		munmap(mount->mem, mount->mem_size);
+	mount->mem = NULL;
+
+	if(fstat(mount->device_fd, &st) == -1 || st.st_size == 0)
+		return -1;
+	char *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mount->device_fd, 0);
+	if(mem == MAP_FAILED)
+		return -1;
+
+	mount->mem = mem;
+	mount->mem_size = st.st_size;
+	return 1;
 }
 
+void save_memdevice(int mount_point)
+{
+	/*
+		* Writes a RAM disk named "mem:<path>" to the image at <path>; "mem:" alone is not saved.
+		* Blocks that are all zeros are left as holes in the image.
+	*/
+
+	struct mount_t *mount = &mounts[mount_point];
+	const char *image = mount->device_name + strlen(MEM_PREFIX);
+	int bs = mount->block_size;
 
-int closedevice_(int mount_point)
+	if(!*image)
+		return;
+
+	int fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd == -1 || ftruncate(fd, mount->mem_size) == -1)
+	{
+		printf("Error: RAM disk COULD NOT be saved to %s \n", image);
+		if(fd != -1)
+			close(fd);
+		return;
+	}
+	for(size_t off = 0; off + bs <= mount->mem_size; off += bs)
+		for(int k = 0; k < bs; k++)
+			if(mount->mem[off + k])
+			{
+				pwrite(fd, mount->mem + off, bs, off);
+				break;
+			}
+	close(fd);
+
+	printf("[%s] RAM disk saved to %s \n", mount->device_name, image);
+}
+
+static int mem_block(int mount_point, int blocknum, char *buf, int write)
 {
 	/*
-		* Closes a device
+		* Copies a block between the buffer and a RAM disk's memory
 
-		* Return value: -1, error
+		* Return value: -1, block outside the device
 						 1, success
 	*/
 
-	char dev_name[20];
+	struct mount_t *mount = &mounts[mount_point];
+	size_t offset = (size_t)blocknum * mount->block_size;
 
-	if(mounts[mount_point].device_fd < 0)
+	if(blocknum < 0 || offset + mount->block_size > mount->mem_size)
 	{
-		printf("Error: Devices not found\n");
+		printf("Error: RAM disk access out of range. block: %d \n", blocknum);
 		return -1;
 	}
+	if(write)
+		memcpy(mount->mem + offset, buf, mount->block_size);
+	else
+		memcpy(buf, mount->mem + offset, mount->block_size);
+	return 1;
+}
 
-	strcpy(dev_name, mounts[mount_point].device_name);
-	close(mounts[mount_point].device_fd);
+int resize_device(int mount_point, off_t size)
+{
+	/*
+		* Sets the size of the device in bytes (without writing: the new space is a hole)
 
-	mounts[mount_point].device_fd = -1;
-	strcpy(mounts[mount_point].device_name, "\0");
-	mounts[mount_point].fs_number = -1;
+		* Return value: -1, error
+						 1, success
+	*/
 
-	printf("[%s] Device closed \n", dev_name);
-	return 1;
-}
+	struct mount_t *mount = &mounts[mount_point];
 
-void update_mount(int mount_point, int fs_number){
+	// Each member of a striped volume holds its share of the stripes, rounded up to whole stripes
+	if(mount->stripe_count)
+	{
+		int unit = mount->stripe_blocks;
+		int stripes = (size / mount->block_size + unit - 1) / unit;
+		off_t member_size = (off_t)((stripes + mount->stripe_count - 1) / mount->stripe_count) * unit * mount->block_size;
+		for(int i=0; i<mount->stripe_count; i++)
+			if(ftruncate(mount->stripe_fds[i], member_size) == -1)
+				return -1;
+		return 1;
+	}
 
-	int key;
+	if(ftruncate(mount->device_fd, size) == -1)
+		return -1;
+	if(mount->mem)
+		return map_memdevice(mount_point);
+	return 1;
+}
 
-    // Update the filesystem type (fs_number) for the specified mount point
-    mounts[mount_point].fs_number = fs_number;
 
-    // If the file system is encrypted (fs_number == 1), ask for the encryption key
-    if (fs_number == 1) {
-        printf("Input encryption key: ");
-        
-        // Read the key from the user input (ensure it's a valid integer)
-        while (scanf("%d", &key) != 1 || key <= 0) {
-            // If invalid input, prompt the user to enter a valid positive integer
-            printf("Invalid key! Please enter a valid positive integer for the encryption key: ");
-            // Clear the buffer to avoid infinite loop on invalid input
-            while(getchar() != '\n');
-        }
-        
-        // Store the encryption key in the mount structure
-        mounts[mount_point].key = key;
-        
-        // Optionally, print a message that the key is set (you can remove this in production code)
-        printf("Encryption key set for the mounted file system.\n");
-    } else {
-        // If not encrypted, we can reset the key (this part is optional)
-        mounts[mount_point].key = 0;
-    }
+/*-----------STRIPED VOLUMES------------*/
+static int dev_locate(int mount_point, int blocknum, int *fd)
+{
 	/*
-		update the fstype in the mount and prompt the user for key if its an encryted system
+		* Maps a block of the mount to the device holding it
+		* On a striped volume the blocks go to the members stripe_blocks at a time, round robin
+
+		* Return value: block number on the device *fd
 	*/
+
+	struct mount_t *mount = &mounts[mount_point];
+
+	if(!mount->stripe_count)
+	{
+		*fd = mount->device_fd;
+		return blocknum;
+	}
+
+	int stripe = blocknum / mount->stripe_blocks;
+	*fd = mount->stripe_fds[stripe % mount->stripe_count];
+	return (stripe / mount->stripe_count) * mount->stripe_blocks + blocknum % mount->stripe_blocks;
 }
 
-void mount_dump(void)
+static int volume_io(int mount_point, char *blocks, int count, char *buf, int write)
 {
 	/*
-		* Prints summary of mount points
+		* Reads or writes `count` blocks of a striped volume (their content one after the other in buf)
+		* Blocks that follow each other on a member and in buf become one request. All the requests
+		* are submitted together with lio_listio, so the members transfer in parallel.
+
+		* Return value: -1, error
+						 1, success
 	*/
 
-	struct mount_t* mount_point;
+	int bs = mounts[mount_point].block_size;
+	struct aiocb cbs[count];
+	struct aiocb *list[count];
+	int n = 0, ret = 1;
 
-	printf("\n%-12s %-20s %-15s %-10s %-20s \n", "MOUNT-POINT", "DEVICE-NAME", "DEVICE-NUMBER", "FS-NUMBER", "FS-NAME");
-	for(int i=0; i< MAX_MOUNT_POINTS; i++)
+	memset(cbs, 0, sizeof(cbs));
+	memset(list, 0, sizeof(list));
+	for(int i=0; i<count; i++)
 	{
-		mount_point = mounts + i;
-		if(mount_point->device_fd <= 0)
+		int fd;
+		off_t offset = (off_t)dev_locate(mount_point, blocks[i], &fd) * bs;
+		struct aiocb *last = n ? &cbs[n - 1] : NULL;
+
+		if(last && last->aio_fildes == fd && last->aio_offset + (off_t)last->aio_nbytes == offset
+			&& (char*)last->aio_buf + last->aio_nbytes == buf + (size_t)i * bs)
+		{
+			last->aio_nbytes += bs;
 			continue;
+		}
+		cbs[n].aio_fildes = fd;
+		cbs[n].aio_offset = offset;
+		cbs[n].aio_buf = buf + (size_t)i * bs;
+		cbs[n].aio_nbytes = bs;
+		cbs[n].aio_lio_opcode = write ? LIO_WRITE : LIO_READ;
+		list[n] = &cbs[n];
+		n++;
+	}
 
-		if(mount_point->device_fd > 0)
-			printf("%-12d %-20s %-15d %-10d %-20s\n", 
-					i, mount_point->device_name, mount_point->device_fd, mount_point->fs_number, 
-					mount_point->fs_number == EMUFS_NON_ENCRYPTED ? "emufs non-encrypted" : (mount_point->fs_number == EMUFS_ENCRYPTED ? "emufs encrypted" : "Unknown file system"));
+	// Waits for all the requests; a failed one is reported by its own status below
+	if(lio_listio(LIO_WAIT, list, n, NULL) == -1 && errno != EIO)
+	{
+		printf("Error: Volume I/O COULD NOT be submitted \n");
+		return -1;
 	}
+	for(int i=0; i<n; i++)
+		if(aio_error(&cbs[i]) != 0 || aio_return(&cbs[i]) != (ssize_t)cbs[i].aio_nbytes)
+		{
+			printf("Error: Volume %s failed. offset: %ld \n", write ? "write" : "read", (long)cbs[i].aio_offset);
+			ret = -1;
+		}
+	return ret;
 }
 
-void read_superblock(int mount_point, struct superblock_t *superblock){
-	/*	
-		* Reads the superblock of the device
-		* If its an encrypted system, decrypts the magic number after reading
-	*/
 
-	char tempBuf[BLOCKSIZE];
-	readblock(mounts[mount_point].device_fd, 0, tempBuf);
-	if(mounts[mount_point].fs_number==1)
-		xor_decrypt(mounts[mount_point].key, tempBuf, 4);
-	memcpy(superblock, tempBuf, sizeof(struct superblock_t));
+/*-----------BLOCK CACHE------------*/
+static struct cache_entry_t* cache_find(struct block_cache_t *cache, int blocknum)
+{
+	for(int i=0; i<CACHE_BLOCKS; i++)
+		if(cache->entries[i].blocknum == blocknum)
+			return &cache->entries[i];
+	return NULL;
 }
 
-void write_superblock(int mount_point, struct superblock_t *superblock){
-	/*
-		* Updates the superblock of the device
-		* If its an encrypted system, encrypts the magic number before writing
-	*/
-
-	char tempBuf[BLOCKSIZE];
-	memcpy(tempBuf, superblock, sizeof(struct superblock_t));
-	if(mounts[mount_point].fs_number==1)
-		xor_encrypt(mounts[mount_point].key, tempBuf, 4);
-	writeblock(mounts[mount_point].device_fd, 0, tempBuf);
+static struct cache_entry_t* cache_victim(struct block_cache_t *cache)
+{
+	// Least recently used entry; empty entries have last_use 0 and go first
+	struct cache_entry_t *victim = &cache->entries[0];
+	for(int i=1; i<CACHE_BLOCKS; i++)
+		if(cache->entries[i].last_use < victim->last_use)
+			victim = &cache->entries[i];
+	return victim;
 }
 
-int alloc_inode(int mount_point) {
-    /*
-        Function: alloc_inode
-        Purpose: This function allocates a free inode if available, by checking the inode bitmap.
-        Updates the inode bitmap and the number of used inodes accordingly.
+int dev_readblock(int mount_point, int blocknum, char *buf)
+{
+	/*
+		* Serves the block from the cache, or reads it from the device and caches it
 
-        Parameters:
-            mount_point: The mount point to identify the filesystem.
+		* Return value: -1, error
+						 1, success
+	*/
 
-        Return value:
-            -1: if no free inodes are available (error).
-            inode number: if a free inode is allocated successfully (success).
-    */
+	EMUFS_SPAN("dev_readblock");
 
-    // Structure to hold the superblock data
-    struct superblock_t superblock;
+	struct block_cache_t *cache = mounts[mount_point].cache;
+	struct cache_entry_t *entry;
 
-    // Read the superblock data from the disk
-    read_superblock(mount_point, &superblock);
+	// A RAM disk is its own cache
+	if(mounts[mount_point].mem)
+	{
+		mount_stats[mount_point].io.block_reads++;
+		return mem_block(mount_point, blocknum, buf, 0);
+	}
 
-    // If all inodes are already used, return error (-1)
-    if(superblock.used_inodes == MAX_INODES)
+	entry = cache_find(cache, blocknum);
+	if(entry)
+		mount_stats[mount_point].io.cache_hits++;
+	else
+	{
+		int fd, phys = dev_locate(mount_point, blocknum, &fd);
+		mount_stats[mount_point].io.cache_misses++;
+		mount_stats[mount_point].io.block_reads++;
+		entry = cache_victim(cache);
+		entry->blocknum = -1;
+		if(readblock(fd, phys, mounts[mount_point].block_size, entry->data) == -1)
+			return -1;
+		entry->blocknum = blocknum;
+	}
+
+	entry->last_use = ++cache->clock;
+	memcpy(buf, entry->data, mounts[mount_point].block_size);
+	return 1;
+}
+
+int dev_writeblock(int mount_point, int blocknum, char *buf)
+{
+	/*
+		* Writes the block to the device and keeps the cached copy in step
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	EMUFS_SPAN("dev_writeblock");
+
+	struct block_cache_t *cache = mounts[mount_point].cache;
+	struct cache_entry_t *entry;
+
+	mount_stats[mount_point].io.block_writes++;
+	if(mounts[mount_point].mem)
+		return mem_block(mount_point, blocknum, buf, 1);
+
+	int fd, phys = dev_locate(mount_point, blocknum, &fd);
+	entry = cache_find(cache, blocknum);
+	if(writeblock(fd, phys, mounts[mount_point].block_size, buf) == -1)
+	{
+		if(entry)
+			entry->blocknum = -1;
+		return -1;
+	}
+
+	if(!entry)
+		entry = cache_victim(cache);
+	entry->blocknum = blocknum;
+	entry->last_use = ++cache->clock;
+	memcpy(entry->data, buf, mounts[mount_point].block_size);
+	return 1;
+}
+
+int dev_writeblocks(int mount_point, char *blocks, int count, char *buf)
+{
+	/*
+		* Writes the blocks and keeps their cached copies in step
+		* Runs of consecutive blocks go out with one write each; the members
+		* of a striped volume are written in parallel
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	EMUFS_SPAN("dev_writeblocks");
+
+	struct mount_t *mount = &mounts[mount_point];
+	struct block_cache_t *cache = mount->cache;
+	int bs = mount->block_size;
+
+	if(mount->mem)
+	{
+		for(int i=0; i<count; i++)
+			if(dev_writeblock(mount_point, blocks[i], buf + (size_t)i * bs) == -1)
+				return -1;
+		return 1;
+	}
+
+	int ret = 1;
+	if(mount->stripe_count)
+		ret = volume_io(mount_point, blocks, count, buf, 1);
+	else
+		for(int i=0, n; i<count && ret == 1; i += n)
+		{
+			for(n = 1; i + n < count && blocks[i + n] == blocks[i] + n; n++)
+				;
+			ret = writeblocks(mount->device_fd, blocks[i], n, bs, buf + (size_t)i * bs);
+		}
+	mount_stats[mount_point].io.block_writes += count;
+	for(int i=0; i<count; i++)
+	{
+		struct cache_entry_t *entry = cache_find(cache, blocks[i]);
+		if(ret == -1)
+		{
+			if(entry)
+				entry->blocknum = -1;
+			continue;
+		}
+		if(!entry)
+			entry = cache_victim(cache);
+		entry->blocknum = blocks[i];
+		entry->last_use = ++cache->clock;
+		memcpy(entry->data, buf + (size_t)i * bs, bs);
+	}
+	return ret;
+}
+
+static int dev_readrun(int mount_point, int start, int count, char *buf)
+{
+	// Reads consecutive blocks: one device read, or parallel reads across the members of a volume
+	char blocks[count];
+
+	mount_stats[mount_point].io.block_reads += count;
+	if(!mounts[mount_point].stripe_count)
+		return readblocks(mounts[mount_point].device_fd, start, count, mounts[mount_point].block_size, buf);
+	for(int i=0; i<count; i++)
+		blocks[i] = start + i;
+	return volume_io(mount_point, blocks, count, buf, 0);
+}
+
+void prefetch_blocks(int mount_point, char *blocks, int count, char *hint, int hint_count)
+{
+	/*
+		* Loads the listed blocks that are not cached yet. Consecutive block numbers
+		* are fetched with one device read. The hinted blocks are handed to the host
+		* with POSIX_FADV_WILLNEED, which starts their read in the background.
+	*/
+
+	EMUFS_SPAN("prefetch_blocks");
+
+	struct block_cache_t *cache = mounts[mount_point].cache;
+	int bs = mounts[mount_point].block_size;
+	char *run = NULL;
+	int i = 0;
+
+	// Nothing to prefetch on a RAM disk
+	if(mounts[mount_point].mem)
+		return;
+
+	while(i < count)
+	{
+		if(blocks[i] == -1 || cache_find(cache, blocks[i]))
+		{
+			i++;
+			continue;
+		}
+
+		int start = blocks[i], n = 1;
+		while(i + n < count && n < MAX_READAHEAD * 2 && blocks[i + n] == start + n && !cache_find(cache, start + n))
+			n++;
+
+		// Staging buffer for the longest run, allocated on the first miss
+		if(!run && !(run = malloc(MAX_READAHEAD * 2 * bs)))
+			break;
+
+		if(dev_readrun(mount_point, start, n, run) == 1)
+		{
+			for(int k=0; k<n; k++)
+			{
+				struct cache_entry_t *entry = cache_victim(cache);
+				entry->blocknum = start + k;
+				entry->last_use = ++cache->clock;
+				memcpy(entry->data, run + k * bs, bs);
+			}
+		}
+		i += n;
+	}
+	free(run);
+
+	for(i=0; i<hint_count; i++)
+		if(hint[i] != -1 && !cache_find(cache, hint[i]))
+		{
+			int fd, phys = dev_locate(mount_point, hint[i], &fd);
+			posix_fadvise(fd, (off_t)phys * bs, bs, POSIX_FADV_WILLNEED);
+		}
+}
+
+
+/*-----------ENCRYPTION------------*/
+void xor_encrypt(int key, char* buf, int size) {
+    EMUFS_SPAN("xor_encrypt");
+    for (int i = 0; i < size; i++) {
+        buf[i] ^= key; // XOR each byte with the key
+    }
+}
+
+void xor_decrypt(int key, char* buf, int size) {
+    EMUFS_SPAN("xor_decrypt");
+    for (int i = 0; i < size; i++) {
+        buf[i] ^= key; // XOR each byte with the same key (symmetric)
+    }
+}
+
+
+/*-----------COMPRESSION------------*/
+#define LZ_MINMATCH 4           // Shortest match worth encoding
+#define LZ_LASTLITERALS 5       // The last bytes of the input are always literals
+#define LZ_HASH_LOG 12          // Size of the match finder table (2^12 entries)
+
+static unsigned int lz_hash(const unsigned char *p)
+{
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static unsigned char* lz_put_length(unsigned char *op, int len)
+{
+	// Lengths >= 15 continue in extra bytes of 255 terminated by a smaller byte
+	while(len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+int lz_compress(const char *src, int len, char *dst, int cap)
+{
+	/*
+		* Greedy LZ77 with a single-probe hash table, emitting LZ4-style sequences:
+		* token (literal length << 4 | match length - 4), literals, 2-byte offset, extra length bytes
+
+		* Return value: -1,					output does not fit in cap
+						 compressed length,	success
+	*/
+
+	EMUFS_SPAN("lz_compress");
+
+	const unsigned char *base = (const unsigned char*)src;
+	const unsigned char *ip = base, *anchor = base, *end = base + len;
+	const unsigned char *mflimit = end - LZ_LASTLITERALS;
+	unsigned char *op = (unsigned char*)dst, *oend = op + cap;
+	int table[1 << LZ_HASH_LOG];
+
+	for(int i=0; i<(1 << LZ_HASH_LOG); i++)
+		table[i] = -1;
+
+	while(len > LZ_MINMATCH + LZ_LASTLITERALS && ip + LZ_MINMATCH <= mflimit)
+	{
+		unsigned int h = lz_hash(ip);
+		int ref = table[h];
+		table[h] = ip - base;
+
+		if(ref < 0 || (ip - base) - ref > 65535 || memcmp(base + ref, ip, LZ_MINMATCH) != 0)
+		{
+			ip++;
+			continue;
+		}
+
+		// Extend the match as far as the literal tail allows
+		const unsigned char *match = base + ref;
+		const unsigned char *p = ip + LZ_MINMATCH, *m = match + LZ_MINMATCH;
+		while(p < mflimit && *p == *m)
+		{
+			p++;
+			m++;
+		}
+
+		int lit = ip - anchor;
+		int mlen = (p - ip) - LZ_MINMATCH;
+		int offset = ip - match;
+
+		if(op + 1 + lit/255 + 1 + lit + 2 + mlen/255 + 1 > oend)
+			return -1;
+
+		unsigned char *token = op++;
+		if(lit >= 15)
+		{
+			*token = 15 << 4;
+			op = lz_put_length(op, lit - 15);
+		}
+		else
+			*token = lit << 4;
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+
+		if(mlen >= 15)
+		{
+			*token |= 15;
+			op = lz_put_length(op, mlen - 15);
+		}
+		else
+			*token |= mlen;
+
+		ip = p;
+		anchor = p;
+	}
+
+	// Final sequence: literals only
+	int lit = end - anchor;
+	if(op + 1 + lit/255 + 1 + lit > oend)
+		return -1;
+	unsigned char *token = op++;
+	if(lit >= 15)
+	{
+		*token = 15 << 4;
+		op = lz_put_length(op, lit - 15);
+	}
+	else
+		*token = lit << 4;
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - (unsigned char*)dst;
+}
+
+int lz_decompress(const char *src, int clen, char *dst, int cap)
+{
+	/*
+		* Decodes a stream produced by lz_compress, checking every copy against both buffers
+
+		* Return value: -1,						corrupt input or output overflow
+						 decompressed length,	success
+	*/
+
+	EMUFS_SPAN("lz_decompress");
+
+	const unsigned char *ip = (const unsigned char*)src, *iend = ip + clen;
+	unsigned char *op = (unsigned char*)dst, *oend = op + cap;
+
+	while(ip < iend)
+	{
+		int token = *ip++;
+		int lit = token >> 4;
+		if(lit == 15)
+		{
+			int b;
+			do {
+				if(ip >= iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while(b == 255);
+		}
+		if(ip + lit > iend || op + lit > oend)
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		// The last sequence carries no match
+		if(ip == iend)
+			break;
+
+		if(ip + 2 > iend)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op - (unsigned char*)dst)
+			return -1;
+
+		int mlen = token & 15;
+		if(mlen == 15)
+		{
+			int b;
+			do {
+				if(ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while(b == 255);
+		}
+		mlen += LZ_MINMATCH;
+		if(op + mlen > oend)
+			return -1;
+
+		// Byte-wise copy: the match may overlap the bytes being produced
+		unsigned char *match = op - offset;
+		for(int i=0; i<mlen; i++)
+			op[i] = match[i];
+		op += mlen;
+	}
+
+	return op - (unsigned char*)dst;
+}
+
+
+/*-----------FILE SYSTEM TYPES------------*/
+/*
+	* Each file system type supplies its own superblock, inode and data block routines.
+	* A mount binds the table of its type once (add_new_mount_point, update_mount),
+	* so none of these routines tests the type on a call.
+	* A new type is a new table in fs_types, indexed by its fs_number.
+*/
+
+static void plain_read_superblock(int mount_point, struct superblock_t *superblock)
+{
+	char tempBuf[mounts[mount_point].block_size];
+	dev_readblock(mount_point, 0, tempBuf);
+	memcpy(superblock, tempBuf, sizeof(struct superblock_t));
+}
+
+static void plain_write_superblock(int mount_point, struct superblock_t *superblock)
+{
+	char tempBuf[mounts[mount_point].block_size];
+	memset(tempBuf, 0, mounts[mount_point].block_size);
+	memcpy(tempBuf, superblock, sizeof(struct superblock_t));
+	dev_writeblock(mount_point, 0, tempBuf);
+}
+
+static void crypt_read_superblock(int mount_point, struct superblock_t *superblock)
+{
+	// Only the magic number is encrypted
+	plain_read_superblock(mount_point, superblock);
+	xor_decrypt(mounts[mount_point].key, (char*)&superblock->magic_number, 4);
+}
+
+static void crypt_write_superblock(int mount_point, struct superblock_t *superblock)
+{
+	struct superblock_t copy = *superblock;
+	xor_encrypt(mounts[mount_point].key, (char*)&copy.magic_number, 4);
+	plain_write_superblock(mount_point, &copy);
+}
+
+static int inode_block(int mount_point, int inodenum, int *offset)
+{
+	/*
+		* Locates an inode in the inode table: block_size / 16 inodes per block from block 1 on,
+		* or in the snapshot's frozen copy on a snapshot mount
+
+		* Return value: block number, with the entry's byte offset in *offset
+	*/
+
+	int per_block = mounts[mount_point].block_size / sizeof(struct inode_t);
+	int block_offset = inodenum / per_block;
+
+	*offset = (inodenum % per_block) * sizeof(struct inode_t);
+	return mounts[mount_point].snapshot ? mounts[mount_point].snapshot_blocks[block_offset] : 1 + block_offset;
+}
+
+static void plain_read_inode(int mount_point, int inodenum, struct inode_t *inodeptr)
+{
+	char block[mounts[mount_point].block_size];
+	int offset;
+	dev_readblock(mount_point, inode_block(mount_point, inodenum, &offset), block);
+	memcpy(inodeptr, block + offset, sizeof(struct inode_t));
+}
+
+static void plain_write_inode(int mount_point, int inodenum, struct inode_t *inodeptr)
+{
+	// Read-modify-write: the other entries of the block stay as they are on disk
+	char block[mounts[mount_point].block_size];
+	int offset;
+	int blocknum = inode_block(mount_point, inodenum, &offset);
+	dev_readblock(mount_point, blocknum, block);
+	memcpy(block + offset, inodeptr, sizeof(struct inode_t));
+	dev_writeblock(mount_point, blocknum, block);
+}
+
+static void plain_read_inode_table(int mount_point, struct inode_t *inodes)
+{
+	int bs = mounts[mount_point].block_size;
+	int table_size = MAX_INODES * sizeof(struct inode_t);
+	char block[bs];
+
+	for(int i=0; i<mounts[mount_point].inode_blocks; i++)
+	{
+		int blocknum = mounts[mount_point].snapshot ? mounts[mount_point].snapshot_blocks[i] : 1 + i;
+		int len = table_size - i * bs < bs ? table_size - i * bs : bs;  // a large block holds the whole table
+
+		dev_readblock(mount_point, blocknum, block);
+		memcpy((char*)inodes + i * bs, block, len);
+	}
+}
+
+static void plain_write_inode_table(int mount_point, struct inode_t *inodes)
+{
+	// One write per table block; a large block keeps its bytes past the table
+	int bs = mounts[mount_point].block_size;
+	int table_size = MAX_INODES * sizeof(struct inode_t);
+	char block[bs];
+
+	for(int i=0; i<mounts[mount_point].inode_blocks; i++)
+	{
+		int len = table_size - i * bs < bs ? table_size - i * bs : bs;
+
+		if(len < bs)
+			dev_readblock(mount_point, 1 + i, block);
+		memcpy(block, (char*)inodes + i * bs, len);
+		dev_writeblock(mount_point, 1 + i, block);
+	}
+}
+
+// XOR works byte by byte, so only the bytes of the entry (or table) need the key
+static void crypt_read_inode(int mount_point, int inodenum, struct inode_t *inodeptr)
+{
+	plain_read_inode(mount_point, inodenum, inodeptr);
+	xor_decrypt(mounts[mount_point].key, (char*)inodeptr, sizeof(struct inode_t));
+}
+
+static void crypt_write_inode(int mount_point, int inodenum, struct inode_t *inodeptr)
+{
+	struct inode_t entry = *inodeptr;
+	xor_encrypt(mounts[mount_point].key, (char*)&entry, sizeof(struct inode_t));
+	plain_write_inode(mount_point, inodenum, &entry);
+}
+
+static void crypt_read_inode_table(int mount_point, struct inode_t *inodes)
+{
+	plain_read_inode_table(mount_point, inodes);
+	xor_decrypt(mounts[mount_point].key, (char*)inodes, MAX_INODES * sizeof(struct inode_t));
+}
+
+static void crypt_write_inode_table(int mount_point, struct inode_t *inodes)
+{
+	struct inode_t table[MAX_INODES];
+	memcpy(table, inodes, sizeof(table));
+	xor_encrypt(mounts[mount_point].key, (char*)table, sizeof(table));
+	plain_write_inode_table(mount_point, table);
+}
+
+static void plain_read_datablock(int mount_point, int blocknum, char *buf)
+{
+	dev_readblock(mount_point, blocknum, buf);
+}
+
+static void plain_write_datablock(int mount_point, int blocknum, char *buf)
+{
+	dev_writeblock(mount_point, blocknum, buf);
+}
+
+static void crypt_read_datablock(int mount_point, int blocknum, char *buf)
+{
+	dev_readblock(mount_point, blocknum, buf);
+	xor_decrypt(mounts[mount_point].key, buf, mounts[mount_point].block_size);
+}
+
+static void crypt_write_datablock(int mount_point, int blocknum, char *buf)
+{
+	xor_encrypt(mounts[mount_point].key, buf, mounts[mount_point].block_size);
+	dev_writeblock(mount_point, blocknum, buf);
+}
+
+static void plain_write_datablocks(int mount_point, char *blocks, int count, char *buf)
+{
+	dev_writeblocks(mount_point, blocks, count, buf);
+}
+
+static void crypt_write_datablocks(int mount_point, char *blocks, int count, char *buf)
+{
+	xor_encrypt(mounts[mount_point].key, buf, count * mounts[mount_point].block_size);
+	dev_writeblocks(mount_point, blocks, count, buf);
+}
+
+// A device without a file system: the superblock is read and written as is
+static const struct fs_ops_t raw_ops = {
+	.name = "Unknown file system",
+	.read_superblock = plain_read_superblock,	.write_superblock = plain_write_superblock,
+	.read_inode = plain_read_inode,				.write_inode = plain_write_inode,
+	.read_inode_table = plain_read_inode_table,	.write_inode_table = plain_write_inode_table,
+	.read_datablock = plain_read_datablock,		.write_datablock = plain_write_datablock,
+	.write_datablocks = plain_write_datablocks,
+};
+
+static const struct fs_ops_t plain_ops = {
+	.name = "emufs non-encrypted",
+	.read_superblock = plain_read_superblock,	.write_superblock = plain_write_superblock,
+	.read_inode = plain_read_inode,				.write_inode = plain_write_inode,
+	.read_inode_table = plain_read_inode_table,	.write_inode_table = plain_write_inode_table,
+	.read_datablock = plain_read_datablock,		.write_datablock = plain_write_datablock,
+	.write_datablocks = plain_write_datablocks,
+};
+
+static const struct fs_ops_t crypt_ops = {
+	.name = "emufs encrypted",
+	.read_superblock = crypt_read_superblock,	.write_superblock = crypt_write_superblock,
+	.read_inode = crypt_read_inode,				.write_inode = crypt_write_inode,
+	.read_inode_table = crypt_read_inode_table,	.write_inode_table = crypt_write_inode_table,
+	.read_datablock = crypt_read_datablock,		.write_datablock = crypt_write_datablock,
+	.write_datablocks = crypt_write_datablocks,
+};
+
+// Plain blocks, but a file's content is stored as one LZ stream
+static const struct fs_ops_t compressed_ops = {
+	.name = "emufs compressed",
+	.read_superblock = plain_read_superblock,	.write_superblock = plain_write_superblock,
+	.read_inode = plain_read_inode,				.write_inode = plain_write_inode,
+	.read_inode_table = plain_read_inode_table,	.write_inode_table = plain_write_inode_table,
+	.read_datablock = plain_read_datablock,		.write_datablock = plain_write_datablock,
+	.write_datablocks = plain_write_datablocks,
+	.read_file = read_file_data,				.write_file = write_file_data,
+};
+
+// Indexed by fs_number
+static const struct fs_ops_t *fs_types[] = {
+	[EMUFS_NON_ENCRYPTED] = &plain_ops,
+	[EMUFS_ENCRYPTED] = &crypt_ops,
+	[EMUFS_COMPRESSED] = &compressed_ops,
+};
+
+static void bind_fs_ops(struct mount_t *mount)
+{
+	int count = sizeof(fs_types) / sizeof(fs_types[0]);
+	mount->ops = mount->fs_number >= 0 && mount->fs_number < count ? fs_types[mount->fs_number] : &raw_ops;
+}
+
+
+/*----------MOUNT-------*/
+int add_new_mount_point(int file_des, char *dev_name, int num_fs, int block_size)
+{
+	/*
+		* Creates a mount for the device
+		* Assigns an entry in the mount devices array
+
+		* Return value: -1,									error
+						array entry index (mount point)		success
+	*/
+
+	struct mount_t* mount_point = NULL;
+
+	for(int i=0; i<MAX_MOUNT_POINTS; i++)
+		if(mounts[i].device_fd <= 0 )
+		{
+			mount_point = &mounts[i];
+			mount_point->device_fd = file_des;
+			
+			strcpy(mount_point->device_name, dev_name);
+			mount_point->fs_number = num_fs;
+			bind_fs_ops(mount_point);
+			mount_point->snapshot = 0;
+			mount_point->mem = NULL;
+			memset(mount_point->punch_pending, 0, MAX_BLOCKS);
+			mount_point->punch_count = 0;
+			mount_point->reserved_blocks = 0;
+			mount_point->stripe_count = 0;
+			mount_point->stripe_blocks = 1;
+			mount_point->cache = NULL;
+			memset(&mount_stats[i], 0, sizeof(struct emufs_stats_t));
+
+			if(set_block_size(i, block_size) == -1)
+			{
+				mount_point->device_fd = -1;
+				return -1;
+			}
+
+			return i;
+		}
+
+	return -1;
+}
+
+
+int set_block_size(int mount_point, int block_size)
+{
+	/*
+		* Records the block size and what follows from it, and reallocates the block cache:
+		* CACHE_BLOCKS entries whose data live in one allocation behind the cache header
+
+		* Return value: -1,	invalid block size or out of memory
+						 1,	success
+	*/
+
+	struct mount_t *mount = &mounts[mount_point];
+
+	if(block_size < BLOCKSIZE || block_size > MAX_BLOCKSIZE || (block_size & (block_size - 1)))
+		return -1;
+
+	struct block_cache_t *cache = (struct block_cache_t*)calloc(1, sizeof(struct block_cache_t) + (size_t)CACHE_BLOCKS * block_size);
+	if(!cache)
+		return -1;
+	for(int j=0; j<CACHE_BLOCKS; j++)
+	{
+		cache->entries[j].blocknum = -1;
+		cache->entries[j].data = cache->data + (size_t)j * block_size;
+	}
+
+	free(mount->cache);
+	mount->cache = cache;
+	mount->block_size = block_size;
+	mount->inode_blocks = (MAX_INODES * (int)sizeof(struct inode_t) + block_size - 1) / block_size;
+	mount->max_file_size = MAX_FILE_SIZE * block_size < MAX_FILE_BYTES ? MAX_FILE_SIZE * block_size : MAX_FILE_BYTES;
+	return 1;
+}
+
+
+static int load_superblock(int fd, struct superblock_t *superblock, int *key)
+{
+	/*
+		* Reads the superblock of an existing device, asking for the key if the
+		* file system is encrypted, and checks it
+
+		* Return value: -1, inconsistent superblock
+						 1, success
+	*/
+
+	char tempBuf[BLOCKSIZE];
+
+	// The superblock sits in the first BLOCKSIZE bytes whatever the block size
+	readblock(fd, 0, BLOCKSIZE, tempBuf);
+	memcpy(superblock, tempBuf, sizeof(struct superblock_t));
+	if(superblock->fs_number==EMUFS_ENCRYPTED){
+		if(preset_key < 0){
+			printf("Error: No key for the encrypted device \n");
+			return -1;
+		}
+		if(preset_key)
+			*key = preset_key;
+		else{
+			printf("Input key: ");
+			scanf("%d",key);
+		}
+		xor_decrypt(*key, (char*)&(superblock->magic_number),4);
+	}
+	if(superblock->magic_number != MAGIC_NUMBER || superblock->disk_size < 3 || superblock->disk_size > MAX_BLOCKS)
+	{
+		printf("%d,%d,%d",superblock->magic_number,superblock->disk_size,superblock->disk_size);
+		printf("Error: Inconsistent super block on device. \n");
+		return -1;
+	}
+	if(superblock->layout != LAYOUT_MAGIC)
+	{
+		/*
+			* Images made before the layout field only hold the fields up to the
+			* block bitmap, whatever follows is left over bytes. They always use
+			* BLOCKSIZE blocks and none of the newer features, so clear those fields
+			* and write the superblock back in the current layout
+		*/
+		printf("[%s] Old superblock layout, upgrading \n", superblock->device_name);
+		memset(superblock->block_refs, 0, sizeof(superblock->block_refs));
+		superblock->dedup_index = 0;
+		memset(superblock->snapshot_blocks, 0, sizeof(superblock->snapshot_blocks));
+		superblock->block_size = BLOCKSIZE;
+		superblock->stripe_members = 0;
+		superblock->stripe_blocks = 0;
+		superblock->layout = LAYOUT_MAGIC;
+
+		memcpy(tempBuf, superblock, sizeof(struct superblock_t));
+		if(superblock->fs_number == EMUFS_ENCRYPTED)
+			xor_encrypt(*key, tempBuf, 4);
+		if(writeblock(fd, 0, BLOCKSIZE, tempBuf) == -1)
+			return -1;
+	}
+	if(superblock->block_size < BLOCKSIZE || superblock->block_size > MAX_BLOCKSIZE
+		|| (superblock->block_size & (superblock->block_size - 1)))
+	{
+		printf("Error: Inconsistent super block on device (block size %d). \n", superblock->block_size);
+		return -1;
+	}
+	return 1;
+}
+
+
+int opendevice(char* dev_name, int sz)
+{
+	/*
+		* Opens a device if it exists and do some consistency checks
+		* Creates a device of given size if not present
+		* Assigns a mount point
+
+		* Return value: -1, 			error
+						 mount point,	success	
+	*/			
+
+	int fd;
+	FILE* fp;
+	char tempBuf[BLOCKSIZE];
+	struct superblock_t* superblock;
+	int mount_point;
+	int key;
+	char path[sizeof(mounts[0].device_name)];
+	int snapshot = 0;
+	int exists;
+	int mem;
+
+	//checking if a valid device name is passed
+	if(!dev_name || strlen(dev_name) == 0)
+	{
+		printf("Error: Device name INVALID \n");
+		return -1;
+	}
+
+	//checking if size exceeds MAX BLOCK
+	if(sz > MAX_BLOCKS || sz < 3)
+	{
+		printf("Error: Disk size INVALID \n");
+		return -1;
+	}
+
+	//"<device>@snap" names the read-only snapshot of <device>
+	strncpy(path, dev_name, sizeof(path) - 1);
+	path[sizeof(path) - 1] = 0;
+	if(strlen(path) > 5 && strcmp(path + strlen(path) - 5, "@snap") == 0)
+	{
+		path[strlen(path) - 5] = 0;
+		snapshot = 1;
+	}
+
+	//A device is mounted once: the block cache, the reservations and the handles are per mount
+	for(int i=0; i<MAX_MOUNT_POINTS && !snapshot; i++)
+		if(mounts[i].device_fd > 0 && !mounts[i].snapshot && strcmp(mounts[i].device_name, path) == 0)
+		{
+			printf("Error: Device already mounted (mount point %d) \n", i);
+			return -1;
+		}
+
+	superblock = (struct superblock_t*)calloc(1, sizeof(struct superblock_t));
+
+	//"mem:..." names a RAM disk, anything else a host file
+	mem = strncmp(path, MEM_PREFIX, strlen(MEM_PREFIX)) == 0;
+	fp = NULL;
+	if(mem)
+	{
+		fd = open_memdevice(path, &exists);
+		if(fd == -1)
+		{
+			printf("Error : RAM disk COULD NOT be created \n");
+			free(superblock);
+			return -1;
+		}
+	}
+	else
+	{
+		fp = fopen(path, "r");
+		exists = fp != NULL;
+	}
+
+	//A snapshot can only be mounted from an existing device
+	if(!exists && snapshot)
+	{
+		printf("Error: Device for snapshot NOT found \n");
+		if(mem)
+			close(fd);
+		free(superblock);
+		return -1;
+	}
+
+	//What is file does not open
+	if(!exists)
+	{
+		//	Creating the device
+		printf("[%s] Creating the disk image \n", dev_name);
+
+		superblock->fs_number =  -1; 	//	No fs in the disk
+		strcpy(superblock->device_name, dev_name);
+		superblock->disk_size = sz;
+		superblock->magic_number = MAGIC_NUMBER;	
+		superblock->block_size = BLOCKSIZE;	//	Until a file system picks another
+		superblock->stripe_members = 0;
+		superblock->stripe_blocks = 0;
+		superblock->layout = LAYOUT_MAGIC;
+
+		if(!mem)
+		{
+			fp = fopen(dev_name, "w+");
+			if(!fp)
+			{
+				printf("Error : Device COULD NOT be created \n");
+				free(superblock);
+				return -1;
+			}
+			fd = fileno(fp);
+		}
+
+		// Disk size = Total size. The file is extended without writing, so the
+		// host only materializes the blocks that are actually written (sparse image)
+		if(ftruncate(fd, (off_t)sz * BLOCKSIZE) == -1)
+		{
+			printf("Error : Device COULD NOT be sized \n");
+			if(fp)
+				fclose(fp);
+			else
+				close(fd);
+			free(superblock);
+			return -1;
+		}
+
+		// Allocating disk to superblock
+		memcpy(tempBuf, superblock, sizeof(struct superblock_t));
+		writeblock(fd, 0, BLOCKSIZE, tempBuf);
+
+		printf("[%s] Disk image SUCCESSFULLY created \n", dev_name);
+	}
+	
+	//YES file did open
+	else
+	{
+		if(!mem)
+		{
+			fclose(fp);
+			fd = open(path, O_RDWR);
+		}
+
+		if(load_superblock(fd, superblock, &key) == -1)
+		{
+			close(fd);
+			free(superblock);
+			return -1;
+		}
+		if(superblock->stripe_members)
+		{
+			printf("Error: Device is a member of a striped volume (open it with openvolume) \n");
+			close(fd);
+			free(superblock);
+			return -1;
+		}
+		if(snapshot && superblock->snapshot_blocks[0] == 0)
+		{
+			printf("Error: No snapshot on device. \n");
+			close(fd);
+			free(superblock);
+			return -1;
+		}
+		printf("[%s] Disk opened \n", dev_name);
+
+		if(superblock->fs_number == -1)
+			printf("[%s] File system found in the disk \n", dev_name);
+		else
+			printf("[%s] File system found. fs_number: %d \n", dev_name, superblock->fs_number);
+		
+	}	
+
+	mount_point = add_new_mount_point(fd, dev_name, superblock->fs_number, superblock->block_size);
+	if(mount_point == -1)
+	{
+		printf("Error: No free mount point \n");
+		close(fd);
+		free(superblock);
+		return -1;
+	}
+	if(mem && map_memdevice(mount_point) == -1)
+	{
+		printf("Error: RAM disk COULD NOT be mapped \n");
+		closedevice_(mount_point);
+		free(superblock);
+		return -1;
+	}
+	if(superblock->fs_number==1)
+		mounts[mount_point].key=key;
+	if(snapshot)
+	{
+		mounts[mount_point].snapshot = 1;
+		memcpy(mounts[mount_point].snapshot_blocks, superblock->snapshot_blocks, INODE_BLOCKS);
+		printf("[%s] Snapshot mounted read-only \n", dev_name);
+	}
+
+	printf("[%s] Disk mount SUCCESS-> To infinity!!! \n", dev_name);
+	free(superblock);
+
+	return mount_point;	
+}
+
+
+void emufs_set_key(int key)
+{
+	/*
+		* Sets the key that opening an encrypted device or creating an encrypted
+		* file system uses instead of prompting for one (0 = prompt again,
+		* negative = never prompt: encrypted devices fail to open)
+	*/
+
+	preset_key = key;
+}
+
+
+int openvolume(char **member_names, int count, int stripe_blocks, int sz)
+{
+	/*
+		* Opens a volume striped over several image files (RAID-0)
+		* Logical blocks go to the members stripe_blocks at a time, round robin. The superblock
+		* (logical block 0, at the start of the first member) records the layout, so an existing
+		* volume must be opened with the same members in the same order.
+		* Creates the member images if the volume does not exist yet
+
+		* Return value: -1, 			error
+						 mount point,	success
+	*/
+
+	int fds[MAX_STRIPE_MEMBERS];
+	struct superblock_t superblock;
+	struct stat st;
+	int mount_point;
+	int key = 0;
+	int exists = 0;
+
+	if(!member_names || count < 2 || count > MAX_STRIPE_MEMBERS || stripe_blocks < 0 || stripe_blocks > MAX_BLOCKS)
+	{
+		printf("Error: Volume layout INVALID \n");
+		return -1;
+	}
+	if(sz > MAX_BLOCKS || sz < 3)
+	{
+		printf("Error: Disk size INVALID \n");
+		return -1;
+	}
+
+	for(int i=0; i<count; i++)
+	{
+		//Members are host files; RAM disks are not striped
+		fds[i] = -1;
+		if(member_names[i] && strlen(member_names[i]) > 0 && strlen(member_names[i]) < sizeof(mounts[0].device_name)
+			&& strncmp(member_names[i], MEM_PREFIX, strlen(MEM_PREFIX)) != 0)
+			fds[i] = open(member_names[i], O_RDWR | O_CREAT, 0666);
+		if(fds[i] == -1 || fstat(fds[i], &st) == -1)
+		{
+			printf("Error: Volume member %d COULD NOT be opened \n", i);
+			for(int j=0; j<=i; j++)
+				if(fds[j] != -1)
+					close(fds[j]);
+			return -1;
+		}
+		if(i == 0)
+			exists = st.st_size > 0;
+	}
+
+	if(exists)
+	{
+		if(load_superblock(fds[0], &superblock, &key) == -1 || superblock.stripe_members != count
+			|| (stripe_blocks && superblock.stripe_blocks != stripe_blocks))
+		{
+			printf("Error: Volume members do not match the super block \n");
+			for(int i=0; i<count; i++)
+				close(fds[i]);
+			return -1;
+		}
+		printf("[%s] Volume opened (%d members, stripe unit %d blocks) \n", member_names[0], count, superblock.stripe_blocks);
+	}
+	else
+	{
+		memset(&superblock, 0, sizeof(superblock));
+		superblock.fs_number = -1;	//	No fs in the volume
+		strcpy(superblock.device_name, member_names[0]);
+		superblock.disk_size = sz;
+		superblock.magic_number = MAGIC_NUMBER;
+		superblock.block_size = BLOCKSIZE;
+		superblock.stripe_members = count;
+		superblock.stripe_blocks = stripe_blocks ? stripe_blocks : 1;
+		superblock.layout = LAYOUT_MAGIC;
+	}
+
+	mount_point = add_new_mount_point(fds[0], member_names[0], superblock.fs_number, superblock.block_size);
+	if(mount_point == -1)
+	{
+		printf("Error: No free mount point \n");
+		for(int i=0; i<count; i++)
+			close(fds[i]);
+		return -1;
+	}
+	mounts[mount_point].stripe_count = count;
+	mounts[mount_point].stripe_blocks = superblock.stripe_blocks;
+	memcpy(mounts[mount_point].stripe_fds, fds, count * sizeof(int));
+	if(superblock.fs_number == EMUFS_ENCRYPTED)
+		mounts[mount_point].key = key;
+
+	if(!exists)
+	{
+		// Members are sized without writing (sparse), then the superblock is stored
+		if(resize_device(mount_point, (off_t)sz * BLOCKSIZE) == -1)
+		{
+			printf("Error : Volume COULD NOT be sized \n");
+			closedevice_(mount_point);
+			return -1;
+		}
+		write_superblock(mount_point, &superblock);
+		printf("[%s] Volume SUCCESSFULLY created (%d members) \n", member_names[0], count);
+	}
+
+	printf("[%s] Volume mount SUCCESS \n", member_names[0]);
+	return mount_point;
+}
+
+
+int closedevice_(int mount_point)
+{
+	/*
+		* Closes a device
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	char dev_name[20];
+
+	if(mounts[mount_point].device_fd < 0)
+	{
+		printf("Error: Devices not found\n");
+		return -1;
+	}
+
+	strcpy(dev_name, mounts[mount_point].device_name);
+	if(!mounts[mount_point].snapshot)
+		flush_punches(mount_point);
+	if(mounts[mount_point].mem)
+	{
+		if(!mounts[mount_point].snapshot)
+			save_memdevice(mount_point);
+		munmap(mounts[mount_point].mem, mounts[mount_point].mem_size);
+		mounts[mount_point].mem = NULL;
+	}
+	close(mounts[mount_point].device_fd);
+	for(int i=1; i<mounts[mount_point].stripe_count; i++)
+		close(mounts[mount_point].stripe_fds[i]);
+
+	mounts[mount_point].device_fd = -1;
+	mounts[mount_point].stripe_count = 0;
+	strcpy(mounts[mount_point].device_name, "\0");
+	mounts[mount_point].fs_number = -1;
+	bind_fs_ops(&mounts[mount_point]);
+	mounts[mount_point].snapshot = 0;
+	free(mounts[mount_point].cache);
+	mounts[mount_point].cache = NULL;
+
+	printf("[%s] Device closed \n", dev_name);
+	return 1;
+}
+
+void update_mount(int mount_point, int fs_number){
+
+	int key;
+
+    // Update the filesystem type (fs_number) for the specified mount point and bind its routines
+    mounts[mount_point].fs_number = fs_number;
+    bind_fs_ops(&mounts[mount_point]);
+
+    // If the file system is encrypted (fs_number == 1), take the preset key or ask for one
+    if (fs_number == 1 && preset_key > 0) {
+        mounts[mount_point].key = preset_key;
+    } else if (fs_number == 1) {
+        printf("Input encryption key: ");
+        
+        // Read the key from the user input (ensure it's a valid integer)
+        while (scanf("%d", &key) != 1 || key <= 0) {
+            // If invalid input, prompt the user to enter a valid positive integer
+            printf("Invalid key! Please enter a valid positive integer for the encryption key: ");
+            // Clear the buffer to avoid infinite loop on invalid input
+            while(getchar() != '\n');
+        }
+        
+        // Store the encryption key in the mount structure
+        mounts[mount_point].key = key;
+        
+        // Optionally, print a message that the key is set (you can remove this in production code)
+        printf("Encryption key set for the mounted file system.\n");
+    } else {
+        // If not encrypted, we can reset the key (this part is optional)
+        mounts[mount_point].key = 0;
+    }
+	/*
+		update the fstype in the mount and prompt the user for key if its an encryted system
+	*/
+}
+
+void mount_dump(void)
+{
+	/*
+		* Prints summary of mount points
+	*/
+
+	struct mount_t* mount_point;
+
+	printf("\n%-12s %-20s %-15s %-10s %-20s \n", "MOUNT-POINT", "DEVICE-NAME", "DEVICE-NUMBER", "FS-NUMBER", "FS-NAME");
+	for(int i=0; i< MAX_MOUNT_POINTS; i++)
+	{
+		mount_point = mounts + i;
+		if(mount_point->device_fd <= 0)
+			continue;
+
+		if(mount_point->device_fd > 0)
+			printf("%-12d %-20s %-15d %-10d %-20s\n", 
+					i, mount_point->device_name, mount_point->device_fd, mount_point->fs_number, mount_point->ops->name);
+	}
+}
+
+void read_superblock(int mount_point, struct superblock_t *superblock){
+	/*	
+		* Reads the superblock of the device through the mount's file system type
+	*/
+
+	EMUFS_SPAN("read_superblock");
+
+	mount_stats[mount_point].io.superblock_reads++;
+	mounts[mount_point].ops->read_superblock(mount_point, superblock);
+}
+
+void write_superblock(int mount_point, struct superblock_t *superblock){
+	/*
+		* Updates the superblock of the device through the mount's file system type
+	*/
+
+	EMUFS_SPAN("write_superblock");
+
+	mount_stats[mount_point].io.superblock_writes++;
+	mounts[mount_point].ops->write_superblock(mount_point, superblock);
+}
+
+int alloc_inode(int mount_point) {
+    /*
+        Function: alloc_inode
+        Purpose: This function allocates a free inode if available, by checking the inode bitmap.
+        Updates the inode bitmap and the number of used inodes accordingly.
+
+        Parameters:
+            mount_point: The mount point to identify the filesystem.
+
+        Return value:
+            -1: if no free inodes are available (error).
+            inode number: if a free inode is allocated successfully (success).
+    */
+
+    EMUFS_SPAN("alloc_inode");
+
+    // Structure to hold the superblock data
+    struct superblock_t superblock;
+
+    // Read the superblock data from the disk
+    read_superblock(mount_point, &superblock);
+
+    // If all inodes are already used, return error (-1)
+    if(superblock.used_inodes == MAX_INODES)
         return -1;
 
     // Loop through the inode bitmap to find a free inode
@@ -358,6 +1649,7 @@ int alloc_inode(int mount_point) {
 
             // Write the updated superblock data back to the disk
             write_superblock(mount_point, &superblock);
+            mount_stats[mount_point].io.inode_allocs++;
 
             // Return the index of the allocated inode
             return i;
@@ -368,12 +1660,46 @@ int alloc_inode(int mount_point) {
     return -1;
 }
 
+int alloc_inodes(int mount_point, int count, int *inodes){
+    /*
+        * Allocates `count` inodes (the lowest free ones) with a single superblock read-modify-write
+
+        * Return value: -1, not enough free inodes (nothing is allocated)
+                         1, success
+    */
+
+    EMUFS_SPAN("alloc_inodes");
+
+    struct superblock_t superblock;
+    read_superblock(mount_point, &superblock);
+
+    if(MAX_INODES - superblock.used_inodes < count)
+        return -1;
+
+    int n = 0;
+    for(int i = 0; n < count && i < MAX_INODES; i++){
+        if(superblock.inode_bitmap[i] == 0){
+            superblock.inode_bitmap[i] = 1;
+            inodes[n++] = i;
+        }
+    }
+    if(n < count)
+        return -1;
+
+    superblock.used_inodes += count;
+    write_superblock(mount_point, &superblock);
+    mount_stats[mount_point].io.inode_allocs += count;
+    return 1;
+}
+
 
 void free_inode(int mount_point, int inodenum){
 	/*
 	 * Marks the specified inode as free in the inode bitmap
 	 * and updates the count of used inodes in the superblock.
 	 */
+
+	EMUFS_SPAN("free_inode");
 	
 	// Define a variable to hold the superblock structure
 	struct superblock_t superblock;
@@ -389,81 +1715,75 @@ void free_inode(int mount_point, int inodenum){
 	
 	// Write the updated superblock back to disk
 	write_superblock(mount_point, &superblock);
+	mount_stats[mount_point].io.inode_frees++;
+}
+
+
+void read_inode(int mount_point, int inodenum, struct inode_t *inodeptr){
+    /*
+        * This function retrieves the inode metadata from the storage.
+        * A snapshot mount reads the snapshot's frozen copy of the inode table instead.
+        * Decryption, if any, is done by the mount's file system type.
+    */
+
+    EMUFS_SPAN("read_inode");
+
+    mount_stats[mount_point].io.inode_reads++;
+    mounts[mount_point].ops->read_inode(mount_point, inodenum, inodeptr);
+}
+
+
+void read_inode_table(int mount_point, struct inode_t *inodes){
+    /*
+        * Reads every metadata block once (decrypted by the mount's file system type),
+        * so callers that walk the tree do not re-read a block per inode.
+    */
+
+    EMUFS_SPAN("read_inode_table");
+
+    mount_stats[mount_point].io.inode_reads++;
+    mounts[mount_point].ops->read_inode_table(mount_point, inodes);
 }
 
 
-void read_inode(int mount_point, int inodenum, struct inode_t *inodeptr){
+void write_inode_table(int mount_point, struct inode_t *inodes){
     /*
-        * This function retrieves the inode metadata from the storage.
-        * It reads the appropriate block (block 2 or 3) based on the inode number.
-        * If the file system is encrypted, it decrypts the metadata block using a XOR operation.
-        * The specific inode entry is extracted from the metadata block and placed into the provided inode pointer.
+        * Writes the whole inode table (MAX_INODES entries) with one write per metadata block,
+        * encrypted by the mount's file system type. Used to store many inodes at once.
     */
 
-    struct metadata_t metadata;  // Structure to hold the metadata block read from the disk.
-    int block_offset = inodenum / 16;  // Determine the block offset based on inode number.
-    int entry_index = inodenum % 16;  // Calculate the index of the inode within the block.
-
-    // Read the metadata block from the disk. Offset depends on inode number.
-    readblock(mounts[mount_point].device_fd, 1 + block_offset, (char*)&metadata);
-
-    // If the filesystem is encrypted (fs_number == 1), decrypt the metadata block.
-    if (mounts[mount_point].fs_number == 1) {
-        xor_decrypt(mounts[mount_point].key, (char*)&metadata, BLOCKSIZE);
-    }
+    EMUFS_SPAN("write_inode_table");
 
-    // Copy the inode entry corresponding to the given index into the provided inode pointer.
-    *inodeptr = metadata.inodes[entry_index];
+    mount_stats[mount_point].io.inode_writes++;
+    mounts[mount_point].ops->write_inode_table(mount_point, inodes);
 }
 
 
 void write_inode(int mount_point, int inodenum, struct inode_t *inodeptr) {
     /*
         This function is responsible for updating the inode entry in the 
-        filesystem's metadata block. The steps are as follows:
-        1. Identify the appropriate metadata block based on the inode number.
-        2. If the filesystem is encrypted, decrypt the block before modification.
-        3. Update the inode entry at the correct location within the block.
-        4. If the filesystem is encrypted, re-encrypt the block after modification.
-        5. Write the updated metadata block back to the disk.
+        filesystem's metadata block, through the mount's file system type.
     */
 
-    struct metadata_t metadata;
-    int block_idx = inodenum / 16;  // Determine the block index based on inode number
-    int entry_idx = inodenum % 16;  // Determine the position within the block
-
-    // Read the metadata block from the storage device
-    readblock(mounts[mount_point].device_fd, 1 + block_idx, (char*)&metadata);
-
-    // Decrypt the block if the filesystem is encrypted
-    if (mounts[mount_point].fs_number == 1) {
-        xor_decrypt(mounts[mount_point].key, (char*)&metadata, BLOCKSIZE);
-    }
-
-    // Update the inode entry in the metadata block
-    metadata.inodes[entry_idx] = *inodeptr;
-
-    // Encrypt the block again if the filesystem is encrypted
-    if (mounts[mount_point].fs_number == 1) {
-        xor_encrypt(mounts[mount_point].key, (char*)&metadata, BLOCKSIZE);
-    }
+    EMUFS_SPAN("write_inode");
 
-    // Write the modified metadata block back to the device
-    writeblock(mounts[mount_point].device_fd, 1 + block_idx, (char*)&metadata);
+    mount_stats[mount_point].io.inode_writes++;
+    mounts[mount_point].ops->write_inode(mount_point, inodenum, inodeptr);
 }
 
 
 // Function to allocate a new data block
 // Returns the index of the allocated block or -1 if no blocks are available
 int alloc_datablock(int mount_point) {
+    EMUFS_SPAN("alloc_datablock");
     // Structure representing the superblock
     struct superblock_t superblock;
     
     // Read the superblock to get current disk information
     read_superblock(mount_point, &superblock);
 
-    // Check if all blocks are used; return -1 if disk is full
-    if(superblock.used_blocks == superblock.disk_size)
+    // Check if all blocks are used (or promised to write-back buffers); return -1 if disk is full
+    if(superblock.used_blocks + mounts[mount_point].reserved_blocks >= superblock.disk_size)
         return -1;
 
     // Iterate through the block bitmap to find a free block
@@ -474,6 +1794,7 @@ int alloc_datablock(int mount_point) {
             superblock.used_blocks++;         // Increment the count of used blocks
             // Write the updated superblock back to disk
             write_superblock(mount_point, &superblock);
+            mount_stats[mount_point].io.block_allocs++;
             return i;  // Return the index of the allocated block
         }
     }
@@ -483,16 +1804,71 @@ int alloc_datablock(int mount_point) {
 }
 
 
+int alloc_datablocks(int mount_point, int count, char *blocks){
+    /*
+        * Allocates `count` blocks with a single superblock read-modify-write.
+        * First looks for a free run long enough to hold them all (first fit),
+        * and falls back to the lowest free blocks if the free space is fragmented.
+
+        * Return value: -1, not enough free blocks
+                         1, success
+    */
+
+    EMUFS_SPAN("alloc_datablocks");
+
+    struct superblock_t superblock;
+    read_superblock(mount_point, &superblock);
+
+    if(superblock.disk_size - superblock.used_blocks - mounts[mount_point].reserved_blocks < count)
+        return -1;
+
+    int start = -1;
+    for(int i = 0, run = 0; i < superblock.disk_size; i++){
+        run = superblock.block_bitmap[i] ? 0 : run + 1;
+        if(run == count){
+            start = i - count + 1;
+            break;
+        }
+    }
+
+    int n = 0;
+    for(int i = (start == -1 ? 0 : start); n < count && i < superblock.disk_size; i++){
+        if(superblock.block_bitmap[i] == 0){
+            superblock.block_bitmap[i] = 1;
+            blocks[n++] = i;
+        }
+    }
+    if(n < count)
+        return -1;
+
+    superblock.used_blocks += count;
+    write_superblock(mount_point, &superblock);
+    mount_stats[mount_point].io.block_allocs += count;
+    return 1;
+}
+
+
 void free_datablock(int mount_point, int blocknum){
     /*
         * This function marks the specified data block as free.
         * It updates the block bitmap and the number of used blocks in the superblock.
+        * A shared block only loses one reference and stays allocated.
     */
 
+    EMUFS_SPAN("free_datablock");
+
     struct superblock_t superblock;  // Declare a structure to hold the superblock data.
     
     // Read the current superblock data from the specified mount point.
     read_superblock(mount_point, &superblock);
+    mount_stats[mount_point].io.block_frees++;
+
+    // If other files still reference the block, just drop this reference.
+    if(superblock.block_refs[blocknum] > 0){
+        superblock.block_refs[blocknum]--;
+        write_superblock(mount_point, &superblock);
+        return;
+    }
     
     // Mark the block as free in the block bitmap by setting the corresponding entry to 0.
     superblock.block_bitmap[blocknum] = 0;
@@ -502,32 +1878,570 @@ void free_datablock(int mount_point, int blocknum){
     
     // Write the updated superblock data back to the storage.
     write_superblock(mount_point, &superblock);
+
+    // The block's content is gone, so it can no longer be a dedup match.
+    if(superblock.dedup_index)
+        dedup_update(mount_point, blocknum, 0);
+
+    // Give the space back to the host once enough frees have piled up.
+    queue_punch(mount_point, blocknum);
+}
+
+void free_batch(int mount_point, char *blocks, int nblocks, char *inodes, int ninodes){
+    /*
+        * Frees a set of data blocks and inodes with one superblock read-modify-write.
+        * Shared blocks only lose one reference, exactly as in free_datablock.
+        * Dedup index entries of the blocks actually freed are cleared in one index update.
+    */
+
+    EMUFS_SPAN("free_batch");
+
+    struct superblock_t superblock;
+    char freed[MAX_INODES * MAX_FILE_SIZE + INODE_BLOCKS];
+    int nfreed = 0;
+
+    read_superblock(mount_point, &superblock);
+    mount_stats[mount_point].io.block_frees += nblocks;
+    mount_stats[mount_point].io.inode_frees += ninodes;
+
+    for(int i = 0; i < nblocks; i++){
+        int blocknum = blocks[i];
+        if(superblock.block_refs[blocknum] > 0){
+            superblock.block_refs[blocknum]--;
+            continue;
+        }
+        superblock.block_bitmap[blocknum] = 0;
+        superblock.used_blocks--;
+        freed[nfreed++] = blocknum;
+    }
+
+    for(int i = 0; i < ninodes; i++){
+        superblock.inode_bitmap[(int)inodes[i]] = 0;
+        superblock.used_inodes--;
+    }
+
+    write_superblock(mount_point, &superblock);
+
+    if(superblock.dedup_index && nfreed){
+        struct dedup_index_t index;
+        read_dedup_index(mount_point, superblock.dedup_index, &index);
+        for(int i = 0; i < nfreed; i++)
+            index.hashes[(int)freed[i]] = 0;
+        write_dedup_index(mount_point, superblock.dedup_index, &index);
+    }
+
+    // Queued only now, so a flush triggered here sees the updated bitmap.
+    for(int i = 0; i < nfreed; i++)
+        queue_punch(mount_point, freed[i]);
+}
+
+
+/*-----------HOST SPACE------------*/
+static void dev_punch(int mount_point, int first, int count){
+    // Releases the host space of a range of blocks, one call per run that is contiguous on a device
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int bs = mounts[mount_point].block_size;
+    for(int b = first; b < first + count; ){
+        int fd, next_fd, n = 1;
+        int phys = dev_locate(mount_point, b, &fd);
+        while(b + n < first + count && dev_locate(mount_point, b + n, &next_fd) == phys + n && next_fd == fd)
+            n++;
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)phys * bs, (off_t)n * bs);
+        b += n;
+    }
+#endif
+}
+
+void queue_punch(int mount_point, int blocknum){
+    /*
+        * Remembers a freed block; the queue is flushed in one pass every PUNCH_BATCH frees
+    */
+
+    struct mount_t *mount = &mounts[mount_point];
+    if(mount->punch_pending[blocknum])
+        return;
+    mount->punch_pending[blocknum] = 1;
+    if(++mount->punch_count >= PUNCH_BATCH)
+        flush_punches(mount_point);
+}
+
+void flush_punches(int mount_point){
+    /*
+        * Releases the host storage behind freed blocks with fallocate(PUNCH_HOLE).
+        * The host frees whole pages only, so a queued block is punched together with the other
+        * blocks sharing its host page, and only if all of them are free. Adjacent free pages are
+        * merged into one call. Blocks whose page is still partly in use are dropped from the
+        * queue; they are queued again when their neighbours are freed.
+    */
+
+    EMUFS_SPAN("flush_punches");
+
+    struct mount_t *mount = &mounts[mount_point];
+    if(mount->punch_count == 0)
+        return;
+
+    struct superblock_t superblock;
+    read_superblock(mount_point, &superblock);
+
+    int bs = mount->block_size;
+    long page = sysconf(_SC_PAGESIZE);
+    int per_page = page > bs ? page / bs : 1;
+    int range_start = -1, range_end = -1;
+
+    for(int first = 0; first < superblock.disk_size; first += per_page){
+        int queued = 0, all_free = first + per_page <= superblock.disk_size;
+        for(int b = first; b < first + per_page && b < superblock.disk_size; b++){
+            queued |= mount->punch_pending[b];
+            all_free &= !superblock.block_bitmap[b];
+            mount->punch_pending[b] = 0;
+        }
+
+        if(queued && all_free && range_end == first){
+            range_end = first + per_page;   // extends the current range
+            continue;
+        }
+        if(range_start != -1)
+            dev_punch(mount_point, range_start, range_end - range_start);
+        range_start = range_end = -1;
+        if(queued && all_free){
+            range_start = first;
+            range_end = first + per_page;
+        }
+    }
+    if(range_start != -1)
+        dev_punch(mount_point, range_start, range_end - range_start);
+
+    mount->punch_count = 0;
+}
+
+
+/*-----------DEDUP------------*/
+static unsigned int rotl32(unsigned int x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+unsigned int block_hash(const char *buf, int size)
+{
+	/*
+		* xxHash32-style hash. The 16-byte stripes feed four independent lanes,
+		* which keeps the main loop free of dependencies so it vectorizes.
+	*/
+
+	const unsigned int P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u, P4 = 668265263u, P5 = 374761393u;
+	const unsigned char *p = (const unsigned char*)buf, *end = p + size;
+	unsigned int h, w;
+
+	if(size >= 16)
+	{
+		unsigned int v[4] = { P1 + P2, P2, 0, 0u - P1 };
+		while(p + 16 <= end)
+		{
+			for(int l=0; l<4; l++)
+			{
+				memcpy(&w, p + 4 * l, 4);
+				v[l] = rotl32(v[l] + w * P2, 13) * P1;
+			}
+			p += 16;
+		}
+		h = rotl32(v[0], 1) + rotl32(v[1], 7) + rotl32(v[2], 12) + rotl32(v[3], 18);
+	}
+	else
+		h = P5;
+
+	h += size;
+	while(p + 4 <= end)
+	{
+		memcpy(&w, p, 4);
+		h = rotl32(h + w * P3, 17) * P4;
+		p += 4;
+	}
+	while(p < end)
+		h = rotl32(h + (*p++) * P5, 11) * P1;
+
+	h ^= h >> 15;
+	h *= P2;
+	h ^= h >> 13;
+	h *= P3;
+	h ^= h >> 16;
+
+	return h ? h : 1;
+}
+
+int dedup_lookup(int mount_point, char *buf, unsigned int hash)
+{
+	/*
+		* Scans the hash index for blocks with the same hash and compares their content,
+		* so a hash collision never merges different blocks.
+
+		* Return value: -1,				no match (or dedup off)
+						 block number,	success
+	*/
+
+	struct superblock_t superblock;
+	struct dedup_index_t index;
+	char temp_buf[mounts[mount_point].block_size];
+
+	read_superblock(mount_point, &superblock);
+	if(!superblock.dedup_index)
+		return -1;
+	read_dedup_index(mount_point, superblock.dedup_index, &index);
+
+	for(int i=0; i<MAX_BLOCKS; i++)
+	{
+		// A block whose reference count is full cannot take another reference
+		if(index.hashes[i] != hash || !superblock.block_bitmap[i] || superblock.block_refs[i] == MAX_BLOCK_REFS)
+			continue;
+		read_datablock(mount_point, i, temp_buf);
+		if(memcmp(temp_buf, buf, mounts[mount_point].block_size) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void dedup_update(int mount_point, int blocknum, unsigned int hash)
+{
+	/*
+		* Records the hash of a block in the index; the index block is only rewritten if it changes
+	*/
+
+	struct superblock_t superblock;
+	struct dedup_index_t index;
+
+	read_superblock(mount_point, &superblock);
+	if(!superblock.dedup_index)
+		return;
+	read_dedup_index(mount_point, superblock.dedup_index, &index);
+	if(index.hashes[blocknum] == hash)
+		return;
+	index.hashes[blocknum] = hash;
+	write_dedup_index(mount_point, superblock.dedup_index, &index);
+}
+
+void read_dedup_index(int mount_point, int blocknum, struct dedup_index_t *index)
+{
+	/*
+		* The index takes the start of its block; the rest of the block is unused
+	*/
+
+	char block[mounts[mount_point].block_size];
+	read_datablock(mount_point, blocknum, block);
+	memcpy(index, block, sizeof(struct dedup_index_t));
+}
+
+void write_dedup_index(int mount_point, int blocknum, struct dedup_index_t *index)
+{
+	char block[mounts[mount_point].block_size];
+	memset(block, 0, mounts[mount_point].block_size);
+	memcpy(block, index, sizeof(struct dedup_index_t));
+	write_datablock(mount_point, blocknum, block);
+}
+
+int share_datablock(int mount_point, int blocknum)
+{
+	/*
+		* Adds a reference to an allocated block
+
+		* Return value: -1, the reference count is full (the caller stores its own copy)
+						 1, success
+	*/
+
+	struct superblock_t superblock;
+	read_superblock(mount_point, &superblock);
+	if(superblock.block_refs[blocknum] == MAX_BLOCK_REFS)
+		return -1;
+	superblock.block_refs[blocknum]++;
+	write_superblock(mount_point, &superblock);
+	return 1;
+}
+
+int datablock_shared(int mount_point, int blocknum)
+{
+	/*
+		* Return value: 1, the block has more than one reference
+						 0, the block is owned by a single file
+	*/
+
+	struct superblock_t superblock;
+	read_superblock(mount_point, &superblock);
+	return superblock.block_refs[blocknum] > 0;
 }
 
 void read_datablock(int mount_point, int blocknum, char *buf){
 	/*
 		* Read the specified block of data into the provided buffer.
-		* If the system uses encryption, decrypt the block before storing it in memory.
+		* The mount's file system type decrypts it if the system uses encryption.
 	*/
 
-	// Read the block of data from the device into the buffer
-	readblock(mounts[mount_point].device_fd, blocknum, buf);
+	EMUFS_SPAN("read_datablock");
 
-	// Check if the filesystem uses encryption (fs_number == 1) and decrypt if necessary
-	if(mounts[mount_point].fs_number == 1)
-		xor_decrypt(mounts[mount_point].key, buf, BLOCKSIZE);
+	mounts[mount_point].ops->read_datablock(mount_point, blocknum, buf);
 }
 
 void write_datablock(int mount_point, int blocknum, char *buf){
 	/*
-		* If the system is encrypted, encrypt the buffer before writing.
-		* Write the processed buffer to the corresponding block on the disk.
+		* Write the buffer to the corresponding block on the disk.
+		* The mount's file system type encrypts it (in place) if the system uses encryption.
+	*/
+
+	EMUFS_SPAN("write_datablock");
+
+	mounts[mount_point].ops->write_datablock(mount_point, blocknum, buf);
+}
+
+void write_datablocks(int mount_point, char *blocks, int count, char *buf){
+	/*
+		* Write several blocks in one call (the members of a striped volume are written in parallel).
+		* Like write_datablock, the buffer is encrypted in place on an encrypted file system.
+	*/
+
+	EMUFS_SPAN("write_datablocks");
+
+	mounts[mount_point].ops->write_datablocks(mount_point, blocks, count, buf);
+}
+
+static int file_blocks_mapped(int mount_point, struct inode_t *inodeptr)
+{
+	/*
+		* Counts the physical blocks holding a file on a compressed filesystem.
+		* Mapped blocks always form a prefix of the mappings; only entries covered by the size are valid.
+	*/
+
+	int bs = mounts[mount_point].block_size;
+	int num_blocks = inodeptr->size / bs;
+	if(num_blocks * bs < inodeptr->size)
+		num_blocks++;
+
+	int mapped = 0;
+	while(mapped < num_blocks && inodeptr->mappings[mapped] != -1)
+		mapped++;
+	return mapped;
+}
+
+int read_file_data(int mount_point, struct inode_t *inodeptr, char *buf)
+{
+	/*
+		* Reads all physical blocks of the file and rebuilds its content.
+		* If as many blocks are mapped as the size needs, the data is stored raw.
+		* Otherwise the blocks hold a 2-byte compressed length followed by the LZ stream.
+		* A file with no block mapped reads as zeros.
+
+		* Return value: -1, corrupt stream
+						 1, success
+	*/
+
+	int bs = mounts[mount_point].block_size;
+	char stream[(mounts[mount_point].max_file_size + bs - 1) / bs * bs];
+	int num_blocks = inodeptr->size / bs;
+	if(num_blocks * bs < inodeptr->size)
+		num_blocks++;
+	int mapped = file_blocks_mapped(mount_point, inodeptr);
+
+	prefetch_blocks(mount_point, inodeptr->mappings, mapped, NULL, 0);
+	for(int i=0; i<mapped; i++)
+		read_datablock(mount_point, inodeptr->mappings[i], stream + i * bs);
+
+	if(mapped == num_blocks)
+	{
+		memcpy(buf, stream, inodeptr->size);
+		return 1;
+	}
+
+	// Nothing stored: the whole file is a hole
+	if(mapped == 0)
+	{
+		memset(buf, 0, inodeptr->size);
+		return 1;
+	}
+
+	int clen = (unsigned char)stream[0] | ((unsigned char)stream[1] << 8);
+	if(clen + 2 > mapped * bs)
+		return -1;
+	if(lz_decompress(stream + 2, clen, buf, inodeptr->size) != inodeptr->size)
+		return -1;
+	return 1;
+}
+
+int write_file_data(int mount_point, struct inode_t *inodeptr, char *buf, int size)
+{
+	/*
+		* Compresses the new content and stores it in as few blocks as possible.
+		* The data is kept compressed only if that saves at least one block.
+		* Existing blocks are reused, missing ones allocated and surplus ones freed.
+		* Shared blocks (snapshot) are never rewritten in place but copied.
+
+		* Return value: -1, not enough free blocks
+						 1, success
+	*/
+
+	int bs = mounts[mount_point].block_size;
+	char stream[(mounts[mount_point].max_file_size + bs - 1) / bs * bs];
+	int num_blocks = size / bs;
+	if(num_blocks * bs < size)
+		num_blocks++;
+
+	int needed = num_blocks;
+	int clen = -1;
+	if(num_blocks > 1)
+		clen = lz_compress(buf, size, stream + 2, (num_blocks - 1) * bs - 2);
+	if(clen > 0)
+	{
+		stream[0] = clen & 0xff;
+		stream[1] = clen >> 8;
+		needed = (clen + 2 + bs - 1) / bs;
+	}
+	else
+		memcpy(stream, buf, size);
+
+	int mapped = file_blocks_mapped(mount_point, inodeptr);
+	struct superblock_t superblock;
+	read_superblock(mount_point, &superblock);
+
+	// New blocks, plus a copy of every shared block that is rewritten
+	int num_req = needed > mapped ? needed - mapped : 0;
+	for(int i=0; i<needed && i<mapped; i++)
+		if(superblock.block_refs[(int)inodeptr->mappings[i]] > 0)
+			num_req++;
+	if(superblock.disk_size - superblock.used_blocks - mounts[mount_point].reserved_blocks < num_req)
+		return -1;
+
+	for(int i=0; i<needed; i++)
+	{
+		if(i >= mapped)
+			inodeptr->mappings[i] = alloc_datablock(mount_point);
+		else if(datablock_shared(mount_point, inodeptr->mappings[i]))
+		{
+			int blocknum = alloc_datablock(mount_point);
+			free_datablock(mount_point, inodeptr->mappings[i]);
+			inodeptr->mappings[i] = blocknum;
+		}
+		write_datablock(mount_point, inodeptr->mappings[i], stream + i * bs);
+	}
+	for(int i=needed; i<mapped; i++)
+		free_datablock(mount_point, inodeptr->mappings[i]);
+	for(int i=needed; i<MAX_FILE_SIZE; i++)
+		inodeptr->mappings[i] = -1;
+
+	inodeptr->size = size;
+	return 1;
+}
+
+
+/*-----------STATISTICS------------*/
+static int hist_bucket(long long ns)
+{
+	// Below 8 ns one bucket per value, then 8 buckets per power of two
+	if(ns < 8)
+		return ns < 0 ? 0 : (int)ns;
+	int exp = 63 - __builtin_clzll(ns);
+	int bucket = (exp - 2) * 8 + (int)((ns >> (exp - 3)) & 7);
+	return bucket < EMUFS_HIST_BUCKETS ? bucket : EMUFS_HIST_BUCKETS - 1;
+}
+
+static long long hist_bucket_top(int bucket)
+{
+	// Largest value that falls into the bucket
+	if(bucket < 8)
+		return bucket;
+	int exp = bucket / 8 + 2;
+	return ((8LL + bucket % 8 + 1) << (exp - 3)) - 1;
+}
+
+static int stats_mounted(int mount_point)
+{
+	return mount_point >= 0 && mount_point < MAX_MOUNT_POINTS && mounts[mount_point].device_fd > 0;
+}
+
+void stats_record_call(int mount_point, int call, long long latency_ns, long device_ios)
+{
+	if(!stats_mounted(mount_point) || call < 0 || call >= EMUFS_STAT_CALLS)
+		return;
+
+	struct emufs_histogram_t *hist = &mount_stats[mount_point].calls[call];
+	hist->count++;
+	hist->total_ns += latency_ns;
+	if(latency_ns > hist->max_ns)
+		hist->max_ns = latency_ns;
+	hist->device_ios += device_ios;
+	hist->buckets[hist_bucket(latency_ns)]++;
+}
+
+long stats_device_ios(int mount_point)
+{
+	if(!stats_mounted(mount_point))
+		return 0;
+	return mount_stats[mount_point].io.block_reads + mount_stats[mount_point].io.block_writes;
+}
+
+int emufs_stats(int mount_point, struct emufs_stats_t *stats)
+{
+	/*
+		* Copies the statistics of the mount
+
+		* Return value: -1, nothing mounted there
+						 1, success
 	*/
 
-	// Encrypt the buffer if the filesystem uses encryption
-	if(mounts[mount_point].fs_number == 1)
-		xor_encrypt(mounts[mount_point].key, buf, BLOCKSIZE);
+	if(!stats_mounted(mount_point))
+		return -1;
+	memcpy(stats, &mount_stats[mount_point], sizeof(struct emufs_stats_t));
+	return 1;
+}
+
+void emufs_stats_reset(int mount_point)
+{
+	if(stats_mounted(mount_point))
+		memset(&mount_stats[mount_point], 0, sizeof(struct emufs_stats_t));
+}
+
+long long emufs_histogram_percentile(const struct emufs_histogram_t *hist, double percent)
+{
+	long rank, seen = 0;
+
+	if(hist->count == 0)
+		return 0;
+	rank = (long)(hist->count * percent / 100.0 + 0.5);
+	if(rank < 1)
+		rank = 1;
+	for(int i=0; i<EMUFS_HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if(seen >= rank)
+			return hist_bucket_top(i) < hist->max_ns ? hist_bucket_top(i) : hist->max_ns;
+	}
+	return hist->max_ns;
+}
+
+void emufs_stats_dump(int mount_point, FILE *out)
+{
+	static const char *call_names[EMUFS_STAT_CALLS] = {"emufs_read", "emufs_write", "open_file", "emufs_create", "emufs_delete"};
+	struct emufs_stats_t stats;
+
+	if(emufs_stats(mount_point, &stats) == -1)
+	{
+		fprintf(out, "Error: Nothing mounted at %d\n", mount_point);
+		return;
+	}
 
-	// Write the buffer data to the specified block on the device
-	writeblock(mounts[mount_point].device_fd, blocknum, buf);
+	struct emufs_io_stats_t *io = &stats.io;
+	fprintf(out, "Mount %d (%s)\n", mount_point, mounts[mount_point].device_name);
+	fprintf(out, "  blocks      read %-10ld written %-10ld cache hits %-10ld misses %ld\n",
+			io->block_reads, io->block_writes, io->cache_hits, io->cache_misses);
+	fprintf(out, "  superblock  read %-10ld written %ld\n", io->superblock_reads, io->superblock_writes);
+	fprintf(out, "  inodes      read %-10ld written %-10ld allocated  %-10ld freed  %ld\n",
+			io->inode_reads, io->inode_writes, io->inode_allocs, io->inode_frees);
+	fprintf(out, "  data blocks allocated %-5ld freed %ld\n", io->block_allocs, io->block_frees);
+
+	fprintf(out, "  %-13s %8s %10s %10s %10s %10s %10s %9s\n", "call", "count", "avg us", "p50 us", "p90 us", "p99 us", "max us", "I/Os/call");
+	for(int i=0; i<EMUFS_STAT_CALLS; i++)
+	{
+		struct emufs_histogram_t *hist = &stats.calls[i];
+		if(hist->count == 0)
+			continue;
+		fprintf(out, "  %-13s %8ld %10.2f %10.2f %10.2f %10.2f %10.2f %9.2f\n", call_names[i], hist->count,
+				hist->total_ns / 1e3 / hist->count,
+				emufs_histogram_percentile(hist, 50) / 1e3, emufs_histogram_percentile(hist, 90) / 1e3,
+				emufs_histogram_percentile(hist, 99) / 1e3, hist->max_ns / 1e3,
+				(double)hist->device_ios / hist->count);
+	}
 }
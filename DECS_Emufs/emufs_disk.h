@@ -7,23 +7,39 @@
 #include <unistd.h>     // POSIX API for system calls like read, write, etc.
 #include <time.h>       // Time-related functions
 #include <string.h>     // String manipulation functions
+#include <sys/mman.h>   // mmap and memfd_create, for RAM disks
+#include <aio.h>        // lio_listio, for parallel I/O on striped volumes
+#include <errno.h>      // errno, to tell failed volume requests from failed submissions
+#include "emufs_span.h"   // Trace points (EMUFS_SPAN)
 
 // Definitions for the filesystem's configuration and constraints
-#define BLOCKSIZE 256          // Size of a block in bytes
+#define BLOCKSIZE 256          // Default (and smallest) size of a block in bytes
+#define MAX_BLOCKSIZE 65536    // Largest block size a file system can be created with
 #define MAX_BLOCKS 64          // Maximum number of blocks on the disk
                                // Includes 1 superblock, 1 metadata block, and 40 data blocks
 #define MAX_FILE_SIZE 4        // Maximum file size in blocks (4 blocks per file)
+#define MAX_FILE_BYTES 65535   // Maximum file size in bytes (inode_t.size is 16 bits)
 #define MAX_INODES 32          // Maximum number of inodes supported
+#define INODE_BLOCKS 2         // Most blocks the inode table can take (2 with 256-byte blocks, else 1)
+#define MAX_BLOCK_REFS 255     // Most extra references a shared block can hold (superblock_t.block_refs)
 
 // States for resource allocation
 #define UNUSED 0               // Represents an unused resource (inode or block)
 #define USED 1                 // Represents an allocated resource
 
 #define MAGIC_NUMBER 6763      // Unique identifier for the filesystem type
+#define LAYOUT_MAGIC 0x32534645 // Marks a superblock whose fields after the block bitmap are set ("EFS2")
+
+#define CACHE_BLOCKS 32        // Blocks kept in each mount's block cache
+#define MAX_READAHEAD MAX_FILE_SIZE  // Largest readahead window, in blocks
+#define PUNCH_BATCH 16         // Freed blocks queued before their host space is released
+#define MEM_PREFIX "mem:"      // Device names starting with this are RAM disks
+#define MAX_STRIPE_MEMBERS 8   // Most image files a striped volume can span
 
 // File system types
 #define EMUFS_NON_ENCRYPTED 0  // Non-encrypted filesystem
 #define EMUFS_ENCRYPTED 1      // Encrypted filesystem
+#define EMUFS_COMPRESSED 2     // Compressed filesystem (file data stored as an LZ stream)
 
 /* ------------------- In-Disk objects ------------------- */
 
@@ -38,6 +54,14 @@ struct superblock_t
     char used_blocks;					// Number of blocks currently in use
     char inode_bitmap[MAX_INODES];      // Bitmap for inode allocation (0 = free, 1 = allocated)
     char block_bitmap[MAX_BLOCKS];    	// Bitmap for block allocation (0 = free, 1 = allocated)
+    unsigned char block_refs[MAX_BLOCKS]; // Extra references to each block (0 = owned by a single file)
+    char dedup_index;                   // Block holding the dedup hash index (0 = dedup off)
+    char snapshot_blocks[INODE_BLOCKS]; // Blocks holding the snapshot's frozen inode table (0 = no snapshot)
+    int block_size;                     // Size of a block in bytes, chosen when the file system is created
+                                        // The superblock always fits in the first BLOCKSIZE bytes of block 0
+    int stripe_members;                 // Image files of a striped volume (0 = single device)
+    int stripe_blocks;                  // Stripe unit of a striped volume in blocks
+    int layout;                         // LAYOUT_MAGIC; anything else is an image made before the fields above
 };
 
 // Structure to represent an inode
@@ -50,17 +74,58 @@ struct inode_t		// 16 bytes in size
     char mappings[4];		    // Block mappings for the file
                                 // mappings[i] = -1 : block is not allocated
                                 // mappings[i] > 0  : block number
+                                // On a compressed filesystem only the first few mappings
+                                // hold blocks; the rest are -1. If fewer blocks are mapped
+                                // than the size needs, the data is stored compressed.
 };
 
-// Structure to represent metadata (array of inodes)
-// This is stored in the metadata block of the disk
-struct metadata_t	// 256 bytes (BLOCKSIZE)
+// The inode table is stored from block 1 on, block_size / 16 inodes per block
+
+// Structure to represent the dedup hash index
+// Stored in the block recorded in superblock_t.dedup_index
+struct dedup_index_t	// 256 bytes (fits in a block of any size)
 {
-    struct inode_t inodes[BLOCKSIZE / 16];	// Array of inodes (16 bytes each)
+    unsigned int hashes[MAX_BLOCKS];	// Content hash of each data block (0 = not indexed)
 };
 
 /* ------------------- In-Memory objects ------------------- */
 
+// Structure to represent one cached device block
+struct cache_entry_t
+{
+    int blocknum;               // Block held by this entry (-1 = empty)
+    unsigned int last_use;      // Cache clock at the last access, for LRU replacement
+    char *data;                 // Block content as stored on the device (still encrypted)
+};
+
+// Structure to represent the block cache of a mount
+// Write-through: the device is always up to date, the cache only saves reads
+struct block_cache_t
+{
+    unsigned int clock;                         // Incremented on every access
+    struct cache_entry_t entries[CACHE_BLOCKS];
+    char data[];                                // CACHE_BLOCKS blocks of the mount's block size
+};
+
+// Structure to represent the routines of a file system type
+// Bound to a mount once its type is known, so the I/O paths never test fs_number
+struct fs_ops_t
+{
+    const char *name;                   // Name shown by mount_dump
+    void (*read_superblock)(int mount_point, struct superblock_t *superblock);
+    void (*write_superblock)(int mount_point, struct superblock_t *superblock);
+    void (*read_inode)(int mount_point, int inodenum, struct inode_t *inodeptr);
+    void (*write_inode)(int mount_point, int inodenum, struct inode_t *inodeptr);
+    void (*read_inode_table)(int mount_point, struct inode_t *inodes);
+    void (*write_inode_table)(int mount_point, struct inode_t *inodes);
+    void (*read_datablock)(int mount_point, int blocknum, char *buf);
+    void (*write_datablock)(int mount_point, int blocknum, char *buf);
+    void (*write_datablocks)(int mount_point, char *blocks, int count, char *buf);
+    // Whole-file access for types that store a file's content as one stream (NULL: block-mapped files)
+    int (*read_file)(int mount_point, struct inode_t *inodeptr, char *buf);
+    int (*write_file)(int mount_point, struct inode_t *inodeptr, char *buf, int size);
+};
+
 // Structure to represent a mounted device
 struct mount_t
 {
@@ -69,11 +134,92 @@ struct mount_t
 					            //  > 0: Active file descriptor
     char device_name[20]; 	    // Name of the emulated device file
     int fs_number;              // Filesystem type (non-encrypted or encrypted)
+    const struct fs_ops_t *ops; // Routines of the filesystem type (bound with fs_number)
     int key;                    // Encryption key (used only for encrypted filesystems)
+    int block_size;             // Size of a block in bytes (from the superblock)
+    int inode_blocks;           // Blocks holding the inode table
+    int max_file_size;          // Largest file size in bytes (MAX_FILE_SIZE blocks, at most MAX_FILE_BYTES)
+    int snapshot;               // 1: read-only mount of the device's snapshot
+    char snapshot_blocks[INODE_BLOCKS]; // Inode table of the snapshot (used only for snapshot mounts)
+    struct block_cache_t *cache; // Block cache of the mount (allocated at mount time)
+    char *mem;                  // Mapped memory of a RAM disk (NULL: the device is a host file)
+    size_t mem_size;            // Size of the mapping in bytes
+    char punch_pending[MAX_BLOCKS]; // Freed blocks whose host space has not been released yet
+    int punch_count;            // Number of blocks in punch_pending
+    int reserved_blocks;        // Free blocks promised to write-back buffers (delayed allocation);
+                                // no allocation may take them
+    int stripe_count;           // Members of a striped volume (0: single device)
+    int stripe_blocks;          // Stripe unit in blocks
+    int stripe_fds[MAX_STRIPE_MEMBERS]; // Member devices in stripe order (stripe_fds[0] is device_fd)
 };
 
+extern struct mount_t mounts[];  // Mount table, indexed by mount point
+
+/*--------Compression---------*/
+
+// Function to compress a buffer with the in-tree LZ codec (LZ4-style sequences)
+// `src`/`len` is the input, `dst`/`cap` the output buffer
+// Returns the compressed length, or -1 if the output does not fit in `cap`
+int lz_compress(const char *src, int len, char *dst, int cap);
+
+// Function to decompress a buffer produced by lz_compress
+// `src`/`clen` is the compressed input, `dst`/`cap` the output buffer
+// Returns the decompressed length, or -1 if the input is corrupt or does not fit
+int lz_decompress(const char *src, int clen, char *dst, int cap);
+
 /*--------Device--------------*/
 
+// Functions to write and read one block of `block_size` bytes of a device file, bypassing the cache
+// `dev_fd` is the device's file descriptor, `block` the block number. Return 1 on success or -1 on failure
+int writeblock(int dev_fd, int block, int block_size, char* buf);
+int readblock(int dev_fd, int block, int block_size, char* buf);
+
+// Function to write `count` consecutive blocks of a device file with one write, bypassing the cache
+// Returns 1 on success or -1 on failure
+int writeblocks(int dev_fd, int block, int count, int block_size, char* buf);
+
+// Function to open the memory of a RAM disk named "mem:" or "mem:<path>"
+// Shares the memory of a mounted RAM disk of the same name, else creates it (loaded from <path> if present)
+// `exists` is set to 0 for new, empty memory. Returns the memory's file descriptor or -1 on failure
+int open_memdevice(char *path, int *exists);
+
+// Function to map the memory of a mounted RAM disk (again, after its size changed)
+// Returns 1 on success or -1 on failure
+int map_memdevice(int mount_point);
+
+// Function to save a RAM disk named "mem:<path>" to the image at <path> (all-zero blocks become holes)
+void save_memdevice(int mount_point);
+
+// Function to set the size of a mounted device in bytes; the new space is not written
+// Returns 1 on success or -1 on failure
+int resize_device(int mount_point, off_t size);
+
+
+// Function to read a block of a mounted device through the mount's block cache
+// `mount_point` is the index, `blocknum` the block, `buf` receives the raw block content
+// Returns 1 on success or -1 on failure
+int dev_readblock(int mount_point, int blocknum, char *buf);
+
+// Function to write a block of a mounted device (write-through, the cached copy is updated)
+// Returns 1 on success or -1 on failure
+int dev_writeblock(int mount_point, int blocknum, char *buf);
+
+// Function to write several blocks of a mounted device (write-through, like dev_writeblock)
+// `blocks`/`count` lists the blocks, `buf` holds their content one after the other
+// The members of a striped volume are written in parallel. Returns 1 on success or -1 on failure
+int dev_writeblocks(int mount_point, char *blocks, int count, char *buf);
+
+// Function to bring blocks into the mount's block cache ahead of use
+// Blocks already cached are skipped; runs of consecutive blocks are read with a single device read.
+// `blocks`/`count` lists the blocks to load, `hint`/`hint_count` further blocks the host is asked
+// to start reading asynchronously (they are not loaded into the cache)
+void prefetch_blocks(int mount_point, char *blocks, int count, char *hint, int hint_count);
+
+// Function to set the block size of a mount and size its block cache for it
+// The cache is emptied. Returns 1 on success or -1 if the size is not a power of two
+// between BLOCKSIZE and MAX_BLOCKSIZE
+int set_block_size(int mount_point, int block_size);
+
 // Function to close a device by its mount point
 // `mount_point` is the index of the mounted device
 // Returns 0 on success, -1 on failure
@@ -98,6 +244,10 @@ void write_superblock(int mount_point, struct superblock_t *superblock);
 // Returns the index of the allocated inode or -1 if no inodes are available
 int alloc_inode(int mount_point);
 
+// Function to allocate several inodes in one superblock update
+// `count` inode numbers are stored in `inodes`. Returns 1 on success or -1 if there are not enough free inodes
+int alloc_inodes(int mount_point, int count, int *inodes);
+
 // Function to free a previously allocated inode
 // `mount_point` specifies the device, `inodenum` is the inode number to free
 void free_inode(int mount_point, int inodenum);
@@ -106,6 +256,14 @@ void free_inode(int mount_point, int inodenum);
 // `mount_point` specifies the device, `inodenum` is the inode index, `inodeptr` is the buffer to store data
 void read_inode(int mount_point, int inodenum, struct inode_t *inodeptr);
 
+// Function to read the whole inode table in one pass (one read and decrypt per metadata block)
+// `mount_point` specifies the device, `inodes` receives MAX_INODES entries indexed by inode number
+void read_inode_table(int mount_point, struct inode_t *inodes);
+
+// Function to write the whole inode table in one pass (one write per metadata block)
+// `inodes` holds MAX_INODES entries indexed by inode number
+void write_inode_table(int mount_point, struct inode_t *inodes);
+
 // Function to write an inode's data to the disk
 // `mount_point` specifies the device, `inodenum` is the inode index, `inodeptr` contains the data to write
 void write_inode(int mount_point, int inodenum, struct inode_t *inodeptr);
@@ -115,10 +273,27 @@ void write_inode(int mount_point, int inodenum, struct inode_t *inodeptr);
 // Returns the index of the allocated block or -1 if no blocks are available
 int alloc_datablock(int mount_point);
 
+// Function to allocate several data blocks in one superblock update
+// A contiguous run is preferred; otherwise the lowest free blocks are used
+// `count` blocks are stored in `blocks`. Returns 1 on success or -1 if there are not enough free blocks
+int alloc_datablocks(int mount_point, int count, char *blocks);
+
 // Function to free a previously allocated data block
+// If the block is shared, only one reference is dropped and the block stays allocated
 // `mount_point` specifies the device, `blocknum` is the block number to free
 void free_datablock(int mount_point, int blocknum);
 
+// Function to free many data blocks and inodes with a single superblock update
+// `blocks`/`nblocks` are the data blocks (shared ones lose one reference), `inodes`/`ninodes` the inodes
+void free_batch(int mount_point, char *blocks, int nblocks, char *inodes, int ninodes);
+
+// Function to queue a freed block for release of its host storage (hole punching)
+void queue_punch(int mount_point, int blocknum);
+
+// Function to punch holes in the host image for the queued blocks
+// Only whole host pages whose blocks are all free are released; runs of pages are merged
+void flush_punches(int mount_point);
+
 // Function to read data from a specific block
 // `mount_point` specifies the device, `blocknum` is the block number, `buf` is the buffer to store data
 void read_datablock(int mount_point, int blocknum, char *buf);
@@ -126,3 +301,51 @@ void read_datablock(int mount_point, int blocknum, char *buf);
 // Function to write data to a specific block
 // `mount_point` specifies the device, `blocknum` is the block number, `buf` contains the data to write
 void write_datablock(int mount_point, int blocknum, char *buf);
+
+// Function to write several data blocks at once (in parallel on a striped volume)
+// `blocks`/`count` lists the blocks, `buf` holds their data one after the other (encrypted in place)
+void write_datablocks(int mount_point, char *blocks, int count, char *buf);
+
+/*-----------DEDUP------------*/
+
+// Function to hash a block's content (four independent 32-bit lanes, xxHash32-style)
+// Never returns 0, which marks an empty index entry
+unsigned int block_hash(const char *buf, int size);
+
+// Function to find a block on disk with the given content
+// `buf` is the plain block content, `hash` its block_hash
+// Returns the block number or -1 if no indexed block matches
+int dedup_lookup(int mount_point, char *buf, unsigned int hash);
+
+// Function to record the hash of a block's current content in the dedup index (0 clears the entry)
+void dedup_update(int mount_point, int blocknum, unsigned int hash);
+
+// Functions to read and write the dedup hash index stored at the start of block `blocknum`
+void read_dedup_index(int mount_point, int blocknum, struct dedup_index_t *index);
+void write_dedup_index(int mount_point, int blocknum, struct dedup_index_t *index);
+
+// Function to add a reference to a block that is now used by one more file
+// Returns 1 on success or -1 if the block already has MAX_BLOCK_REFS extra references
+int share_datablock(int mount_point, int blocknum);
+
+// Function to check whether a block is referenced by more than one file
+// Returns 1 if shared (must be copied before it is modified), 0 otherwise
+int datablock_shared(int mount_point, int blocknum);
+
+// Function to read the whole content of a file on a compressed filesystem
+// `mount_point` specifies the device, `inodeptr` is the file's inode, `buf` receives inodeptr->size bytes
+// Returns 1 on success or -1 if the stored stream is corrupt
+int read_file_data(int mount_point, struct inode_t *inodeptr, char *buf);
+
+// Function to store the whole content of a file on a compressed filesystem
+// `buf`/`size` is the new content; the inode's mappings and size are updated (caller writes the inode)
+// Returns 1 on success or -1 if there are not enough free blocks
+int write_file_data(int mount_point, struct inode_t *inodeptr, char *buf, int size);
+
+/*-----------STATISTICS------------*/
+
+// Function to add a call's latency and device I/Os to the mount's histogram of the call (EMUFS_STAT_*)
+void stats_record_call(int mount_point, int call, long long latency_ns, long device_ios);
+
+// Function to get the number of blocks read and written on a mount so far (0 if nothing is mounted)
+long stats_device_ios(int mount_point);
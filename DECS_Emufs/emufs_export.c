@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "emufs.h"
+#include "emufs_disk.h"
+
+/*
+	* Copies the tree of an image to a directory of the host (the counterpart of emufs_import).
+	* Directories are created as needed; existing host files are overwritten.
+	*
+	* Usage: emufs_export [-k key] image hostdir
+	*   -k key   key of an encrypted file system
+*/
+
+static FILE *out;
+static int files = 0, directories = 0;
+static long bytes = 0;
+static char data[MAX_FILE_BYTES + 1];
+
+
+static int export_dir(int handle, const char *path, const char *host_path)
+{
+	/*
+		* Exports the directory at `path` (relative to the root, "" = root) and everything below it
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct emufs_dirent_t entries[MAX_FILE_SIZE];
+	int n = emufs_readdir(handle, path[0] ? (char*)path : NULL, entries, MAX_FILE_SIZE);
+
+	if(n == -1)
+	{
+		fprintf(out, "%s: cannot list the directory\n", path[0] ? path : "/");
+		return -1;
+	}
+	if(mkdir(host_path, 0755) == -1 && errno != EEXIST)
+	{
+		perror(host_path);
+		return -1;
+	}
+
+	for(int i=0; i<n && i<MAX_FILE_SIZE; i++)
+	{
+		char child[PATH_MAX], host_child[PATH_MAX];
+		snprintf(child, sizeof(child), "%s%s%s", path, path[0] ? "/" : "", entries[i].name);
+		snprintf(host_child, sizeof(host_child), "%s/%s", host_path, entries[i].name);
+
+		if(entries[i].type == 1)
+		{
+			directories++;
+			if(export_dir(handle, child, host_child) == -1)
+				return -1;
+			continue;
+		}
+
+		int file = open_file(handle, child);
+		int size = entries[i].size;
+		if(file == -1 || (size && emufs_read(file, data, size) == -1))
+		{
+			fprintf(out, "%s: read failed\n", child);
+			if(file != -1)
+				emufs_close(file, 0);
+			return -1;
+		}
+		emufs_close(file, 0);
+
+		FILE *host = fopen(host_child, "wb");
+		if(!host || fwrite(data, 1, size, host) != (size_t)size || fclose(host) != 0)
+		{
+			perror(host_child);
+			return -1;
+		}
+		files++;
+		bytes += size;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	char *image = NULL, *host_dir = NULL;
+	int key = 0;
+
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			key = atoi(argv[++i]);
+		else if(argv[i][0] != '-' && !image)
+			image = argv[i];
+		else if(argv[i][0] != '-' && !host_dir)
+			host_dir = argv[i];
+		else
+		{
+			image = NULL;
+			break;
+		}
+	}
+	if(!image || !host_dir)
+	{
+		fprintf(stderr, "Usage: %s [-k key] image hostdir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(access(image, F_OK) == -1)
+	{
+		perror(image);
+		return EXIT_FAILURE;
+	}
+
+	// The file system's messages would drown the results
+	out = fdopen(dup(fileno(stdout)), "w");
+	if(!out || !freopen("/dev/null", "w", stdout))
+		return EXIT_FAILURE;
+	emufs_set_key(key > 0 ? key : -1);
+
+	int mp = opendevice(image, MAX_BLOCKS);
+	int handle = mp == -1 ? -1 : open_root(mp);
+	if(handle == -1)
+	{
+		fprintf(out, "Failed to mount %s (an encrypted image needs its key, -k)\n", image);
+		return EXIT_FAILURE;
+	}
+	int ret = export_dir(handle, "", host_dir);
+	emufs_close(handle, 1);
+	closedevice(mp);
+
+	if(ret == 1)
+		fprintf(out, "%s: %d files, %d directories, %ld bytes\n", host_dir, files, directories, bytes);
+	fclose(out);
+	return ret == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "emufs.h"
+#include "emufs_disk.h"
+
+/*
+	* Builds a new image from a directory tree of the host, like mkfs with a prototype tree.
+	*
+	* The whole layout is planned before the image is touched: every entity gets its inode
+	* (in breadth-first order) and every file a contiguous extent, and anything that does not
+	* fit (names, entries per directory, inodes, file sizes, free blocks) is reported up front.
+	* The host files are read by a pool of threads while nothing else happens; the image is then
+	* written with one superblock write, one write for all file data (a single sequential run)
+	* and one write per inode table block. On a compressed file system the data of each file
+	* is stored as its own stream instead.
+	*
+	* Usage: emufs_import [-f fs_number] [-b block size] [-n blocks] [-k key] [-j threads] image hostdir
+	*   -f fs      file system type (default 0)
+	*   -b size    block size (default 256)
+	*   -n blocks  size of the device in blocks (default MAX_BLOCKS)
+	*   -k key     key of an encrypted file system
+	*   -j n       threads reading the host files (default 4)
+	*
+	* Hidden host entries (names starting with '.') and entries that are neither files nor
+	* directories are skipped. The image is replaced if it exists.
+*/
+
+#define MAX_READERS 16
+
+struct entity_t
+{
+	char name[MAX_ENTITY_NAME + 1];
+	char host_path[PATH_MAX];
+	int type;                   // 0 = file, 1 = directory
+	int parent;                 // Inode number of the parent directory
+	int size;                   // File size in bytes, or number of entries of a directory
+	int children[MAX_FILE_SIZE];
+	char *data;                 // Content, padded with zeros to whole blocks
+	int first_block;            // Start of the file's extent (-1 = no blocks)
+	int nblocks;
+};
+
+static struct entity_t entities[MAX_INODES];    // Indexed by inode number (0 = root)
+static int nentities = 1;
+static int block_size = BLOCKSIZE;
+static atomic_int next_file;
+static atomic_int read_failed;
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int skip_entry(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+static int plan_tree(int max_file_size)
+{
+	/*
+		* Assigns an inode to every entity, breadth first, and checks the limits of the file system
+
+		* Return value: -1, the tree does not fit
+						 1, success
+	*/
+
+	for(int d=0; d<nentities; d++)
+	{
+		struct dirent **names;
+		struct entity_t *dir = &entities[d];
+		if(dir->type != 1)
+			continue;
+
+		int n = scandir(dir->host_path, &names, skip_entry, alphasort);
+		if(n < 0)
+		{
+			perror(dir->host_path);
+			return -1;
+		}
+		for(int i=0; i<n; i++)
+		{
+			struct entity_t *e = &entities[nentities];
+			struct stat st;
+			char path[PATH_MAX];
+			int ret = -1;
+
+			if(snprintf(path, sizeof(path), "%s/%s", dir->host_path, names[i]->d_name) >= (int)sizeof(path))
+				fprintf(stderr, "%s/%s: path too long\n", dir->host_path, names[i]->d_name);
+			else if(stat(path, &st) == -1)
+				perror(path);
+			else if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			{
+				fprintf(stderr, "Skipping %s: not a file or directory\n", path);
+				ret = 0;
+			}
+			else if(strlen(names[i]->d_name) > MAX_ENTITY_NAME)
+				fprintf(stderr, "%s: names are limited to %d characters\n", path, MAX_ENTITY_NAME);
+			else if(dir->size == MAX_FILE_SIZE)
+				fprintf(stderr, "%s: a directory holds at most %d entries\n", path, MAX_FILE_SIZE);
+			else if(nentities == MAX_INODES)
+				fprintf(stderr, "%s: the file system holds at most %d entities\n", path, MAX_INODES - 1);
+			else if(S_ISREG(st.st_mode) && st.st_size > max_file_size)
+				fprintf(stderr, "%s: %ld bytes, the largest file is %d bytes\n", path, (long)st.st_size, max_file_size);
+			else
+			{
+				strcpy(e->name, names[i]->d_name);
+				strcpy(e->host_path, path);
+				e->type = S_ISDIR(st.st_mode);
+				e->parent = d;
+				e->size = e->type ? 0 : st.st_size;
+				e->first_block = -1;
+				dir->children[dir->size++] = nentities++;
+				ret = 1;
+			}
+			free(names[i]);
+			if(ret == -1)
+			{
+				while(++i < n)
+					free(names[i]);
+				free(names);
+				return -1;
+			}
+		}
+		free(names);
+	}
+	return 1;
+}
+
+static void* reader_main(void *arg)
+{
+	// Reads whole host files, taking the next unread one until none is left
+	(void)arg;
+	for(int i = atomic_fetch_add(&next_file, 1); i < nentities; i = atomic_fetch_add(&next_file, 1))
+	{
+		struct entity_t *e = &entities[i];
+		if(e->type == 1 || e->size == 0)
+			continue;
+
+		int fd = open(e->host_path, O_RDONLY);
+		int got = 0;
+		e->data = (char*)calloc(e->nblocks ? e->nblocks : 1, block_size);
+		while(fd != -1 && e->data && got < e->size)
+		{
+			ssize_t n = read(fd, e->data + got, e->size - got);
+			if(n <= 0)
+				break;
+			got += n;
+		}
+		if(fd != -1)
+			close(fd);
+		if(got != e->size)
+		{
+			fprintf(stderr, "%s: read failed (file changed or unreadable)\n", e->host_path);
+			atomic_store(&read_failed, 1);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int fs_number = EMUFS_NON_ENCRYPTED, disk_blocks = MAX_BLOCKS, key = 0, readers = 4;
+	char *image = NULL, *host_dir = NULL;
+	pthread_t threads[MAX_READERS];
+	FILE *out;
+
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			fs_number = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			block_size = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			disk_blocks = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			key = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			readers = atoi(argv[++i]);
+		else if(argv[i][0] != '-' && !image)
+			image = argv[i];
+		else if(argv[i][0] != '-' && !host_dir)
+			host_dir = argv[i];
+		else
+		{
+			image = NULL;
+			break;
+		}
+	}
+	if(!image || !host_dir)
+	{
+		fprintf(stderr, "Usage: %s [-f fs_number] [-b block size] [-n blocks] [-k key] [-j threads] image hostdir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(readers < 1 || readers > MAX_READERS || disk_blocks < 1 || disk_blocks > MAX_BLOCKS
+		|| block_size < BLOCKSIZE || block_size > MAX_BLOCKSIZE || (block_size & (block_size - 1)))
+	{
+		fprintf(stderr, "Invalid options (1 to %d threads, 1 to %d blocks, block size a power of 2 from %d to %d)\n",
+				MAX_READERS, MAX_BLOCKS, BLOCKSIZE, MAX_BLOCKSIZE);
+		return EXIT_FAILURE;
+	}
+	if(fs_number == EMUFS_ENCRYPTED && key <= 0)
+	{
+		fprintf(stderr, "An encrypted file system needs a key (-k)\n");
+		return EXIT_FAILURE;
+	}
+
+	// Plan: inodes, then one extent per file after the superblock and the inode table
+	int max_file_size = MAX_FILE_SIZE * block_size < MAX_FILE_BYTES ? MAX_FILE_SIZE * block_size : MAX_FILE_BYTES;
+	int reserved = 1 + (MAX_INODES * (int)sizeof(struct inode_t) + block_size - 1) / block_size;
+	int compressed = fs_number == EMUFS_COMPRESSED, total_blocks = 0, files = 0;
+	long bytes = 0;
+	double start = now_ms();
+
+	strcpy(entities[0].host_path, host_dir);
+	entities[0].type = 1;
+	entities[0].parent = 255;
+	if(plan_tree(max_file_size) == -1)
+		return EXIT_FAILURE;
+	for(int i=1; i<nentities; i++)
+	{
+		struct entity_t *e = &entities[i];
+		if(e->type == 1)
+			continue;
+		e->nblocks = (e->size + block_size - 1) / block_size;
+		if(e->nblocks && !compressed)
+			e->first_block = reserved + total_blocks;
+		total_blocks += e->nblocks;
+		bytes += e->size;
+		files++;
+	}
+	// A compressed file system stores less; its streams are only known once compressed
+	if(!compressed && reserved + total_blocks > disk_blocks)
+	{
+		fprintf(stderr, "%s needs %d data blocks, a device of %d blocks holds %d\n",
+				host_dir, total_blocks, disk_blocks, disk_blocks - reserved);
+		return EXIT_FAILURE;
+	}
+
+	// Host files, read in parallel
+	double read_start = now_ms();
+	if(readers > files)
+		readers = files ? files : 1;
+	for(int i=0; i<readers; i++)
+		pthread_create(&threads[i], NULL, reader_main, NULL);
+	for(int i=0; i<readers; i++)
+		pthread_join(threads[i], NULL);
+	if(read_failed)
+		return EXIT_FAILURE;
+	double write_start = now_ms();
+
+	// The file system's messages would drown the results
+	out = fdopen(dup(fileno(stdout)), "w");
+	if(!out || !freopen("/dev/null", "w", stdout))
+		return EXIT_FAILURE;
+	emufs_set_key(key > 0 ? key : -1);
+	unlink(image);
+	int mp = opendevice(image, disk_blocks);
+	if(mp == -1 || create_file_system(mp, fs_number, block_size) == -1 || 1 + mounts[mp].inode_blocks != reserved)
+	{
+		fprintf(stderr, "Failed to create the file system on %s\n", image);
+		return EXIT_FAILURE;
+	}
+
+	// Superblock: every inode and extent at once
+	struct superblock_t superblock;
+	read_superblock(mp, &superblock);
+	for(int i=1; i<nentities; i++)
+	{
+		superblock.inode_bitmap[i] = 1;
+		superblock.used_inodes++;
+		for(int b=0; b<entities[i].nblocks && !compressed; b++)
+		{
+			superblock.block_bitmap[entities[i].first_block + b] = 1;
+			superblock.used_blocks++;
+		}
+	}
+	write_superblock(mp, &superblock);
+
+	// File data: the extents follow each other, so the device sees one sequential write
+	if(!compressed && total_blocks)
+	{
+		char *blocks = (char*)malloc(total_blocks);
+		char *stage = (char*)malloc((size_t)total_blocks * block_size);
+		int n = 0;
+		if(!blocks || !stage)
+			return EXIT_FAILURE;
+		for(int i=1; i<nentities; i++)
+			for(int b=0; b<entities[i].nblocks; b++, n++)
+			{
+				blocks[n] = entities[i].first_block + b;
+				memcpy(stage + (size_t)n * block_size, entities[i].data + (size_t)b * block_size, block_size);
+			}
+		write_datablocks(mp, blocks, total_blocks, stage);
+		free(blocks);
+		free(stage);
+	}
+
+	// Inode table, written once at the end
+	struct inode_t inodes[MAX_INODES];
+	read_inode_table(mp, inodes);
+	for(int i=0; i<nentities; i++)
+	{
+		struct entity_t *e = &entities[i];
+		struct inode_t *inode = &inodes[i];
+
+		if(i > 0)
+		{
+			memset(inode->name, 0, sizeof(inode->name));
+			memcpy(inode->name, e->name, strlen(e->name));
+			inode->parent = e->parent;
+		}
+		inode->type = e->type;
+		for(int b=0; b<MAX_FILE_SIZE; b++)
+			inode->mappings[b] = -1;
+		if(e->type == 1)
+		{
+			inode->size = e->size;
+			for(int c=0; c<e->size; c++)
+				inode->mappings[c] = e->children[c];
+		}
+		else if(compressed)
+		{
+			inode->size = 0;
+			if(e->size && mounts[mp].ops->write_file(mp, inode, e->data, e->size) == -1)
+			{
+				fprintf(stderr, "%s: no space left on the device\n", e->host_path);
+				closedevice(mp);
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			inode->size = e->size;
+			for(int b=0; b<e->nblocks; b++)
+				inode->mappings[b] = e->first_block + b;
+		}
+		free(e->data);
+	}
+	write_inode_table(mp, inodes);
+	closedevice(mp);
+
+	double end = now_ms();
+	fprintf(out, "%s: %d files, %d directories, %ld bytes in %.1f ms (planned %.1f, host reads %.1f, image writes %.1f)\n",
+			image, files, nentities - 1 - files, bytes, end - start, read_start - start, write_start - read_start, end - write_start);
+	fclose(out);
+	return 0;
+}
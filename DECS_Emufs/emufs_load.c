@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "emufs.h"
+#include "emufs_disk.h"
+
+/*
+	* Multi-threaded load generator. Worker threads run a random mix of create, write, read
+	* and delete on files spread over a directory tree of their own, on one or several mounts,
+	* for growing thread counts. Each run reports throughput and how much time the threads
+	* spent waiting for the file system lock, i.e. how much the global handle tables and
+	* the devices serialize them.
+	*
+	* The file system is not thread-safe, so every operation holds one global lock.
+	*
+	* Usage: emufs_load [-t max threads] [-m mounts] [-s seconds] [-d depth] [-x c:w:r:d] [-M] [-k key] [-f fs_number]
+	*   -t n      largest thread count; runs use 1, 2, 4, ... up to n (default: as many as the mounts hold)
+	*   -m n      mounts the threads are spread over (default 2)
+	*   -s secs   duration of each run (default 1)
+	*   -d depth  depth of each thread's directory tree (default 2)
+	*   -x mix    relative weights of create:write:read:delete (default 1:4:4:1)
+	*   -M        use RAM disks instead of image files
+	*   -f fs     file system type (default 0); an encrypted one uses the key given with -k
+*/
+
+#define MAX_WORKERS 16          // Limited by the root directory entries of the mounts (4 per mount)
+#define MAX_LOAD_MOUNTS 4
+#define WORKER_FILES 6          // Files a worker keeps at a time
+#define WORKER_INODES(depth) (1 + (depth) + WORKER_FILES)   // Inodes a worker's tree can take
+#define OP_TYPES 4              // create, write, read, delete
+
+struct worker_t
+{
+	pthread_t thread;
+	int id;
+	int mount_point;
+	int handle;                 // Directory handle of the worker's own tree
+	unsigned int seed;
+	long ops[OP_TYPES];         // Successful operations of each type
+	long failures;              // Failed operations (e.g., the file system is full)
+	double wait_ns;             // Time spent waiting for the lock
+	double hold_ns;             // Time spent holding it
+	char files[WORKER_FILES][32];   // Paths of the worker's files ("" = free slot)
+	int sizes[WORKER_FILES];        // Their sizes
+};
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int running;    // Cleared by the main thread to stop the workers
+static int mix[OP_TYPES] = {1, 4, 4, 1};
+static int depth = 2;
+static int mount_points[MAX_LOAD_MOUNTS];
+static int nmounts = 2;
+static char data[MAX_FILE_BYTES];
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double lock_fs(struct worker_t *w)
+{
+	double t = now_ns();
+	pthread_mutex_lock(&fs_lock);
+	double got = now_ns();
+	w->wait_ns += got - t;
+	return got;
+}
+
+static void unlock_fs(struct worker_t *w, double got)
+{
+	w->hold_ns += now_ns() - got;
+	pthread_mutex_unlock(&fs_lock);
+}
+
+static int file_size(struct worker_t *w)
+{
+	// Log-uniform between 16 bytes and the largest file: many small files, a few large ones
+	int max = mounts[w->mount_point].max_file_size;
+	int bits = 4 + rand_r(&w->seed) % 13;
+	int size = (1 << bits) + rand_r(&w->seed) % (1 << bits);
+	return size < max ? size : max;
+}
+
+static int run_op(struct worker_t *w, int op)
+{
+	/*
+		* Runs one operation on a random file of the worker, under the lock
+
+		* Return value: -1, failed
+						 0, nothing to do (no file, or no free slot for a new one)
+						 1, success
+	*/
+
+	int slot = rand_r(&w->seed) % WORKER_FILES;
+	int ret = -1;
+
+	// create needs a free slot, the other operations an existing file
+	if((op == 0) != (w->files[slot][0] == 0))
+		return 0;
+
+	if(op == 0)
+	{
+		// At a random depth of the worker's tree ("d/d/f<slot>"). emufs_create takes a name in
+		// the current directory, so the handle steps down to that level and back up.
+		int level = rand_r(&w->seed) % (depth + 1), reached = 0;
+		char name[8];
+		snprintf(name, sizeof(name), "f%d", slot);
+
+		double got = lock_fs(w);
+		while(reached < level && change_dir(w->handle, "d") == 1)
+			reached++;
+		if(reached == level)
+			ret = emufs_create(w->handle, name, 0);
+		for(int i=0; i<reached; i++)
+			change_dir(w->handle, "..");
+		unlock_fs(w, got);
+
+		if(ret != -1)
+		{
+			w->files[slot][0] = 0;
+			for(int i=0; i<level; i++)
+				strcat(w->files[slot], "d/");
+			strcat(w->files[slot], name);
+			w->sizes[slot] = 0;
+		}
+		return ret;
+	}
+
+	double got = lock_fs(w);
+	if(op == 3)
+	{
+		ret = emufs_delete(w->handle, w->files[slot]);
+		if(ret != -1)
+			w->files[slot][0] = 0;
+	}
+	else
+	{
+		int file = open_file(w->handle, w->files[slot]);
+		if(file != -1)
+		{
+			if(op == 1)
+			{
+				int size = file_size(w);
+				ret = emufs_write(file, data, size);
+				if(ret != -1 && size > w->sizes[slot])
+					w->sizes[slot] = size;
+			}
+			else
+				ret = w->sizes[slot] ? emufs_read(file, data, w->sizes[slot]) : 1;
+			emufs_close(file, 0);
+		}
+	}
+	unlock_fs(w, got);
+	return ret;
+}
+
+static void* worker_main(void *arg)
+{
+	struct worker_t *w = (struct worker_t*)arg;
+	int total = 0;
+
+	for(int i=0; i<OP_TYPES; i++)
+		total += mix[i];
+	while(running)
+	{
+		int pick = rand_r(&w->seed) % total, op = 0;
+		while(pick >= mix[op])
+			pick -= mix[op++];
+		int ret = run_op(w, op);
+		if(ret == 1)
+			w->ops[op]++;
+		else if(ret == -1)
+			w->failures++;
+	}
+	return NULL;
+}
+
+
+static int setup_worker(struct worker_t *w)
+{
+	// The worker's tree: "t<id>" in the root of its mount, with a chain of "d" directories below
+	char name[8];
+
+	snprintf(name, sizeof(name), "t%d", w->id);
+	w->mount_point = mount_points[w->id % nmounts];
+	w->handle = open_root(w->mount_point);
+	if(w->handle == -1 || emufs_create(w->handle, name, 1) == -1 || change_dir(w->handle, name) == -1)
+		return -1;
+	for(int i=0; i<depth; i++)
+		if(emufs_create(w->handle, "d", 1) == -1 || change_dir(w->handle, "d") == -1)
+			return -1;
+	change_dir(w->handle, "/");
+	return change_dir(w->handle, name);
+}
+
+static int workers_per_mount(void)
+{
+	// Every worker's tree has to fit in the root directory and in the inodes left by the root
+	int n = (MAX_INODES - 1) / WORKER_INODES(depth);
+	return n < MAX_FILE_SIZE ? n : MAX_FILE_SIZE;
+}
+
+static int setup_mounts(int fs_number, int ram)
+{
+	// Fresh file systems for every run. RAM disks get their own names, as RAM disks of
+	// the same name are one device; their images are removed again when they are closed.
+	for(int i=0; i<nmounts; i++)
+	{
+		char device[20];
+		snprintf(device, sizeof(device), "%sload%d.img", ram ? MEM_PREFIX : "", i);
+		unlink(device + (ram ? strlen(MEM_PREFIX) : 0));
+		mount_points[i] = opendevice(device, MAX_BLOCKS);
+		if(mount_points[i] == -1 || create_file_system(mount_points[i], fs_number, 0) == -1)
+			return -1;
+	}
+	return 1;
+}
+
+static void close_mounts(void)
+{
+	for(int i=0; i<nmounts; i++)
+	{
+		char device[20];
+		closedevice(mount_points[i]);
+		snprintf(device, sizeof(device), "load%d.img", i);
+		unlink(device);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 0, seconds = 1, ram = 0, fs_number = EMUFS_NON_ENCRYPTED, key = 0;
+	static struct worker_t workers[MAX_WORKERS];
+	FILE *out;
+
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			max_threads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			nmounts = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2], &mix[3]);
+		else if(strcmp(argv[i], "-M") == 0)
+			ram = 1;
+		else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			fs_number = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			key = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Usage: %s [-t threads] [-m mounts] [-s seconds] [-d depth] [-x c:w:r:d] [-M] [-k key] [-f fs_number]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(nmounts < 1 || nmounts > MAX_LOAD_MOUNTS || depth < 0 || depth > 4)
+	{
+		fprintf(stderr, "Invalid options (%d mounts at most, depth 0 to 4)\n", MAX_LOAD_MOUNTS);
+		return EXIT_FAILURE;
+	}
+	if(!max_threads)
+		max_threads = workers_per_mount() * nmounts < MAX_WORKERS ? workers_per_mount() * nmounts : MAX_WORKERS;
+	if(max_threads < 1 || max_threads > workers_per_mount() * nmounts || max_threads > MAX_WORKERS
+		|| mix[0] + mix[1] + mix[2] + mix[3] <= 0 || mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[3] < 0)
+	{
+		fprintf(stderr, "Invalid options (at most %d threads per mount at depth %d, %d threads)\n", workers_per_mount(), depth, MAX_WORKERS);
+		return EXIT_FAILURE;
+	}
+	if(fs_number == EMUFS_ENCRYPTED && key <= 0)
+	{
+		fprintf(stderr, "An encrypted file system needs a key (-k)\n");
+		return EXIT_FAILURE;
+	}
+
+	// The file system's messages would drown the results
+	out = fdopen(dup(fileno(stdout)), "w");
+	if(!out || !freopen("/dev/null", "w", stdout))
+		return EXIT_FAILURE;
+	emufs_set_key(key > 0 ? key : -1);
+	for(int i=0; i<(int)sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+
+	fprintf(out, "%7s %12s %10s %10s %10s %10s %10s %10s\n",
+			"threads", "ops/s", "create", "write", "read", "delete", "failed", "lock wait");
+	for(int n = 1; n <= max_threads; n = n * 2 > max_threads && n < max_threads ? max_threads : n * 2)
+	{
+		if(setup_mounts(fs_number, ram) == -1)
+		{
+			fprintf(out, "Failed to create the file systems\n");
+			return EXIT_FAILURE;
+		}
+		memset(workers, 0, sizeof(workers));
+		for(int i=0; i<n; i++)
+		{
+			workers[i].id = i;
+			workers[i].seed = 1234 + i;
+			if(setup_worker(&workers[i]) == -1)
+			{
+				fprintf(out, "Failed to create the tree of worker %d\n", i);
+				return EXIT_FAILURE;
+			}
+		}
+
+		running = 1;
+		double start = now_ns();
+		for(int i=0; i<n; i++)
+			pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+		struct timespec duration = {seconds, 0};
+		nanosleep(&duration, NULL);
+		running = 0;
+		for(int i=0; i<n; i++)
+			pthread_join(workers[i].thread, NULL);
+		double elapsed = now_ns() - start;
+
+		long ops[OP_TYPES] = {0}, total = 0, failures = 0;
+		double wait = 0;
+		for(int i=0; i<n; i++)
+		{
+			for(int k=0; k<OP_TYPES; k++)
+				ops[k] += workers[i].ops[k];
+			failures += workers[i].failures;
+			wait += workers[i].wait_ns;
+			emufs_close(workers[i].handle, 1);
+		}
+		for(int k=0; k<OP_TYPES; k++)
+			total += ops[k];
+
+		// Lock wait: share of the threads' time spent waiting for another thread's operation
+		fprintf(out, "%7d %12.0f %10ld %10ld %10ld %10ld %10ld %9.1f%%\n", n, total / (elapsed / 1e9),
+				ops[0], ops[1], ops[2], ops[3], failures, 100.0 * wait / (elapsed * n));
+		fflush(out);
+		close_mounts();
+	}
+	return 0;
+}
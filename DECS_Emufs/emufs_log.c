@@ -0,0 +1,246 @@
+#include "emufs_log.h"
+
+/*
+	* Asynchronous transaction log. A thread that logs writes a fixed-size record into its
+	* own ring buffer (single producer, single consumer: no lock, no system call) and goes on.
+	* The message is formatted into the record by the logging thread. A writer thread drains
+	* the rings every EMUFS_LOG_FLUSH_MS, adds the time stamps and appends the
+	* records to the log file in one buffered write per pass. It also keeps the cached clock
+	* the records are stamped with, so logging does not read the time either.
+	*
+	* Records of one thread stay in order; records of different threads are ordered by
+	* the second they were logged in.
+	*
+	* Rings are never freed: the ring of a thread that exits is taken over by the next thread
+	* that logs, and a thread keeps its ring when the log is closed and opened again. Closing
+	* waits for the calls in progress (a flag per ring) and then writes out what is left.
+*/
+
+struct log_ring_t
+{
+	struct emufs_log_record_t records[EMUFS_LOG_RING];
+	atomic_uint head;               // Next record the owner thread writes
+	atomic_uint tail;               // Next record the writer thread reads
+	atomic_int active;              // The owner thread is adding a record
+	atomic_int owned;               // A live thread logs into this ring
+	struct log_ring_t *next;        // Next registered ring
+};
+
+static FILE *log_file = NULL;
+static pthread_t writer;
+static atomic_int running;
+static atomic_int min_level = EMUFS_LOG_INFO;
+static atomic_llong coarse_now;             // Clock cached by the writer thread (seconds)
+static atomic_long dropped;                 // Records lost to full rings
+static _Atomic(struct log_ring_t*) rings;   // Rings of every thread that logged (push only)
+static pthread_key_t ring_key;              // Releases a thread's ring when it exits
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring_t *thread_ring;
+
+
+/*-----------PRODUCERS------------*/
+static void release_ring(void *ring)
+{
+	// Its pending records are still written; the next thread that logs takes it over
+	atomic_store(&((struct log_ring_t*)ring)->owned, 0);
+}
+
+static void make_ring_key(void)
+{
+	pthread_key_create(&ring_key, release_ring);
+}
+
+static struct log_ring_t* get_ring(void)
+{
+	// The calling thread's ring; taken over or registered on its first record
+	struct log_ring_t *ring;
+
+	if(thread_ring)
+		return thread_ring;
+	pthread_once(&ring_key_once, make_ring_key);
+	for(ring = atomic_load(&rings); ring; ring = ring->next)
+	{
+		int unowned = 0;
+		if(atomic_compare_exchange_strong(&ring->owned, &unowned, 1))
+			break;
+	}
+	if(!ring)
+	{
+		ring = (struct log_ring_t*)calloc(1, sizeof(struct log_ring_t));
+		if(!ring)
+			return NULL;
+		atomic_store(&ring->owned, 1);
+		ring->next = atomic_load(&rings);
+		while(!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+			;
+	}
+	thread_ring = ring;
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+void emufs_log(int level, const char *format, ...)
+{
+	if(level < atomic_load_explicit(&min_level, memory_order_relaxed) || !atomic_load_explicit(&running, memory_order_relaxed))
+		return;
+
+	struct log_ring_t *ring = get_ring();
+	if(!ring)
+	{
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	// Either emufs_log_close sees the flag and waits for the record, or this sees the log closed
+	atomic_store(&ring->active, 1);
+	if(!atomic_load(&running))
+	{
+		atomic_store_explicit(&ring->active, 0, memory_order_release);
+		return;
+	}
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == EMUFS_LOG_RING)
+	{
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		atomic_store_explicit(&ring->active, 0, memory_order_release);
+		return;
+	}
+
+	struct emufs_log_record_t *record = &ring->records[head & (EMUFS_LOG_RING - 1)];
+	va_list args;
+	record->time = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+	record->level = level;
+	va_start(args, format);
+	vsnprintf(record->message, EMUFS_LOG_MESSAGE, format, args);
+	va_end(args);
+
+	// Publishes the record to the writer thread
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	atomic_store_explicit(&ring->active, 0, memory_order_release);
+}
+
+void emufs_log_set_level(int level)
+{
+	atomic_store(&min_level, level);
+}
+
+
+/*-----------WRITER------------*/
+static void write_record(struct emufs_log_record_t *record)
+{
+	// Same format as before: "[YYYY-MM-DD HH:MM:SS] message" (the level only decides what is logged)
+	static long long stamp_time = -1;
+	static char stamp[32];
+
+	if(record->time != stamp_time)
+	{
+		time_t t = record->time;
+		struct tm tm;
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		stamp_time = record->time;
+	}
+	fprintf(log_file, "[%s] %s\n", stamp, record->message);
+}
+
+static int drain(void)
+{
+	/*
+		* Writes out the pending records of every ring
+
+		* Return value: the most records taken from one ring
+	*/
+
+	int most = 0;
+
+	for(struct log_ring_t *ring = atomic_load(&rings); ring; ring = ring->next)
+	{
+		unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if((int)(head - tail) > most)
+			most = head - tail;
+		for(; tail != head; tail++)
+			write_record(&ring->records[tail & (EMUFS_LOG_RING - 1)]);
+
+		// Hands the slots back to the owner thread
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+	return most;
+}
+
+static void* writer_main(void *arg)
+{
+	(void)arg;
+	while(1)
+	{
+		int stop = !atomic_load(&running);
+		atomic_store_explicit(&coarse_now, time(NULL), memory_order_relaxed);
+		int most = drain();
+		fflush(log_file);
+		if(stop)
+			break;
+
+		// A ring that was half full is drained again right away
+		if(most < EMUFS_LOG_RING / 2)
+		{
+			struct timespec ts = {0, EMUFS_LOG_FLUSH_MS * 1000000L};
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+
+
+/*-----------LOG FILE------------*/
+int emufs_log_open(const char *path, int level)
+{
+	/*
+		* Opens the log file and starts the writer thread
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	emufs_log_close();
+	log_file = fopen(path ? path : EMUFS_LOG_FILE, "a");
+	if(!log_file)
+		return -1;
+	setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+
+	atomic_store(&dropped, 0);
+	atomic_store(&coarse_now, time(NULL));
+	atomic_store(&min_level, level);
+	atomic_store(&running, 1);
+	if(pthread_create(&writer, NULL, writer_main, NULL) != 0)
+	{
+		atomic_store(&running, 0);
+		fclose(log_file);
+		log_file = NULL;
+		return -1;
+	}
+	return 1;
+}
+
+void emufs_log_close(void)
+{
+	// Calls of emufs_log in progress finish first; their records are written out after the writer stops
+	if(!log_file)
+		return;
+	atomic_store(&running, 0);
+	for(struct log_ring_t *ring = atomic_load(&rings); ring; ring = ring->next)
+		while(atomic_load_explicit(&ring->active, memory_order_acquire))
+			sched_yield();
+	pthread_join(writer, NULL);
+	drain();
+
+	if(atomic_load(&dropped))
+	{
+		struct emufs_log_record_t record;
+		record.time = time(NULL);
+		record.level = EMUFS_LOG_WARN;
+		snprintf(record.message, EMUFS_LOG_MESSAGE, "%ld log records dropped (ring buffers full)", atomic_load(&dropped));
+		write_record(&record);
+	}
+	fclose(log_file);
+	log_file = NULL;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>      // Standard I/O functions
+#include <stdlib.h>     // General utility functions
+#include <string.h>     // String manipulation functions
+#include <stdarg.h>     // Variable argument lists of emufs_log
+#include <time.h>       // Timestamps
+#include <pthread.h>    // Writer thread
+#include <stdatomic.h>  // Lock-free ring buffers
+#include <sched.h>      // sched_yield, while closing waits for calls in progress
+
+#define EMUFS_LOG_FILE "file_system_log.txt"   // Default log file
+#define EMUFS_LOG_RING 1024         // Records of a thread's ring buffer (a power of 2)
+#define EMUFS_LOG_MESSAGE 112       // Longest message (longer ones are truncated)
+#define EMUFS_LOG_FLUSH_MS 50       // Longest time a record waits for the writer thread
+
+// Levels; records below the configured level are dropped before they are formatted
+#define EMUFS_LOG_DEBUG 0
+#define EMUFS_LOG_INFO 1
+#define EMUFS_LOG_WARN 2
+#define EMUFS_LOG_ERROR 3
+
+// Fixed-size record of a ring buffer; the logging thread formats the message, the writer thread adds the time stamp
+struct emufs_log_record_t
+{
+    long long time;                     // Seconds since the epoch (the cached coarse clock)
+    int level;
+    char message[EMUFS_LOG_MESSAGE];
+};
+
+// Function to open the log file (appending) and start its writer thread
+// Records of `level` and above are logged. Returns 1 on success or -1 on error.
+int emufs_log_open(const char *path, int level);
+
+// Function to change the lowest level that is logged
+void emufs_log_set_level(int level);
+
+// Function to log a message (printf-style format)
+// Never blocks: the record goes to the calling thread's ring buffer and is written later.
+// When the ring is full the record is dropped and counted.
+void emufs_log(int level, const char *format, ...);
+
+// Function to write out every pending record, stop the writer thread and close the log file
+// Waits for the calls of emufs_log in progress; calls made after it returns log nothing.
+void emufs_log_close(void);
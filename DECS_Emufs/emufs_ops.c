@@ -12,6 +12,14 @@ struct file_t
 	int mount_point;    			// reference to mount point
                                     // -1: Free
                                     // >0: In Use
+    int ra_next;                    // offset where the next read continues a sequential pattern
+    int ra_window;                  // readahead window in blocks (0: no sequential pattern seen)
+    char *wb_data;                  // write-back buffer: appended bytes not yet written to disk
+                                    // (max_file_size bytes, allocated by the first buffered append)
+    int wb_offset;                  // file offset of wb_data[0]
+    int wb_len;                     // number of pending bytes (0: buffer empty)
+    int wb_reserved;                // new blocks the pending bytes will need (reserved, not yet allocated)
+    int wb_have;                    // blocks below the end of the pending bytes that need no new block
 };
 
 struct directory_t
@@ -26,28 +34,80 @@ struct directory_t
 struct directory_t dir[MAX_DIR_HANDLES];    // array of directory handles
 struct file_t files[MAX_FILE_HANDLES];      // array of file handles
 
+// Handles open on each inode, as bitmasks over the handle arrays (bit i = handle i)
+// Lets delete invalidate the handles of an inode without scanning the arrays
+int inode_files[MAX_MOUNT_POINTS][MAX_INODES];
+int inode_dirs[MAX_MOUNT_POINTS][MAX_INODES];
+
+// Write-back buffer helpers (defined with emufs_write)
+int flush_write_buffer(int file_handle);
+int flush_inode_buffers(int mount_point, int inodenum, int except);
+int flush_mount_buffers(int mount_point);
+
+static void drop_write_buffer(struct file_t *file){
+    // Forgets the handle's pending appends and gives their reserved blocks back
+    mounts[file->mount_point].reserved_blocks -= file->wb_reserved;
+    file->wb_reserved = 0;
+    file->wb_len = 0;
+    free(file->wb_data);
+    file->wb_data = NULL;
+}
+
+void invalidate_handles(int mount_point, int inodenum){
+    /*
+        * Close every file and directory handle open on the inode
+    */
+
+    int mask = inode_files[mount_point][inodenum];
+    while(mask){
+        // Pending data is dropped with the handle: it never reaches the bitmap or the device
+        struct file_t *file = &files[__builtin_ctz(mask)];
+        drop_write_buffer(file);
+        file->mount_point = -1;
+        mask &= mask - 1;
+    }
+    mask = inode_dirs[mount_point][inodenum];
+    while(mask){
+        dir[__builtin_ctz(mask)].mount_point = -1;
+        mask &= mask - 1;
+    }
+    inode_files[mount_point][inodenum] = 0;
+    inode_dirs[mount_point][inodenum] = 0;
+}
+
 int closedevice(int mount_point){
     /*
-        * Close all the associated handles
+        * Flush pending appends and close all the associated handles
         * Unmount the device
         
-        * Return value: -1,     error
+        * Return value: -1,     error (pending appends could not be written; the device stays mounted)
                          1,     success
     */
 
+    if(flush_mount_buffers(mount_point) == -1)
+        return -1;
     for(int i=0; i<MAX_DIR_HANDLES; i++)
         dir[i].mount_point = (dir[i].mount_point==mount_point ? -1 : dir[i].mount_point);
-    for(int i=0; i<MAX_FILE_HANDLES; i++)
-        files[i].mount_point = (files[i].mount_point==mount_point ? -1 : files[i].mount_point);
+    for(int i=0; i<MAX_FILE_HANDLES; i++){
+        if(files[i].mount_point != mount_point)
+            continue;
+        free(files[i].wb_data);
+        files[i].wb_data = NULL;
+        files[i].mount_point = -1;
+    }
+    memset(inode_files[mount_point], 0, sizeof(inode_files[mount_point]));
+    mounts[mount_point].reserved_blocks = 0;
+    memset(inode_dirs[mount_point], 0, sizeof(inode_dirs[mount_point]));
     
     return closedevice_(mount_point);
 }
 
-int create_file_system(int mount_point, int fs_number){
+static int create_file_system_(int mount_point, int fs_number, int block_size){
     /*
 	   	* Read the superblock.
-        * Update the mount point with the file system number
-	    * Set file system number on superblock
+        * Update the mount point with the file system number and block size (0 = BLOCKSIZE)
+        * Resize the device to disk_size blocks of the new size
+	    * Set file system number and block size on superblock
 		* Clear the bitmaps.  values on the bitmap will be either '0', or '1'. 
         * Update the used inodes and blocks
 		* Create Inode 0 (root) in metadata block in disk
@@ -56,20 +116,39 @@ int create_file_system(int mount_point, int fs_number){
 		* Return value: -1,		error
 						 1, 	success
 	*/
+    if(mounts[mount_point].snapshot)
+        return -1;
+
+    if(block_size == 0)
+        block_size = BLOCKSIZE;
+
     struct superblock_t superblock;
     read_superblock(mount_point, &superblock);
 
+    // Blocks cached at the old size are dropped; the sparse image is resized without writing
+    if(set_block_size(mount_point, block_size) == -1
+       || resize_device(mount_point, (off_t)superblock.disk_size * block_size) == -1)
+        return -1;
+
     update_mount(mount_point, fs_number);
 
+    // Superblock and inode table blocks are reserved
+    int reserved = 1 + mounts[mount_point].inode_blocks;
     superblock.fs_number=fs_number;
-    for(int i=3; i<MAX_BLOCKS; i++)
+    superblock.block_size=block_size;
+    for(int i=reserved; i<MAX_BLOCKS; i++)
         superblock.block_bitmap[i]=0;
-    for(int i=0; i<3; i++)
+    for(int i=0; i<reserved; i++)
         superblock.block_bitmap[i]=1;
     for(int i=1; i<MAX_INODES; i++)
         superblock.inode_bitmap[i]=0;
     superblock.inode_bitmap[0]=1;
-    superblock.used_blocks=3;
+    for(int i=0; i<MAX_BLOCKS; i++)
+        superblock.block_refs[i]=0;
+    superblock.dedup_index=0;
+    for(int i=0; i<INODE_BLOCKS; i++)
+        superblock.snapshot_blocks[i]=0;
+    superblock.used_blocks=reserved;
     superblock.used_inodes=1;
     write_superblock(mount_point, &superblock);
 
@@ -79,6 +158,170 @@ int create_file_system(int mount_point, int fs_number){
     inode.parent=255;
     inode.type=1;
     write_inode(mount_point, 0, &inode);
+    return 1;
+}
+
+int enable_dedup(int mount_point){
+    /*
+        * Turn on block deduplication for the file system.
+        * Allocates the hash index block and records it in the superblock.
+        * Blocks written before this point are not indexed until they are rewritten.
+        * Not supported on compressed file systems, whose blocks hold stream fragments.
+
+		* Return value: -1,		error
+						 1, 	success
+    */
+    if(mounts[mount_point].snapshot)
+        return -1;
+
+    struct superblock_t superblock;
+    read_superblock(mount_point, &superblock);
+
+    if(superblock.dedup_index)
+        return 1;
+    if(mounts[mount_point].ops->write_file)
+        return -1;
+
+    int index_block = alloc_datablock(mount_point);
+    if(index_block == -1)
+        return -1;
+
+    struct dedup_index_t index;
+    memset(&index, 0, sizeof(struct dedup_index_t));
+    write_dedup_index(mount_point, index_block, &index);
+
+    // Re-read: the allocation above updated the bitmap
+    read_superblock(mount_point, &superblock);
+    superblock.dedup_index = index_block;
+    write_superblock(mount_point, &superblock);
+    return 1;
+}
+
+void collect_file_blocks(int block_size, struct inode_t *inodes, int inodenum, char *blocks, int *count){
+    /*
+        * Walk the tree below inodenum in an in-memory inode table
+        * and append the data blocks of every file to blocks
+    */
+
+    struct inode_t *inode = &inodes[inodenum];
+    if(inode->type == 0){
+        int num_blocks = inode->size / block_size;
+        if(num_blocks * block_size < inode->size)
+            num_blocks++;
+        for(int i = 0; i < num_blocks; i++)
+            if(inode->mappings[i] != -1)
+                blocks[(*count)++] = inode->mappings[i];
+        return;
+    }
+    for(int i = 0; i < inode->size; i++)
+        collect_file_blocks(block_size, inodes, inode->mappings[i], blocks, count);
+}
+
+int emufs_snapshot(int mount_point){
+    /*
+        * Copy the inode table to fresh blocks (as many as the live table takes)
+        * Take one reference on every data block of every file, so that
+          the live file system copies a block before modifying it
+        * Record the snapshot in the superblock (a single superblock write)
+
+		* Return value: -1,		error   (snapshot mount, snapshot exists, or no space)
+						 1, 	success
+    */
+
+    if(mounts[mount_point].snapshot)
+        return -1;
+
+    // Buffered appends belong to the point in time being frozen
+    if(flush_mount_buffers(mount_point) == -1)
+        return -1;
+
+    struct superblock_t superblock;
+    read_superblock(mount_point, &superblock);
+    int bs = mounts[mount_point].block_size;
+    int table_blocks = mounts[mount_point].inode_blocks;
+    if(superblock.snapshot_blocks[0] || superblock.disk_size - superblock.used_blocks - mounts[mount_point].reserved_blocks < table_blocks)
+        return -1;
+
+    // Read the whole inode table, padded to whole blocks, and list the blocks it refers to
+    char table[table_blocks * bs];
+    struct inode_t *inodes = (struct inode_t*)table;
+    memset(table, 0, table_blocks * bs);
+    read_inode_table(mount_point, inodes);
+
+    char blocks[MAX_INODES * MAX_FILE_SIZE];
+    int count = 0;
+    collect_file_blocks(bs, inodes, 0, blocks, &count);
+
+    // Every block takes one more reference; none may go past MAX_BLOCK_REFS
+    int refs[MAX_BLOCKS];
+    for(int i = 0; i < MAX_BLOCKS; i++)
+        refs[i] = superblock.block_refs[i];
+    for(int i = 0; i < count; i++)
+        if(++refs[(int)blocks[i]] > MAX_BLOCK_REFS)
+            return -1;
+
+    // Store the frozen copy (write_datablock encrypts the buffer in place, so this comes last)
+    char snapshot_blocks[INODE_BLOCKS] = {0};
+    for(int i = 0; i < table_blocks; i++){
+        snapshot_blocks[i] = alloc_datablock(mount_point);
+        write_datablock(mount_point, snapshot_blocks[i], table + i * bs);
+    }
+
+    read_superblock(mount_point, &superblock);
+    for(int i = 0; i < count; i++)
+        superblock.block_refs[(int)blocks[i]]++;
+    memcpy(superblock.snapshot_blocks, snapshot_blocks, INODE_BLOCKS);
+    write_superblock(mount_point, &superblock);
+
+    return 1;
+}
+
+int emufs_drop_snapshot(int mount_point){
+    /*
+        * Detach the snapshot from the superblock
+        * Drop its reference on every data block it maps, freeing blocks no longer used,
+          and free the blocks of the frozen inode table, in one batch
+
+		* Return value: -1,		error   (snapshot mount, no snapshot, or the snapshot is mounted)
+						 1, 	success
+    */
+
+    if(mounts[mount_point].snapshot)
+        return -1;
+
+    // A mounted snapshot ("<device>@snap") still reads through the blocks
+    int len = strlen(mounts[mount_point].device_name);
+    for(int i = 0; i < MAX_MOUNT_POINTS; i++)
+        if(mounts[i].device_fd > 0 && mounts[i].snapshot && strncmp(mounts[i].device_name, mounts[mount_point].device_name, len) == 0
+            && strcmp(mounts[i].device_name + len, "@snap") == 0)
+            return -1;
+
+    struct superblock_t superblock;
+    read_superblock(mount_point, &superblock);
+    if(!superblock.snapshot_blocks[0])
+        return -1;
+
+    char snapshot_blocks[INODE_BLOCKS];
+    memcpy(snapshot_blocks, superblock.snapshot_blocks, INODE_BLOCKS);
+    for(int i = 0; i < INODE_BLOCKS; i++)
+        superblock.snapshot_blocks[i] = 0;
+    write_superblock(mount_point, &superblock);
+
+    int bs = mounts[mount_point].block_size;
+    int table_blocks = mounts[mount_point].inode_blocks;
+    char table[table_blocks * bs];
+    struct inode_t *inodes = (struct inode_t*)table;
+    for(int i = 0; i < table_blocks; i++)
+        read_datablock(mount_point, snapshot_blocks[i], table + i * bs);
+
+    char blocks[MAX_INODES * MAX_FILE_SIZE + INODE_BLOCKS];
+    int count = 0;
+    collect_file_blocks(bs, inodes, 0, blocks, &count);
+    for(int i = 0; i < table_blocks; i++)
+        blocks[count++] = snapshot_blocks[i];
+    free_batch(mount_point, blocks, count, NULL, 0);
+
+    return 1;
 }
 
 int alloc_dir_handle(){
@@ -121,11 +364,13 @@ int goto_parent(int dir_handle){
     read_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, &inode);
     if(inode.parent==255)
         return -1;
+    inode_dirs[dir[dir_handle].mount_point][dir[dir_handle].inode_number] &= ~(1 << dir_handle);
     dir[dir_handle].inode_number = inode.parent;
+    inode_dirs[dir[dir_handle].mount_point][dir[dir_handle].inode_number] |= 1 << dir_handle;
     return 1;
 }
 
-int open_root(int mount_point) {
+static int open_root_(int mount_point) {
     /*
      * Opens a handle to the root directory of the specified mount point.
      *
@@ -146,6 +391,7 @@ int open_root(int mount_point) {
     // Set the mount point and root inode number for the allocated directory handle
     dir[dir_handle].mount_point = mount_point; // Assign mount point to the handle
     dir[dir_handle].inode_number = 0;         // Root directory always has inode number 0
+    inode_dirs[mount_point][0] |= 1 << dir_handle;
 
     // Return the allocated directory handle
     return dir_handle;
@@ -165,6 +411,8 @@ int return_inode(int mount_point, int inodenum, char* path) {
         - Inode number: Success.
     */
 
+    EMUFS_SPAN("return_inode");
+
     // If the path starts with '/', begin traversal from the root inode (inodenum = 0).
     if (path[0] == '/')
         inodenum = 0;
@@ -251,7 +499,7 @@ int return_inode(int mount_point, int inodenum, char* path) {
 }
 
 
-int change_dir(int dir_handle, char* path) {
+static int change_dir_(int dir_handle, char* path) {
     /*
      * Function: change_dir
      * --------------------
@@ -284,7 +532,9 @@ int change_dir(int dir_handle, char* path) {
 
     // Check if the target inode represents a directory and update the handle if valid.
     if (inode.type) {
+        inode_dirs[mnt][dir[dir_handle].inode_number] &= ~(1 << dir_handle);
         dir[dir_handle].inode_number = inodenum;
+        inode_dirs[mnt][inodenum] |= 1 << dir_handle;
     }
 
     // Return success if it's a valid directory, otherwise return an error.
@@ -292,62 +542,146 @@ int change_dir(int dir_handle, char* path) {
 }
 
 
-void emufs_close(int handle, int type){
+int emufs_readdir(int dir_handle, char* path, struct emufs_dirent_t* entries, int max_entries){
+    /*
+        * Resolve the directory (the handle's own directory if path is empty)
+        * Read the inode table once and fill one entry per child: name, type and size
+        
+        * Return value: -1,                 error (invalid handle, path not found, or not a directory)
+                         number of entries, success (may exceed max_entries; only max_entries are filled)
+    */
+
+    EMUFS_SPAN("emufs_readdir");
+
+    int mnt = dir[dir_handle].mount_point;
+    if(mnt == -1)
+        return -1;
+
+    int inodenum = dir[dir_handle].inode_number;
+    if(path && path[0]){
+        inodenum = return_inode(mnt, inodenum, path);
+        if(inodenum == -1)
+            return -1;
+    }
+
+    // Sizes must include buffered appends
+    if(flush_mount_buffers(mnt) == -1)
+        return -1;
+
+    struct inode_t inodes[MAX_INODES];
+    read_inode_table(mnt, inodes);
+    if(inodes[inodenum].type != 1)
+        return -1;
+
+    for(int i = 0; i < inodes[inodenum].size && i < max_entries; i++){
+        struct inode_t *entry = &inodes[(int)inodes[inodenum].mappings[i]];
+        memcpy(entries[i].name, entry->name, MAX_ENTITY_NAME);
+        entries[i].name[MAX_ENTITY_NAME] = 0;
+        entries[i].type = entry->type;
+        entries[i].size = entry->size;
+    }
+
+    return inodes[inodenum].size;
+}
+
+
+static int emufs_close_(int handle, int type){
     /*
         * type = 1 : Indicates Directory handle
         * type = 0 : Indicates File handle
         * This function closes the file or directory by updating the respective mount point to -1.
+        * A file handle whose pending appends cannot be written (no space) stays open with them,
+          so the caller can free space and close it again.
+
+        * Return value: -1,     error (pending appends not written; the handle is still open)
+                         1,     success
     */
 
     // Check if it's a directory handle
     if(type) {
-        // Mark the directory handle as closed by setting the mount point to -1
+        // Drop the handle from its inode's index and mark it closed by setting the mount point to -1
+        if(dir[handle].mount_point != -1)
+            inode_dirs[dir[handle].mount_point][dir[handle].inode_number] &= ~(1 << handle);
         dir[handle].mount_point = -1;
     }
     else {
-        // Mark the file handle as closed by setting the mount point to -1
+        // Flush pending appends, drop the handle from its inode's index and mark it closed
+        if(files[handle].mount_point != -1 && flush_write_buffer(handle) == -1)
+            return -1;
+        if(files[handle].mount_point != -1){
+            inode_files[files[handle].mount_point][files[handle].inode_number] &= ~(1 << handle);
+            drop_write_buffer(&files[handle]);
+        }
         files[handle].mount_point = -1;
     }
+    return 1;
 }
 
 
-int delete_entity(int mount_point, int inodenum){
+void emufs_discard(int file_handle){
     /*
-        * Delete the entity denoted by inodenum (inode number)
-        * Close all the handles associated
-        * If its a file then free all the allocated blocks
-        * If its a directory call delete_entity on all the entities present
-        * Free the inode
-        
-        * Return value : inode number of the parent directory
+        * Close a file handle without writing its pending appends
+    */
+
+    if(file_handle < 0 || file_handle >= MAX_FILE_HANDLES || files[file_handle].mount_point == -1)
+        return;
+    inode_files[files[file_handle].mount_point][files[file_handle].inode_number] &= ~(1 << file_handle);
+    drop_write_buffer(&files[file_handle]);
+    files[file_handle].mount_point = -1;
+}
+
+
+void collect_entity(int mount_point, int inodenum, char *blocks, int *nblocks, char *inodes, int *ninodes){
+    /*
+        * Gather the entity denoted by inodenum and everything below it for deletion
+        * Close all the handles associated (through the handle index)
+        * If its a file then add all its allocated blocks to blocks
+        * If its a directory call collect_entity on all the entities present
+        * Add the inode to inodes
     */
 
     struct inode_t inode;
     read_inode(mount_point, inodenum, &inode);
+    invalidate_handles(mount_point, inodenum);
+
     if(inode.type==0){
-        for(int i=0; i<MAX_FILE_HANDLES; i++)
-            if(files[i].inode_number==inodenum)
-                files[i].mount_point=-1;
-        int num_blocks = inode.size/BLOCKSIZE;
-        if(num_blocks*BLOCKSIZE<inode.size)
+        int bs = mounts[mount_point].block_size;
+        int num_blocks = inode.size/bs;
+        if(num_blocks*bs<inode.size)
             num_blocks++;
         for(int i=0; i<num_blocks; i++)
-            free_datablock(mount_point, inode.mappings[i]);
-        free_inode(mount_point, inodenum);
-        return inode.parent;
+            if(inode.mappings[i] != -1)
+                blocks[(*nblocks)++] = inode.mappings[i];
+    }
+    else{
+        for(int i=0; i<inode.size; i++)
+            collect_entity(mount_point, inode.mappings[i], blocks, nblocks, inodes, ninodes);
     }
+    inodes[(*ninodes)++] = inodenum;
+}
+
+int delete_entity(int mount_point, int inodenum){
+    /*
+        * Delete the entity denoted by inodenum (inode number) and its whole subtree
+        * The freed blocks and inodes are collected first and released
+          together with a single superblock update
+        
+        * Return value : inode number of the parent directory
+    */
+
+    struct inode_t inode;
+    read_inode(mount_point, inodenum, &inode);
+
+    char blocks[MAX_INODES * MAX_FILE_SIZE];
+    char inodes[MAX_INODES];
+    int nblocks = 0, ninodes = 0;
+    collect_entity(mount_point, inodenum, blocks, &nblocks, inodes, &ninodes);
+    free_batch(mount_point, blocks, nblocks, inodes, ninodes);
 
-    for(int i=0; i<MAX_DIR_HANDLES; i++)
-        if(dir[i].inode_number==inodenum)
-            dir[i].mount_point=-1;
-    
-    for(int i=0; i<inode.size; i++)
-        delete_entity(mount_point, inode.mappings[i]);
-    free_inode(mount_point, inodenum);
     return inode.parent;
 }
 
-int emufs_delete(int dir_handle, char* path) {
+static int emufs_delete_(int dir_handle, char* path) {
     /*
         * Function to delete a file or directory at the given path.
         * The function first locates the inode of the entity to be deleted, then removes its entry
@@ -373,6 +707,11 @@ int emufs_delete(int dir_handle, char* path) {
         return -1;  // Return error if mount point is invalid.
     }
 
+    // A snapshot mount is read-only.
+    if (mounts[mnt].snapshot) {
+        return -1;
+    }
+
     // Get the inode number for the entity located at the given path.
     int inodenum = return_inode(mnt, dir[dir_handle].inode_number, path);
     if (inodenum <= 0) {
@@ -410,7 +749,102 @@ int emufs_delete(int dir_handle, char* path) {
 }
 
 
-int emufs_create(int dir_handle, char* name, int type) {
+static void collect_table_entity(int mount_point, struct inode_t *inodes, int inodenum, char *removed,
+                                 char *blocks, int *nblocks, char *freed, int *nfreed) {
+    /*
+        * collect_entity over an in-memory inode table: gathers the entity and its subtree,
+        * closes their handles and marks them in removed
+    */
+
+    struct inode_t *inode = &inodes[inodenum];
+    invalidate_handles(mount_point, inodenum);
+
+    if (inode->type == 0) {
+        collect_file_blocks(mounts[mount_point].block_size, inodes, inodenum, blocks, nblocks);
+    }
+    else {
+        for (int i = 0; i < inode->size; i++) {
+            collect_table_entity(mount_point, inodes, inode->mappings[i], removed, blocks, nblocks, freed, nfreed);
+        }
+    }
+    removed[inodenum] = 1;
+    freed[(*nfreed)++] = inodenum;
+}
+
+static int emufs_delete_batch_(int dir_handle, char** paths, int count) {
+    /*
+        * Deletes the entities at `count` paths (relative to dir_handle) in one pass.
+        * Every path is resolved before anything is deleted. The subtrees are then gathered
+        * from the inode table read once into memory, their blocks and inodes are freed with
+        * a single superblock update and the parents are stored with one inode table write.
+        * A path inside a subtree deleted earlier in the list counts as deleted.
+
+        * Return value: -1,     error (invalid handle, an entity not found)
+                         count, success
+    */
+
+    int mnt = dir_handle >= 0 && dir_handle < MAX_DIR_HANDLES ? dir[dir_handle].mount_point : -1;
+    if (mnt == -1 || count <= 0) {
+        return -1;
+    }
+    if (mounts[mnt].snapshot) {
+        return -1;  // A snapshot mount is read-only
+    }
+
+    int targets[MAX_INODES];
+    int ntargets = 0;
+    for (int i = 0; i < count; i++) {
+        int inodenum = return_inode(mnt, dir[dir_handle].inode_number, paths[i]);
+        if (inodenum <= 0) {
+            return -1;  // Missing entity or the root
+        }
+        int listed = 0;
+        for (int j = 0; j < ntargets; j++) {
+            listed |= targets[j] == inodenum;
+        }
+        if (!listed) {
+            targets[ntargets++] = inodenum;
+        }
+    }
+
+    struct inode_t inodes[MAX_INODES];
+    read_inode_table(mnt, inodes);
+
+    char removed[MAX_INODES];
+    char blocks[MAX_INODES * MAX_FILE_SIZE];
+    char freed[MAX_INODES];
+    int nblocks = 0, nfreed = 0;
+    memset(removed, 0, MAX_INODES);
+
+    for (int i = 0; i < ntargets; i++) {
+        int inodenum = targets[i];
+        if (removed[inodenum]) {
+            continue;
+        }
+        collect_table_entity(mnt, inodes, inodenum, removed, blocks, &nblocks, freed, &nfreed);
+
+        // Unlink it from its parent in the table
+        struct inode_t *parent = &inodes[(int)inodes[inodenum].parent];
+        int del = 0;
+        for (int j = 0; j < parent->size; j++) {
+            if (del) {
+                parent->mappings[j - 1] = parent->mappings[j];
+            }
+            if (parent->mappings[j] == inodenum) {
+                del = 1;
+            }
+        }
+        parent->size -= del;
+    }
+
+    free_batch(mnt, blocks, nblocks, freed, nfreed);
+    write_inode_table(mnt, inodes);
+
+    return count;
+}
+
+
+static int emufs_create_(int dir_handle, char* name, int type) {
     /*
         * This function creates either a directory (type = 1) or a file (type = 0) within the directory specified by dir_handle.
         * It ensures that no directory or file with the same name already exists within the specified directory.
@@ -441,6 +875,9 @@ int emufs_create(int dir_handle, char* name, int type) {
 
     // Retrieve the mount point for the directory and the corresponding inode
     int mount_point = dir[dir_handle].mount_point;
+    if (mounts[mount_point].snapshot) {
+        return -1;  // A snapshot mount is read-only
+    }
     read_inode(mount_point, dir[dir_handle].inode_number, &inode);
 
     // Create a temporary buffer to hold the name of the new entity
@@ -470,6 +907,9 @@ int emufs_create(int dir_handle, char* name, int type) {
 
     // Allocate a new inode for the new entity
     int new_inodenum = alloc_inode(mount_point);
+    if (new_inodenum == -1) {
+        return -1;  // No free inode left
+    }
     inode.mappings[inode.size] = new_inodenum;
     inode.size++;
 
@@ -489,98 +929,328 @@ int emufs_create(int dir_handle, char* name, int type) {
 }
 
 
-int open_file(int dir_handle, char* path) {
+static int emufs_create_batch_(int dir_handle, char** names, int* types, int count) {
     /*
-        * This function opens a file denoted by the given path within the directory specified by dir_handle.
-        * It retrieves the inode for the file using the return_inode function.
-        * A file handle is then allocated using alloc_file_handle.
-        * The file handle is initialized with the relevant mount point, inode number, and an offset of 0.
-        
-        * Return value:
-        *   -1: In case of an error (e.g., invalid inode or failure to allocate file handle)
-        *   File handle number (>= 0): On success, returning a valid file handle
+        * Creates `count` entities in the directory of dir_handle in one pass.
+        * The names are checked up front, against the directory's entries and against each other,
+        * using the inode table read once into memory. Then the inodes are allocated with a single
+        * superblock update, and the parent and the new inodes are stored with one inode table write.
+        * Nothing is created if any name is rejected.
+
+        * Return value: -1,     error (invalid name, duplicate entity, directory or inodes full)
+                         count, success
     */
 
-    // Retrieve the mount point associated with the directory handle
-    int mnt = dir[dir_handle].mount_point;
-
-    // Retrieve the inode number for the file at the specified path
-    int inodenum = return_inode(mnt, dir[dir_handle].inode_number, path);
-    if (inodenum == -1) {
-        // If inode retrieval fails, return error
+    int mount_point = dir_handle >= 0 && dir_handle < MAX_DIR_HANDLES ? dir[dir_handle].mount_point : -1;
+    if (mount_point == -1 || count <= 0) {
         return -1;
     }
+    if (mounts[mount_point].snapshot) {
+        return -1;  // A snapshot mount is read-only
+    }
 
-    // Create an inode structure to store the inode details
-    struct inode_t inode;
-    read_inode(mnt, inodenum, &inode);
+    struct inode_t inodes[MAX_INODES];
+    read_inode_table(mount_point, inodes);
 
-    // Check if the inode type is valid (e.g., not a directory or special type)
-    if (inode.type) {
-        // If the inode type is not suitable (like a directory), return error
+    int parent = dir[dir_handle].inode_number;
+    struct inode_t *inode = &inodes[parent];
+
+    // A directory holds at most MAX_FILE_SIZE entries
+    if (inode->size + count > MAX_FILE_SIZE) {
         return -1;
     }
 
-    // Allocate a new file handle
-    int file_handle = alloc_file_handle();
-    if (file_handle == -1) {
-        // If file handle allocation fails, return error
+    // Padded names of the directory's entries followed by the new ones: the set every name is checked against
+    char enames[2 * MAX_FILE_SIZE][MAX_ENTITY_NAME];
+    int etypes[2 * MAX_FILE_SIZE];
+    int nnames = 0;
+    for (int i = 0; i < inode->size; i++) {
+        memcpy(enames[nnames], inodes[(int)inode->mappings[i]].name, MAX_ENTITY_NAME);
+        etypes[nnames++] = inodes[(int)inode->mappings[i]].type;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *name = names[i];
+        if (strlen(name) > MAX_ENTITY_NAME || name[0] == 0 || name[0] == '/' || name[0] == '.') {
+            return -1;
+        }
+        if (types[i] != 0 && types[i] != 1) {
+            return -1;
+        }
+
+        char ename[MAX_ENTITY_NAME];
+        memset(ename, 0, MAX_ENTITY_NAME);
+        memcpy(ename, name, strlen(name));
+
+        // A file and a directory may share a name
+        for (int j = 0; j < nnames; j++) {
+            if (etypes[j] == types[i] && memcmp(ename, enames[j], MAX_ENTITY_NAME) == 0) {
+                return -1;
+            }
+        }
+        memcpy(enames[nnames], ename, MAX_ENTITY_NAME);
+        etypes[nnames++] = types[i];
+    }
+
+    int new_inodes[MAX_FILE_SIZE];
+    if (alloc_inodes(mount_point, count, new_inodes) == -1) {
         return -1;
     }
 
-    // Initialize the file handle with the mount point, inode number, and offset
-    files[file_handle].mount_point = mnt;
-    files[file_handle].inode_number = inodenum;
-    files[file_handle].offset = 0;
+    for (int i = 0; i < count; i++) {
+        struct inode_t *entry = &inodes[new_inodes[i]];
+        memset(entry, 0, sizeof(struct inode_t));
+        memcpy(entry->name, enames[nnames - count + i], MAX_ENTITY_NAME);
+        entry->type = types[i];
+        entry->parent = parent;
+        for (int b = 0; b < MAX_FILE_SIZE; b++) {
+            entry->mappings[b] = -1;
+        }
+        inode->mappings[inode->size++] = new_inodes[i];
+    }
+    write_inode_table(mount_point, inodes);
 
-    // Return the allocated file handle
-    return file_handle;
+    return count;
 }
 
 
-int emufs_read(int file_handle, char* buf, int size){
+static int emufs_rename_(int dir_handle, char* from, char* to) {
     /*
-        * Function to read a specified number of bytes from a file into a buffer.
-        * The read starts from the current seek offset and reads up to the given size.
-        * The seek offset in the file is updated by the size of the data read.
-        * 
-        * Parameters:
-        *   file_handle: An integer that identifies the file to be read.
-        *   buf: A pointer to a buffer where the read data will be stored.
-        *   size: The number of bytes to read from the file.
-        * 
-        * Returns:
-        *   -1 if an error occurs (e.g., invalid read range).
-        *   1 if the read operation is successful.
-        */
-
-    // Retrieve the mount point, current seek position, and inode number for the file.
-    int mnt = files[file_handle].mount_point;
-    int seek = files[file_handle].offset;
-    int inodenum = files[file_handle].inode_number;
-
-    // Read the inode to access file metadata such as size and block mappings.
-    struct inode_t inode;
-    read_inode(mnt, inodenum, &inode);
+        * Moves the entity at `from` to `to` (both relative to dir_handle); the last component
+        * of `to` is its new name and the rest the directory it goes to.
+        * Only directory entries change: the entity keeps its inode, its blocks and its open handles.
+        * The old parent, the new parent and the entity are updated in memory and stored with
+        * one inode table write.
+
+        * Return value: -1, error (entity or target directory not found, invalid name, an entity of
+                            the same name and type at the target, target directory full, or a
+                            directory moved below itself)
+                         1, success
+    */
 
-    // If the file's size is smaller than the requested read size, return an error.
-    if(inode.size < seek + size)
+    int mnt = dir_handle >= 0 && dir_handle < MAX_DIR_HANDLES ? dir[dir_handle].mount_point : -1;
+    if (mnt == -1) {
+        return -1;
+    }
+    if (mounts[mnt].snapshot) {
+        return -1;  // A snapshot mount is read-only
+    }
+
+    int inodenum = return_inode(mnt, dir[dir_handle].inode_number, from);
+    if (inodenum <= 0) {
+        return -1;  // Missing entity or the root
+    }
+
+    // Split the target into its directory and the new name
+    char *name = strrchr(to, '/') ? strrchr(to, '/') + 1 : to;
+    int parent = dir[dir_handle].inode_number;
+    if (name != to) {
+        char parent_path[name - to + 1];
+        memcpy(parent_path, to, name - to);
+        parent_path[name - to] = 0;
+        parent = return_inode(mnt, parent, parent_path);
+        if (parent == -1) {
+            return -1;
+        }
+    }
+    if (strlen(name) > MAX_ENTITY_NAME || name[0] == 0 || name[0] == '.') {
+        return -1;
+    }
+    char ename[MAX_ENTITY_NAME];
+    memset(ename, 0, MAX_ENTITY_NAME);
+    memcpy(ename, name, strlen(name));
+
+    struct inode_t inodes[MAX_INODES];
+    read_inode_table(mnt, inodes);
+    struct inode_t *inode = &inodes[inodenum];
+    struct inode_t *target = &inodes[parent];
+    if (target->type != 1) {
+        return -1;
+    }
+
+    // A directory cannot go below itself
+    for (int i = parent; i != 0; i = inodes[i].parent) {
+        if (i == inodenum) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < target->size; i++) {
+        struct inode_t *entry = &inodes[(int)target->mappings[i]];
+        if (target->mappings[i] != inodenum && entry->type == inode->type
+            && memcmp(ename, entry->name, MAX_ENTITY_NAME) == 0) {
+            return -1;
+        }
+    }
+
+    if (parent != inode->parent) {
+        if (target->size == MAX_FILE_SIZE) {
+            return -1;
+        }
+
+        // Unlink from the old parent and link into the new one
+        struct inode_t *old = &inodes[(int)inode->parent];
+        int del = 0;
+        for (int i = 0; i < old->size; i++) {
+            if (del) {
+                old->mappings[i - 1] = old->mappings[i];
+            }
+            if (old->mappings[i] == inodenum) {
+                del = 1;
+            }
+        }
+        old->size -= del;
+        target->mappings[target->size++] = inodenum;
+        inode->parent = parent;
+    }
+    memcpy(inode->name, ename, MAX_ENTITY_NAME);
+    write_inode_table(mnt, inodes);
+
+    return 1;
+}
+
+
+static int open_file_(int dir_handle, char* path) {
+    /*
+        * This function opens a file denoted by the given path within the directory specified by dir_handle.
+        * It retrieves the inode for the file using the return_inode function.
+        * A file handle is then allocated using alloc_file_handle.
+        * The file handle is initialized with the relevant mount point, inode number, and an offset of 0.
+        
+        * Return value:
+        *   -1: In case of an error (e.g., invalid inode or failure to allocate file handle)
+        *   File handle number (>= 0): On success, returning a valid file handle
+    */
+
+    // Retrieve the mount point associated with the directory handle
+    int mnt = dir[dir_handle].mount_point;
+
+    // Retrieve the inode number for the file at the specified path
+    int inodenum = return_inode(mnt, dir[dir_handle].inode_number, path);
+    if (inodenum == -1) {
+        // If inode retrieval fails, return error
+        return -1;
+    }
+
+    // Create an inode structure to store the inode details
+    struct inode_t inode;
+    read_inode(mnt, inodenum, &inode);
+
+    // Check if the inode type is valid (e.g., not a directory or special type)
+    if (inode.type) {
+        // If the inode type is not suitable (like a directory), return error
+        return -1;
+    }
+
+    // Allocate a new file handle
+    int file_handle = alloc_file_handle();
+    if (file_handle == -1) {
+        // If file handle allocation fails, return error
+        return -1;
+    }
+
+    // Initialize the file handle with the mount point, inode number, and offset
+    files[file_handle].mount_point = mnt;
+    files[file_handle].inode_number = inodenum;
+    files[file_handle].offset = 0;
+    files[file_handle].ra_next = 0;
+    files[file_handle].ra_window = 0;
+    files[file_handle].wb_len = 0;
+    files[file_handle].wb_reserved = 0;
+    inode_files[mnt][inodenum] |= 1 << file_handle;
+
+    // Return the allocated file handle
+    return file_handle;
+}
+
+
+static int emufs_read_(int file_handle, char* buf, int size){
+    /*
+        * Function to read a specified number of bytes from a file into a buffer.
+        * The read starts from the current seek offset and reads up to the given size.
+        * The seek offset in the file is updated by the size of the data read.
+        * 
+        * Parameters:
+        *   file_handle: An integer that identifies the file to be read.
+        *   buf: A pointer to a buffer where the read data will be stored.
+        *   size: The number of bytes to read from the file.
+        * 
+        * Returns:
+        *   -1 if an error occurs (e.g., invalid read range).
+        *   1 if the read operation is successful.
+        */
+
+    // Retrieve the mount point, current seek position, and inode number for the file.
+    int mnt = files[file_handle].mount_point;
+    int seek = files[file_handle].offset;
+    int inodenum = files[file_handle].inode_number;
+
+    // Pending appends of any handle on this file must be on disk before reading.
+    if(flush_inode_buffers(mnt, inodenum, -1) == -1)
+        return -1;
+
+    // Read the inode to access file metadata such as size and block mappings.
+    struct inode_t inode;
+    read_inode(mnt, inodenum, &inode);
+
+    // If the file's size is smaller than the requested read size, return an error.
+    if(inode.size < seek + size)
         return -1;
     
+    // On a compressed filesystem the file is decoded as a whole and the range copied out.
+    if(mounts[mnt].ops->read_file){
+        char data[mounts[mnt].max_file_size];
+        if(mounts[mnt].ops->read_file(mnt, &inode, data) == -1)
+            return -1;
+        memcpy(buf, data + seek, size);
+        files[file_handle].offset += size;
+        return 1;
+    }
+
+    // Sequential detection: a read starting where the previous one ended grows the
+    // readahead window (1, 2, 4, ... blocks); any other read resets it.
+    if(seek == files[file_handle].ra_next){
+        int window = files[file_handle].ra_window ? files[file_handle].ra_window * 2 : 1;
+        files[file_handle].ra_window = window < MAX_READAHEAD ? window : MAX_READAHEAD;
+    }
+    else{
+        files[file_handle].ra_window = 0;
+    }
+    files[file_handle].ra_next = seek + size;
+
+    // Load the blocks of this read plus the readahead window into the block cache in one go,
+    // and ask the host to start on the window after that.
+    int bs = mounts[mnt].block_size;
+    int num_blocks = inode.size / bs;
+    if(num_blocks * bs < inode.size)
+        num_blocks++;
+    int first = seek / bs;
+    int last = first + (size ? (seek % bs + size - 1) / bs : -1);
+    int ra_end = last + files[file_handle].ra_window;
+    int hint_end = ra_end + files[file_handle].ra_window;
+    ra_end = ra_end < num_blocks ? ra_end : num_blocks - 1;
+    hint_end = hint_end < num_blocks ? hint_end : num_blocks - 1;
+    if(ra_end >= first)
+        prefetch_blocks(mnt, inode.mappings + first, ra_end - first + 1,
+                        inode.mappings + ra_end + 1, hint_end > ra_end ? hint_end - ra_end : 0);
+
     // Temporary buffer to hold data read from each block.
-    char temp_buf[BLOCKSIZE];
+    char temp_buf[bs];
 
     // Loop through the file's data blocks to read the requested size.
-    for(int i = seek / BLOCKSIZE; i * BLOCKSIZE < (seek + size); i++){
+    for(int i = seek / bs; i * bs < (seek + size); i++){
         // Calculate the start (a) and end (b) positions for the current block's data.
-        int a = i * BLOCKSIZE > seek ? i * BLOCKSIZE : seek;  // Start of the current block to read.
-        int b = (i + 1) * BLOCKSIZE < (seek + size) ? (i + 1) * BLOCKSIZE : (seek + size);  // End of the current block to read.
+        int a = i * bs > seek ? i * bs : seek;  // Start of the current block to read.
+        int b = (i + 1) * bs < (seek + size) ? (i + 1) * bs : (seek + size);  // End of the current block to read.
 
-        // Read the data block into the temporary buffer.
-        read_datablock(mnt, inode.mappings[i], temp_buf);
+        // Read the data block into the temporary buffer; a hole reads as zeros without any I/O.
+        if(inode.mappings[i] == -1)
+            memset(temp_buf, 0, bs);
+        else
+            read_datablock(mnt, inode.mappings[i], temp_buf);
 
         // Copy the relevant portion of the block into the provided buffer.
-        memcpy(buf + a - seek, temp_buf + a - i * BLOCKSIZE, b - a);
+        memcpy(buf + a - seek, temp_buf + a - i * bs, b - a);
     }
 
     // Update the file's seek offset to reflect the number of bytes read.
@@ -591,126 +1261,381 @@ int emufs_read(int file_handle, char* buf, int size){
 }
 
 
-int emufs_write(int file_handle, char* buf, int size){
+int write_data(int file_handle, int seek, char* buf, int size){
     /*
-        * This function writes a chunk of data from the provided buffer to the file starting from the current seek offset.
+        * This function writes a chunk of data from the provided buffer to the file starting at the given offset.
         * It handles writing to file blocks that may not align with the block size, ensuring that partial blocks are correctly written.
         * The inode is updated if the file's size or mapping changes.
-        * The file handle’s offset is updated to reflect the new position after the write.
+        * The file handle’s offset is left untouched; emufs_write and the write-back buffer flush both use this.
         
         * Return value:
             -1: error occurred (e.g., invalid size or insufficient space)
             1: success (data written successfully)
     */
 
-    // Get the mount point, seek position, and inode number of the file being written to
+    EMUFS_SPAN("write_data");
+
+    // Get the mount point and inode number of the file being written to
     int mnt = files[file_handle].mount_point;
-    int seek = files[file_handle].offset;
     int inodenum = files[file_handle].inode_number;
 
-    // Check if the requested write goes beyond the maximum allowed file size
-    if(seek + size > BLOCKSIZE * MAX_FILE_SIZE)
-        return -1;
-
-    // Read the superblock to gather information about available space
-    struct superblock_t superblock;
-    read_superblock(mnt, &superblock);
-
     // Read the inode to get file metadata (size, mappings, etc.)
     struct inode_t inode;
     read_inode(mnt, inodenum, &inode);
 
-    // If the new write size extends the current file size, check if there is enough space
-    if(seek + size > inode.size){
-        int num_req;
-        int k = (seek + size) / BLOCKSIZE;
-        num_req = k;
-        
-        // If size isn't a multiple of BLOCKSIZE, increase the required block count
-        if(k * BLOCKSIZE < (seek + size))
-            num_req++;
-        
-        // Determine how many additional blocks are needed to extend the file
-        k = inode.size / BLOCKSIZE;
-        num_req -= k;
-        if(k * BLOCKSIZE < inode.size)
-            num_req--;
-        
-        // If there aren't enough free blocks in the disk, return an error
-        if(superblock.disk_size - superblock.used_blocks < num_req)
+    // On a compressed filesystem the whole file is decoded, patched and re-encoded,
+    // so the number of blocks it occupies follows its compressed size.
+    if(mounts[mnt].ops->read_file){
+        char data[mounts[mnt].max_file_size];
+        if(mounts[mnt].ops->read_file(mnt, &inode, data) == -1)
             return -1;
+        if(seek > inode.size)
+            memset(data + inode.size, 0, seek - inode.size);  // the gap reads as zeros
+        memcpy(data + seek, buf, size);
+        int new_size = inode.size > (seek + size) ? inode.size : (seek + size);
+        if(mounts[mnt].ops->write_file(mnt, &inode, data, new_size) == -1)
+            return -1;
+        write_inode(mnt, inodenum, &inode);
+        return 1;
     }
 
-    // Temporary buffer for reading and writing blocks
-    char temp_buf[BLOCKSIZE];
-    int num_blocks = inode.size / BLOCKSIZE;
+    // Read the superblock to gather information about available space
+    struct superblock_t superblock;
+    read_superblock(mnt, &superblock);
+
+    int bs = mounts[mnt].block_size;
+    int num_blocks = inode.size / bs;
     
-    // Adjust number of blocks if file size isn't an exact multiple of BLOCKSIZE
-    if(num_blocks * BLOCKSIZE < inode.size)
+    // Adjust number of blocks if file size isn't an exact multiple of the block size
+    if(num_blocks * bs < inode.size)
         num_blocks++;
 
+    // Blocks between the old end of the file and the start of this write become holes
+    for(int i = num_blocks; i < seek / bs; i++)
+        inode.mappings[i] = -1;
+
+    // Blocks needed by this write: new blocks past the end of the file or in holes ...
+    int num_new = 0, num_req = 0;
+    for(int i = seek / bs; i * bs < (seek + size); i++)
+        if(i >= num_blocks || inode.mappings[i] == -1)
+            num_new++;
+    num_req = num_new;
+
+    // ... plus a copy for every shared block that gets modified (copy-on-write)
+    for(int i = seek / bs; i < num_blocks && i * bs < (seek + size); i++)
+        if(inode.mappings[i] != -1 && superblock.block_refs[(int)inode.mappings[i]] > 0)
+            num_req++;
+
+    // If there aren't enough free blocks in the disk (less those promised to write-back buffers), return an error
+    if(superblock.disk_size - superblock.used_blocks - mounts[mnt].reserved_blocks < num_req)
+        return -1;
+
+    int new_size = inode.size > (seek + size) ? inode.size : (seek + size);
+    int dedup = superblock.dedup_index != 0;
+
+    // Allocate all the new blocks of this write in one allocator transaction,
+    // so the allocator sees the whole extent and can place it contiguously
+    char new_blocks[MAX_FILE_SIZE], unused_blocks[MAX_FILE_SIZE];
+    int next_new = 0, num_unused = 0;
+    if(num_new && alloc_datablocks(mnt, num_new, new_blocks) == -1)
+        return -1;
+
+    // The new content of the blocks is staged and written with one call after the loop,
+    // so the members of a striped volume are written in parallel
+    int touched = size > 0 ? (seek + size - 1) / bs - seek / bs + 1 : 1;
+    char staged[touched * bs], staged_blocks[MAX_FILE_SIZE];
+    int num_staged = 0;
+
     // Loop through the blocks affected by the write operation
-    for(int i = seek / BLOCKSIZE; i * BLOCKSIZE < (seek + size); i++){
+    for(int i = seek / bs; i * bs < (seek + size); i++){
+        char *temp_buf = staged + num_staged * bs;
         int a, b;
         // Determine the start and end positions of the data to write within the block
-        a = i * BLOCKSIZE > seek ? i * BLOCKSIZE : seek;
-        b = (i + 1) * BLOCKSIZE < (seek + size) ? (i + 1) * BLOCKSIZE : (seek + size);
-        
-        // If this is a new block, allocate it and write the data from the buffer
-        if(i == num_blocks){
-            inode.mappings[i] = alloc_datablock(mnt);
-            memcpy(temp_buf, buf + a - seek, b - a);
-            write_datablock(mnt, inode.mappings[i], temp_buf);
-            num_blocks++;
+        a = i * bs > seek ? i * bs : seek;
+        b = (i + 1) * bs < (seek + size) ? (i + 1) * bs : (seek + size);
+        int old = i < num_blocks ? inode.mappings[i] : -1;
+
+        // Build the new content of the block: fresh for a new block or hole, read-modify for an existing one
+        if(old == -1){
+            memset(temp_buf, 0, bs);
         }
-        // If the block is already allocated, read it, update it, and write it back
         else{
-            read_datablock(mnt, inode.mappings[i], temp_buf);
-            memcpy(temp_buf + a - i * BLOCKSIZE, buf + a - seek, b - a);
+            read_datablock(mnt, old, temp_buf);
+            // Bytes past the old end of the file read as zeros once the file grows over them
+            if(inode.size < (i + 1) * bs)
+                memset(temp_buf + inode.size - i * bs, 0, (i + 1) * bs - inode.size);
+        }
+        memcpy(temp_buf + a - i * bs, buf + a - seek, b - a);
+
+        // In dedup mode a full block whose content is already on disk just takes a reference to it
+        unsigned int hash = 0;
+        if(dedup && (i + 1) * bs <= new_size){
+            hash = block_hash(temp_buf, bs);
+            int dup = dedup_lookup(mnt, temp_buf, hash);
+            if(dup != -1){
+                if(old == -1)
+                    unused_blocks[num_unused++] = new_blocks[next_new++];
+                if(dup != old){
+                    share_datablock(mnt, dup);
+                    if(old != -1)
+                        free_datablock(mnt, old);
+                    inode.mappings[i] = dup;
+                }
+                if(i >= num_blocks)
+                    num_blocks = i + 1;
+                continue;
+            }
+        }
+
+        // A new block takes the next block of the batch; a shared one about to be modified gets a copy
+        if(old == -1){
+            inode.mappings[i] = new_blocks[next_new++];
+        }
+        else if(datablock_shared(mnt, old)){
+            int blocknum = alloc_datablock(mnt);
+            if(blocknum == -1){
+                // Out of space: keep what has been written so far consistent on disk
+                while(next_new < num_new)
+                    unused_blocks[num_unused++] = new_blocks[next_new++];
+                free_batch(mnt, unused_blocks, num_unused, NULL, 0);
+                if(num_staged)
+                    write_datablocks(mnt, staged_blocks, num_staged, staged);
+                inode.size = inode.size > a ? inode.size : a;
+                write_inode(mnt, inodenum, &inode);
+                return -1;
+            }
+            free_datablock(mnt, old);   // drops this file's reference to the shared block
+            inode.mappings[i] = blocknum;
+        }
+
+        // In dedup mode the block is written at once, so later lookups compare against its new content
+        if(dedup){
+            dedup_update(mnt, inode.mappings[i], hash);
             write_datablock(mnt, inode.mappings[i], temp_buf);
         }
+        else
+            staged_blocks[num_staged++] = inode.mappings[i];
+        if(i >= num_blocks)
+            num_blocks = i + 1;
     }
+    if(num_staged)
+        write_datablocks(mnt, staged_blocks, num_staged, staged);
+
+    // Blocks of the batch that dedup made unnecessary go back to the allocator
+    if(num_unused)
+        free_batch(mnt, unused_blocks, num_unused, NULL, 0);
 
     // Update the inode size to the new size if necessary
-    inode.size = inode.size > (seek + size) ? inode.size : (seek + size);
+    inode.size = new_size;
     write_inode(mnt, inodenum, &inode);
 
-    // Update the file handle’s offset to reflect the new position
-    files[file_handle].offset += size;
-
     // Return success
     return 1;
 }
 
 
-int emufs_seek(int file_handle, int nseek) {
+int flush_write_buffer(int file_handle){
+    /*
+        * Write the handle's pending appended bytes to the file
+        * Their blocks are allocated now, in one batch, and the inode is written once
+        
+        * Return value:
+            -1: error occurred (the pending bytes and their reservation are kept, so a later flush can retry)
+            1: success (or nothing pending)
+    */
+
+    EMUFS_SPAN("flush_write_buffer");
+
+    struct file_t *file = &files[file_handle];
+    if(file->wb_len == 0){
+        // An empty buffer needs no blocks
+        mounts[file->mount_point].reserved_blocks -= file->wb_reserved;
+        file->wb_reserved = 0;
+        return 1;
+    }
+
+    // The reserved blocks are handed to write_data, which allocates them
+    mounts[file->mount_point].reserved_blocks -= file->wb_reserved;
+    if(write_data(file_handle, file->wb_offset, file->wb_data, file->wb_len) == -1){
+        mounts[file->mount_point].reserved_blocks += file->wb_reserved;
+        return -1;
+    }
+    file->wb_reserved = 0;
+    file->wb_len = 0;
+    return 1;
+}
+
+
+int flush_inode_buffers(int mount_point, int inodenum, int except){
+    /*
+        * Flush the write-back buffers of all handles open on the inode except `except`,
+        * so that a read, seek or write through one handle sees what the others appended
+
+        * Return value: -1 if a buffer could not be written, else 1
+    */
+
+    int mask = inode_files[mount_point][inodenum];
+    int ret = 1;
+    while(mask){
+        int handle = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if(handle != except && flush_write_buffer(handle) == -1)
+            ret = -1;
+    }
+    return ret;
+}
+
+
+int flush_mount_buffers(int mount_point){
+    /*
+        * Flush the write-back buffers of every handle on the mount
+
+        * Return value: -1 if a buffer could not be written, else 1
+    */
+
+    int ret = 1;
+    for(int i = 0; i < MAX_FILE_HANDLES; i++)
+        if(files[i].mount_point == mount_point && flush_write_buffer(i) == -1)
+            ret = -1;
+    return ret;
+}
+
+
+static int emufs_sync_(int file_handle){
+    /*
+        * Flush the handle's write-back buffer to disk
+        
+        * Return value:
+            -1: error occurred (invalid handle or write failure)
+            1: success
+    */
+
+    if(file_handle < 0 || file_handle >= MAX_FILE_HANDLES || files[file_handle].mount_point == -1)
+        return -1;
+    return flush_write_buffer(file_handle);
+}
+
+
+static int emufs_write_(int file_handle, char* buf, int size){
+    /*
+        * This function writes a chunk of data from the provided buffer to the file starting from the current seek offset.
+        * Appends (writes at the end of the file) go to the handle's write-back buffer. Their blocks are only
+          reserved; allocation is delayed until the buffer is flushed (emufs_sync, close, unmount, or a
+          read/seek/overwrite that needs the data on disk), when the whole extent is allocated in one batch.
+          A file deleted before that never touches the bitmap or the device for its data.
+        * Anything else is written through (after flushing the buffer).
+        * The file handle’s offset is updated to reflect the new position after the write.
+        
+        * Return value:
+            -1: error occurred (e.g., invalid size or insufficient space)
+            1: success (data written successfully)
+    */
+
+    // Get the mount point, seek position, and inode number of the file being written to
+    int mnt = files[file_handle].mount_point;
+    int seek = files[file_handle].offset;
+    int inodenum = files[file_handle].inode_number;
+    struct file_t *file = &files[file_handle];
+
+    // Check if the requested write goes beyond the maximum allowed file size
+    if(mnt == -1 || size < 0 || seek + size > mounts[mnt].max_file_size)
+        return -1;
+
+    // A snapshot mount is read-only
+    if(mounts[mnt].snapshot)
+        return -1;
+
+    // Nothing to write: no buffer and no reservation
+    if(size == 0)
+        return 1;
+
+    // Other handles on this file may hold appended bytes that this write must land after
+    if(flush_inode_buffers(mnt, inodenum, file_handle) == -1)
+        return -1;
+
+    // Is this an append? The end of the file is the end of the pending bytes, if any
+    int end;
+    struct inode_t inode;
+    if(file->wb_len){
+        end = file->wb_offset + file->wb_len;
+    }
+    else{
+        read_inode(mnt, inodenum, &inode);
+        end = inode.size;
+    }
+
+    // The buffer lives as long as the handle
+    if(!file->wb_data && seek == end)
+        file->wb_data = (char*)malloc(mounts[mnt].max_file_size);
+
+    if(seek != end || !file->wb_data){
+        if(flush_write_buffer(file_handle) == -1 || write_data(file_handle, seek, buf, size) == -1)
+            return -1;
+        files[file_handle].offset += size;
+        return 1;
+    }
+
+    // A new buffer: count the blocks below its end that the flush will not need to allocate
+    int bs = mounts[mnt].block_size;
+    if(file->wb_len == 0){
+        file->wb_offset = seek;
+        if(mounts[mnt].ops->write_file){
+            // A compressed file is rewritten as a whole; only its unshared blocks can be reused
+            // (the mapped blocks are a prefix of the mappings covered by the size)
+            file->wb_have = 0;
+            for(int i = 0; i * bs < inode.size && inode.mappings[i] != -1; i++)
+                if(!datablock_shared(mnt, inode.mappings[i]))
+                    file->wb_have++;
+        }
+        else{
+            // Blocks before the end are not touched; the last, partial block is reused unless
+            // it is a hole or shared (then the flush copies it)
+            int first = seek / bs;
+            file->wb_have = first;
+            if(seek % bs && inode.mappings[first] != -1 && !datablock_shared(mnt, inode.mappings[first]))
+                file->wb_have++;
+        }
+    }
+
+    // Reserve the blocks the grown buffer will need
+    int needed = (seek + size + bs - 1) / bs - file->wb_have - file->wb_reserved;
+    if(needed > 0){
+        struct superblock_t superblock;
+        read_superblock(mnt, &superblock);
+        if(superblock.disk_size - superblock.used_blocks - mounts[mnt].reserved_blocks < needed)
+            return -1;
+        mounts[mnt].reserved_blocks += needed;
+        file->wb_reserved += needed;
+    }
+
+    memcpy(file->wb_data + file->wb_len, buf, size);
+    file->wb_len += size;
+
+    files[file_handle].offset += size;
+    return 1;
+}
+
+
+static int emufs_seek_(int file_handle, int nseek) {
     /*
      * Adjust the file offset for the specified file handle.
      * The function ensures that the new offset is within valid bounds:
      * - The offset cannot be negative.
-     * - The offset must not exceed the size of the file.
+     * - The offset may go past the end of the file (a later write leaves a hole),
+     *   but not past the maximum file size.
      *
      * Returns:
-     * - -1: If the new offset is invalid (e.g., exceeds file size or is negative).
+     * - -1: If the new offset is invalid (e.g., exceeds the maximum file size or is negative).
      * -  1: If the offset update is successful.
      */
 
-    // Retrieve the mount point, current offset, and inode number of the file
-    int mount_point = files[file_handle].mount_point;
+    // Retrieve the current offset of the file
     int current_offset = files[file_handle].offset;
-    int inode_num = files[file_handle].inode_number;
-
-    // If the requested seek is positive, check if the new offset is valid
-    if (nseek > 0) {
-        struct inode_t inode;
-
-        // Fetch the inode to check the file's size and other properties
-        read_inode(mount_point, inode_num, &inode);
+    int mnt = files[file_handle].mount_point;
 
-        // Validate that the new offset does not exceed the file's size
-        if (inode.size < (current_offset + nseek)) {
-            return -1; // Error: New offset exceeds file size
-        }
+    // Validate the new offset
+    if (mnt == -1 || current_offset + nseek < 0 || current_offset + nseek > mounts[mnt].max_file_size) {
+        return -1;
     }
 
     // Update the file's offset by adding the seek amount
@@ -722,12 +1647,259 @@ int emufs_seek(int file_handle, int nseek) {
 
 
 
-void flush_dir(int mount_point, int inodenum, int depth) {
-    // Structure to store inode information
+static int emufs_truncate_(int file_handle, int size){
+    /*
+        * Set the size of the file.
+        * Shrinking frees the blocks past the new end (in one batch) and zeroes the rest of the last block,
+          so that growing the file again shows zeros.
+        * Growing leaves a hole: the new range reads as zeros and has no blocks until it is written.
+        * On a compressed filesystem the file is decoded, resized and re-encoded.
+
+        * Return value:
+            -1: error occurred (invalid size, snapshot mount, or no space)
+            1: success
+    */
+
+    int mnt = files[file_handle].mount_point;
+    int inodenum = files[file_handle].inode_number;
+
+    if(mnt == -1 || size < 0 || size > mounts[mnt].max_file_size || mounts[mnt].snapshot)
+        return -1;
+
+    // Pending appends are part of the current size
+    if(flush_inode_buffers(mnt, inodenum, -1) == -1)
+        return -1;
+
+    struct inode_t inode;
+    read_inode(mnt, inodenum, &inode);
+
+    if(mounts[mnt].ops->read_file){
+        char data[mounts[mnt].max_file_size];
+        if(mounts[mnt].ops->read_file(mnt, &inode, data) == -1)
+            return -1;
+        if(size > inode.size)
+            memset(data + inode.size, 0, size - inode.size);
+        if(mounts[mnt].ops->write_file(mnt, &inode, data, size) == -1)
+            return -1;
+        write_inode(mnt, inodenum, &inode);
+        return 1;
+    }
+
+    int bs = mounts[mnt].block_size;
+    int num_blocks = inode.size / bs;
+    if(num_blocks * bs < inode.size)
+        num_blocks++;
+    int new_blocks = size / bs;
+    if(new_blocks * bs < size)
+        new_blocks++;
+
+    if(size < inode.size){
+        // Zero the tail of the new last block (through write_data, which copies it if shared)
+        int tail_end = new_blocks * bs < inode.size ? new_blocks * bs : inode.size;
+        if(size % bs && inode.mappings[new_blocks - 1] != -1){
+            char zeros[bs];
+            memset(zeros, 0, bs);
+            if(write_data(file_handle, size, zeros, tail_end - size) == -1)
+                return -1;
+            read_inode(mnt, inodenum, &inode);
+        }
+
+        char blocks[MAX_FILE_SIZE];
+        int count = 0;
+        for(int i = new_blocks; i < num_blocks; i++)
+            if(inode.mappings[i] != -1)
+                blocks[count++] = inode.mappings[i];
+        free_batch(mnt, blocks, count, NULL, 0);
+    }
+    else{
+        for(int i = num_blocks; i < new_blocks; i++)
+            inode.mappings[i] = -1;
+    }
+
+    inode.size = size;
+    write_inode(mnt, inodenum, &inode);
+
+    // Handles positioned past the new end keep their offset; a write there leaves a hole
+    return 1;
+}
+
+
+static int emufs_fallocate_(int file_handle, int size){
+    /*
+        * Make sure every block of the first `size` bytes is allocated, growing the file to `size` if needed.
+        * All missing blocks (holes and blocks past the end) are allocated in one allocator transaction,
+          as a contiguous run when the free space allows, and zero-filled.
+        * A later write into the range cannot fail for lack of space.
+
+        * Return value:
+            -1: error occurred (invalid size, snapshot mount, or not enough free blocks)
+            1: success
+    */
+
+    int mnt = files[file_handle].mount_point;
+    int inodenum = files[file_handle].inode_number;
+
+    if(mnt == -1 || size < 0 || size > mounts[mnt].max_file_size || mounts[mnt].snapshot)
+        return -1;
+
+    if(flush_inode_buffers(mnt, inodenum, -1) == -1)
+        return -1;
+
     struct inode_t inode;
+    read_inode(mnt, inodenum, &inode);
 
-    // Read the inode information from the specified file system and inode number
-    read_inode(mount_point, inodenum, &inode);
+    // Compressed files have no fixed block mapping to reserve; growing them is all that applies
+    if(mounts[mnt].ops->write_file)
+        return size > inode.size ? emufs_truncate_(file_handle, size) : 1;
+
+    int bs = mounts[mnt].block_size;
+    int num_blocks = inode.size / bs;
+    if(num_blocks * bs < inode.size)
+        num_blocks++;
+    int target_blocks = size / bs;
+    if(target_blocks * bs < size)
+        target_blocks++;
+
+    int count = 0;
+    for(int i = 0; i < target_blocks; i++)
+        if(i >= num_blocks || inode.mappings[i] == -1)
+            count++;
+
+    if(count){
+        struct superblock_t superblock;
+        read_superblock(mnt, &superblock);
+        if(superblock.disk_size - superblock.used_blocks - mounts[mnt].reserved_blocks < count)
+            return -1;
+
+        char blocks[MAX_FILE_SIZE];
+        if(alloc_datablocks(mnt, count, blocks) == -1)
+            return -1;
+
+        char zeros[bs];
+        for(int i = 0, k = 0; i < target_blocks; i++){
+            if(i < num_blocks && inode.mappings[i] != -1)
+                continue;
+            inode.mappings[i] = blocks[k++];
+            memset(zeros, 0, bs);    // write_datablock encrypts in place
+            write_datablock(mnt, inode.mappings[i], zeros);
+        }
+    }
+
+    if(size > inode.size)
+        inode.size = size;
+    write_inode(mnt, inodenum, &inode);
+    return 1;
+}
+
+
+static int copy_through(int src_handle, int dst_handle, int seek, int size){
+    // Copies `size` bytes from the source handle's offset (which advances) to `seek` in the destination file
+    char data[size];
+    if(emufs_read_(src_handle, data, size) == -1)
+        return -1;
+    return write_data(dst_handle, seek, data, size);
+}
+
+static int emufs_copy_range_(int src_handle, int dst_handle, int size){
+    /*
+        * Copy up to `size` bytes from the source file's offset to the destination file's offset,
+          inside the file system (like copy_file_range); both offsets advance by the bytes copied.
+        * On the same mount, when both offsets sit at the same position within a block, the whole
+          blocks of the range are not copied: the destination maps the source's blocks and takes a
+          reference to them (the copy-on-write of write_data and the reference counts of free_batch
+          keep the two files apart). So does the last, partial block when the copy ends both files.
+          The partial blocks at the ends of the range and every other case copy the bytes.
+        * Compressed file systems always copy: their blocks hold pieces of a file's stream.
+
+        * Return value:
+            -1: error occurred (invalid handle, snapshot mount, destination past the maximum size, or no space)
+            number of bytes copied: success (less than `size` at the end of the source, 0 past it)
+    */
+
+    if(src_handle < 0 || src_handle >= MAX_FILE_HANDLES || dst_handle < 0 || dst_handle >= MAX_FILE_HANDLES)
+        return -1;
+    int smnt = files[src_handle].mount_point, dmnt = files[dst_handle].mount_point;
+    if(smnt == -1 || dmnt == -1 || size < 0 || mounts[dmnt].snapshot)
+        return -1;
+    int sinode = files[src_handle].inode_number, dinode = files[dst_handle].inode_number;
+    int s = files[src_handle].offset, d = files[dst_handle].offset;
+
+    // Pending appends of both files go to disk first: the copy works on the inodes
+    if(flush_inode_buffers(smnt, sinode, -1) == -1 || flush_inode_buffers(dmnt, dinode, -1) == -1)
+        return -1;
+
+    struct inode_t src, dst;
+    read_inode(smnt, sinode, &src);
+    read_inode(dmnt, dinode, &dst);
+    int n = src.size - s < size ? src.size - s : size;
+    if(n <= 0)
+        return 0;
+    if(d + n > mounts[dmnt].max_file_size)
+        return -1;
+
+    // The source range [a, e) whose blocks can be shared
+    int bs = mounts[dmnt].block_size;
+    int a = (s + bs - 1) / bs * bs;
+    int e = (s + n) / bs * bs;
+    if(e < s + n && s + n == src.size && d + n >= dst.size)
+        e = s + n;
+    // Blocks whose reference count is full are copied instead
+    struct superblock_t superblock;
+    read_superblock(dmnt, &superblock);
+    for(int j = a / bs; j * bs < e && e > a; j++)
+        if(src.mappings[j] != -1 && superblock.block_refs[(int)src.mappings[j]] == MAX_BLOCK_REFS)
+            e = a;
+    if(smnt != dmnt || sinode == dinode || mounts[smnt].ops->read_file || s % bs != d % bs || a >= e){
+        if(copy_through(src_handle, dst_handle, d, n) == -1)
+            return -1;
+        files[dst_handle].offset = d + n;
+        return n;
+    }
+
+    // Head: the bytes before the first shared block
+    if(a > s && copy_through(src_handle, dst_handle, d, a - s) == -1)
+        return -1;
+
+    // Middle: the destination maps the source's blocks, and the blocks it replaces lose its reference
+    read_inode(dmnt, dinode, &dst);
+    int num_blocks = dst.size / bs;
+    if(num_blocks * bs < dst.size)
+        num_blocks++;
+    int first = (d + a - s) / bs;
+    for(int i = num_blocks; i < first; i++)
+        dst.mappings[i] = -1;   // a gap before the range becomes a hole
+
+    read_superblock(dmnt, &superblock);
+    char replaced[MAX_FILE_SIZE];
+    int num_replaced = 0;
+    for(int j = a / bs, i = first; j * bs < e; j++, i++){
+        if(i < num_blocks && dst.mappings[i] != -1)
+            replaced[num_replaced++] = dst.mappings[i];
+        dst.mappings[i] = src.mappings[j];
+        if(src.mappings[j] != -1)
+            superblock.block_refs[(int)src.mappings[j]]++;
+    }
+    write_superblock(dmnt, &superblock);
+    if(num_replaced)
+        free_batch(dmnt, replaced, num_replaced, NULL, 0);
+    if(d + e - s > dst.size)
+        dst.size = d + e - s;
+    write_inode(dmnt, dinode, &dst);
+
+    // Tail: the bytes after the last shared block
+    files[src_handle].offset = e;
+    if(e < s + n && copy_through(src_handle, dst_handle, d + e - s, s + n - e) == -1)
+        return -1;
+
+    files[src_handle].offset = s + n;
+    files[dst_handle].offset = d + n;
+    return n;
+}
+
+
+void flush_dir(struct inode_t *inodes, int inodenum, int depth) {
+    // The inode, taken from the in-memory inode table
+    struct inode_t inode = inodes[inodenum];
 
     // Print indentation based on depth for the directory tree view
     for (int i = 0; i < depth - 1; i++) {
@@ -751,7 +1923,7 @@ void flush_dir(int mount_point, int inodenum, int depth) {
         // If it's a directory, add a newline and recursively process its contents
         printf("\n");
         for (int i = 0; i < inode.size; i++) {
-            flush_dir(mount_point, inode.mappings[i], depth + 1);
+            flush_dir(inodes, inode.mappings[i], depth + 1);
         }
     }
 }
@@ -772,9 +1944,314 @@ void fsdump(int mount_point)
     // Display the name of the storage device
     printf("\n[%s] File System Dump (fsdump)\n", superblock.device_name);
 
-    // Force a flush of the directory data, starting from the root
-    flush_dir(mount_point, 0, 0);
+    // Sizes must include buffered appends
+    flush_mount_buffers(mount_point);
+
+    // Read the inode table once and print the directory tree from memory, starting from the root
+    struct inode_t inodes[MAX_INODES];
+    read_inode_table(mount_point, inodes);
+    flush_dir(inodes, 0, 0);
 
     // Print the count of in-use inodes and blocks
-    printf("Inodes in use: %d, Blocks in use: %d\n", superblock.used_inodes, superblock.used_blocks);
+    printf("Inodes in use: %d, Blocks in use: %d, Block size: %d bytes\n", superblock.used_inodes, superblock.used_blocks, superblock.block_size);
+
+    // With dedup on, also report how many blocks are shared between files
+    if(superblock.dedup_index){
+        int shared = 0;
+        for(int i = 0; i < MAX_BLOCKS; i++)
+            if(superblock.block_refs[i] > 0)
+                shared++;
+        printf("Dedup index: block %d, Shared blocks: %d\n", superblock.dedup_index, shared);
+    }
+
+    // Report the snapshot's inode table, if one was taken
+    if(superblock.snapshot_blocks[0]){
+        printf("Snapshot inode table: blocks");
+        for(int i = 0; i < INODE_BLOCKS && superblock.snapshot_blocks[i]; i++)
+            printf(" %d", superblock.snapshot_blocks[i]);
+        printf("\n");
+    }
+}
+
+
+/*-----------TRACE------------*/
+static FILE *trace_file = NULL;    // Trace being recorded (NULL = tracing off)
+static long long trace_epoch;      // Clock at the start of the trace
+
+static long long clock_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int emufs_trace_start(const char *path){
+    /*
+        * Open the trace file; records are buffered and written in large chunks
+
+        * Return value: -1,     error
+                         1,     success
+    */
+
+    emufs_trace_stop();
+    trace_file = fopen(path, "wb");
+    if(!trace_file)
+        return -1;
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 16);
+    trace_epoch = clock_ns();
+    return 1;
+}
+
+void emufs_trace_stop(void){
+    if(trace_file)
+        fclose(trace_file);
+    trace_file = NULL;
+}
+
+static void trace_fill(struct emufs_trace_t *record, int op, int type, int mount_point, int handle, int result, int offset, int size, const char *path){
+    memset(record, 0, sizeof(*record));
+    record->op = op;
+    record->type = type;
+    record->mount_point = mount_point;
+    record->handle = handle;
+    record->result = result;
+    record->offset = offset;
+    record->size = size;
+    if(path)
+        strncpy(record->path, path, sizeof(record->path) - 1);
+}
+
+static void trace_write(struct emufs_trace_t *record, long long start){
+    record->timestamp_ns = start - trace_epoch;
+    record->latency_ns = clock_ns() - start;
+    fwrite(record, sizeof(*record), 1, trace_file);
+}
+
+static void trace(int op, int type, int mount_point, int handle, int result, int offset, int size, const char *path, long long start){
+    // Records one call; the calls with more arguments fill and write their record themselves
+    struct emufs_trace_t record;
+    trace_fill(&record, op, type, mount_point, handle, result, offset, size, path);
+    trace_write(&record, start);
+}
+
+static int dir_mount(int handle){
+    return handle >= 0 && handle < MAX_DIR_HANDLES ? dir[handle].mount_point : -1;
+}
+
+static int file_mount(int handle){
+    return handle >= 0 && handle < MAX_FILE_HANDLES ? files[handle].mount_point : -1;
+}
+
+static int file_offset(int handle){
+    return handle >= 0 && handle < MAX_FILE_HANDLES ? files[handle].offset : -1;
+}
+
+// The public calls run their body (the function of the same name with a trailing '_')
+// and record it when a trace is being taken. The calls with a latency histogram
+// (EMUFS_STAT_*) are timed and counted in the mount's statistics either way.
+
+static long long stats_start(int mount_point, long *ios){
+    *ios = stats_device_ios(mount_point);
+    return clock_ns();
+}
+
+static void stats_end(int mount_point, int call, long ios, long long start){
+    stats_record_call(mount_point, call, clock_ns() - start, stats_device_ios(mount_point) - ios);
+}
+
+int create_file_system(int mount_point, int fs_number, int block_size){
+    EMUFS_SPAN("create_file_system");
+    if(!trace_file)
+        return create_file_system_(mount_point, fs_number, block_size);
+    long long start = clock_ns();
+    int ret = create_file_system_(mount_point, fs_number, block_size);
+    trace(EMUFS_TRACE_MKFS, fs_number, mount_point, mount_point, ret, 0, block_size, NULL, start);
+    return ret;
+}
+
+int open_root(int mount_point){
+    EMUFS_SPAN("open_root");
+    if(!trace_file)
+        return open_root_(mount_point);
+    long long start = clock_ns();
+    int ret = open_root_(mount_point);
+    trace(EMUFS_TRACE_OPEN_ROOT, 1, mount_point, mount_point, ret, 0, 0, NULL, start);
+    return ret;
+}
+
+int change_dir(int dir_handle, char* path){
+    EMUFS_SPAN("change_dir");
+    if(!trace_file)
+        return change_dir_(dir_handle, path);
+    long long start = clock_ns();
+    int ret = change_dir_(dir_handle, path);
+    trace(EMUFS_TRACE_CHANGE_DIR, 1, dir_mount(dir_handle), dir_handle, ret, 0, 0, path, start);
+    return ret;
+}
+
+int open_file(int dir_handle, char* path){
+    EMUFS_SPAN("open_file");
+    int mount_point = dir_mount(dir_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = open_file_(dir_handle, path);
+    stats_end(mount_point, EMUFS_STAT_OPEN_FILE, ios, start);
+    if(trace_file)
+        trace(EMUFS_TRACE_OPEN_FILE, 0, mount_point, dir_handle, ret, 0, 0, path, start);
+    return ret;
+}
+
+int emufs_create(int dir_handle, char* name, int type){
+    EMUFS_SPAN("emufs_create");
+    int mount_point = dir_mount(dir_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = emufs_create_(dir_handle, name, type);
+    stats_end(mount_point, EMUFS_STAT_CREATE, ios, start);
+    if(trace_file)
+        trace(EMUFS_TRACE_CREATE, type, mount_point, dir_handle, ret, 0, 0, name, start);
+    return ret;
+}
+
+int emufs_delete(int dir_handle, char* path){
+    EMUFS_SPAN("emufs_delete");
+    int mount_point = dir_mount(dir_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = emufs_delete_(dir_handle, path);
+    stats_end(mount_point, EMUFS_STAT_DELETE, ios, start);
+    if(trace_file)
+        trace(EMUFS_TRACE_DELETE, 0, mount_point, dir_handle, ret, 0, 0, path, start);
+    return ret;
+}
+
+// A batch is timed as one call; the trace gets one record per entity so that it replays with the single calls
+
+int emufs_create_batch(int dir_handle, char** names, int* types, int count){
+    EMUFS_SPAN("emufs_create_batch");
+    int mount_point = dir_mount(dir_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = emufs_create_batch_(dir_handle, names, types, count);
+    stats_end(mount_point, EMUFS_STAT_CREATE, ios, start);
+    for(int i = 0; trace_file && i < count; i++)
+        trace(EMUFS_TRACE_CREATE, types[i], mount_point, dir_handle, ret == -1 ? -1 : 1, 0, 0, names[i], start);
+    return ret;
+}
+
+int emufs_delete_batch(int dir_handle, char** paths, int count){
+    EMUFS_SPAN("emufs_delete_batch");
+    int mount_point = dir_mount(dir_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = emufs_delete_batch_(dir_handle, paths, count);
+    stats_end(mount_point, EMUFS_STAT_DELETE, ios, start);
+    for(int i = 0; trace_file && i < count; i++)
+        trace(EMUFS_TRACE_DELETE, 0, mount_point, dir_handle, ret == -1 ? -1 : 1, 0, 0, paths[i], start);
+    return ret;
+}
+
+int emufs_close(int handle, int type){
+    EMUFS_SPAN("emufs_close");
+    if(!trace_file)
+        return emufs_close_(handle, type);
+    int mount_point = type ? dir_mount(handle) : file_mount(handle);
+    long long start = clock_ns();
+    int ret = emufs_close_(handle, type);
+    trace(EMUFS_TRACE_CLOSE, type, mount_point, handle, ret, 0, 0, NULL, start);
+    return ret;
+}
+
+int emufs_read(int file_handle, char* buf, int size){
+    EMUFS_SPAN("emufs_read");
+    int offset = file_offset(file_handle), mount_point = file_mount(file_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = emufs_read_(file_handle, buf, size);
+    stats_end(mount_point, EMUFS_STAT_READ, ios, start);
+    if(trace_file)
+        trace(EMUFS_TRACE_READ, 0, mount_point, file_handle, ret, offset, size, NULL, start);
+    return ret;
+}
+
+int emufs_write(int file_handle, char* buf, int size){
+    EMUFS_SPAN("emufs_write");
+    int offset = file_offset(file_handle), mount_point = file_mount(file_handle);
+    long ios;
+    long long start = stats_start(mount_point, &ios);
+    int ret = emufs_write_(file_handle, buf, size);
+    stats_end(mount_point, EMUFS_STAT_WRITE, ios, start);
+    if(trace_file)
+        trace(EMUFS_TRACE_WRITE, 0, mount_point, file_handle, ret, offset, size, NULL, start);
+    return ret;
+}
+
+int emufs_sync(int file_handle){
+    EMUFS_SPAN("emufs_sync");
+    if(!trace_file)
+        return emufs_sync_(file_handle);
+    long long start = clock_ns();
+    int ret = emufs_sync_(file_handle);
+    trace(EMUFS_TRACE_SYNC, 0, file_mount(file_handle), file_handle, ret, file_offset(file_handle), 0, NULL, start);
+    return ret;
+}
+
+int emufs_seek(int file_handle, int nseek){
+    EMUFS_SPAN("emufs_seek");
+    if(!trace_file)
+        return emufs_seek_(file_handle, nseek);
+    int offset = file_offset(file_handle);
+    long long start = clock_ns();
+    int ret = emufs_seek_(file_handle, nseek);
+    trace(EMUFS_TRACE_SEEK, 0, file_mount(file_handle), file_handle, ret, offset, nseek, NULL, start);
+    return ret;
+}
+
+int emufs_truncate(int file_handle, int size){
+    EMUFS_SPAN("emufs_truncate");
+    if(!trace_file)
+        return emufs_truncate_(file_handle, size);
+    long long start = clock_ns();
+    int ret = emufs_truncate_(file_handle, size);
+    trace(EMUFS_TRACE_TRUNCATE, 0, file_mount(file_handle), file_handle, ret, file_offset(file_handle), size, NULL, start);
+    return ret;
+}
+
+int emufs_fallocate(int file_handle, int size){
+    EMUFS_SPAN("emufs_fallocate");
+    if(!trace_file)
+        return emufs_fallocate_(file_handle, size);
+    long long start = clock_ns();
+    int ret = emufs_fallocate_(file_handle, size);
+    trace(EMUFS_TRACE_FALLOCATE, 0, file_mount(file_handle), file_handle, ret, file_offset(file_handle), size, NULL, start);
+    return ret;
+}
+
+int emufs_rename(int dir_handle, char* from, char* to){
+    EMUFS_SPAN("emufs_rename");
+    if(!trace_file)
+        return emufs_rename_(dir_handle, from, to);
+    long long start = clock_ns();
+    int ret = emufs_rename_(dir_handle, from, to);
+    // The target goes after the NUL of the source, as far as the record has room
+    struct emufs_trace_t record;
+    trace_fill(&record, EMUFS_TRACE_RENAME, 0, dir_mount(dir_handle), dir_handle, ret, 0, 0, from);
+    int len = strlen(record.path);
+    if(len < (int)sizeof(record.path) - 2)
+        strncpy(record.path + len + 1, to, sizeof(record.path) - len - 2);
+    trace_write(&record, start);
+    return ret;
+}
+
+int emufs_copy_range(int src_handle, int dst_handle, int size){
+    EMUFS_SPAN("emufs_copy_range");
+    if(!trace_file)
+        return emufs_copy_range_(src_handle, dst_handle, size);
+    int offset = file_offset(src_handle);
+    long long start = clock_ns();
+    int ret = emufs_copy_range_(src_handle, dst_handle, size);
+    struct emufs_trace_t record;
+    trace_fill(&record, EMUFS_TRACE_COPY_RANGE, 0, file_mount(src_handle), src_handle, ret, offset, size, NULL);
+    record.dst_handle = dst_handle;
+    trace_write(&record, start);
+    return ret;
 }
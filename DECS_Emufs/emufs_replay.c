@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emufs.h"
+#include "emufs_disk.h"
+
+/*
+	* Replays a trace recorded with emufs_trace_start on fresh devices, at the original pace
+	* or as fast as possible, and compares the replayed calls with the recorded ones.
+	*
+	* Every mount of the trace gets a new device ("replay<n>.img", or the RAM disk "mem:replay<n>.img"
+	* with -M, removed again like the image).
+	* A mount whose create_file_system call is in the trace is created the same way; any other
+	* is created with -f and -b. Handles of the trace are mapped to the handles the replay gets;
+	* a call on a handle the replay never got is skipped and counted as a mismatch.
+	* Written data is a fixed pattern: a trace records sizes, not contents.
+	*
+	* Usage: emufs_replay [-x] [-M] [-f fs_number] [-b block size] [-k key] [-v] trace
+	*   -x       replay as fast as possible instead of at the recorded pace
+	*   -M       replay on RAM disks instead of image files
+	*   -f fs    file system type of mounts created outside the trace (default 0)
+	*   -b size  their block size (default 256)
+	*   -k key   key of encrypted file systems (default 1)
+	*   -v       print every call whose outcome differs from the recording
+*/
+
+#define MAX_REPLAY_MOUNTS MAX_MOUNT_POINTS
+#define TRACE_OPS 16
+#define SKIPPED -2      // replay() of a call on a handle that is not mapped
+
+static const char *op_names[TRACE_OPS] = {"?", "mkfs", "open_root", "change_dir", "open_file", "create",
+	"delete", "close", "read", "write", "seek", "sync", "truncate", "fallocate", "rename", "copy_range"};
+
+static int mount_map[MAX_REPLAY_MOUNTS];     // Trace mount point -> replay mount point (-1 = not created)
+static int dir_map[MAX_DIR_HANDLES];         // Trace handle -> replay handle
+static int file_map[MAX_FILE_HANDLES];
+static int ram = 0, fs_number = EMUFS_NON_ENCRYPTED, block_size = 0;
+static char data[MAX_FILE_BYTES + 1];
+
+struct op_stats_t
+{
+	long count;
+	long mismatches;            // Calls that failed in one run and succeeded in the other
+	double recorded_ns;         // Total latency in the trace
+	double replayed_ns;         // Total latency of the replay
+};
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int map_handle(int *map, int size, int handle)
+{
+	return handle >= 0 && handle < size ? map[handle] : -1;
+}
+
+static int new_mount(int trace_mp, int fs, int bs)
+{
+	// A fresh device for a mount of the trace
+	char device[24];
+
+	if(trace_mp < 0 || trace_mp >= MAX_REPLAY_MOUNTS)
+		return -1;
+	if(mount_map[trace_mp] != -1)
+		closedevice(mount_map[trace_mp]);
+	// RAM disks of the same name are one device, so each mount names its own
+	snprintf(device, sizeof(device), "%sreplay%d.img", ram ? MEM_PREFIX : "", trace_mp);
+	unlink(device + (ram ? strlen(MEM_PREFIX) : 0));
+	mount_map[trace_mp] = opendevice(device, MAX_BLOCKS);
+	if(mount_map[trace_mp] == -1)
+		return -1;
+	return create_file_system(mount_map[trace_mp], fs, bs);
+}
+
+static int replay(struct emufs_trace_t *rec)
+{
+	/*
+		* Executes the call of one record with the replay's mounts and handles
+
+		* Return value: the call's return value
+						 SKIPPED, the call's handle is not mapped
+	*/
+
+	int dir_handle = map_handle(dir_map, MAX_DIR_HANDLES, rec->handle);
+	int file_handle = map_handle(file_map, MAX_FILE_HANDLES, rec->handle);
+	int ret = -1;
+
+	// A call on a handle needs the replay handle it maps to
+	switch(rec->op)
+	{
+		case EMUFS_TRACE_CHANGE_DIR:
+		case EMUFS_TRACE_OPEN_FILE:
+		case EMUFS_TRACE_CREATE:
+		case EMUFS_TRACE_DELETE:
+		case EMUFS_TRACE_RENAME:
+			if(dir_handle == -1)
+				return SKIPPED;
+			break;
+		case EMUFS_TRACE_READ:
+		case EMUFS_TRACE_WRITE:
+		case EMUFS_TRACE_SEEK:
+		case EMUFS_TRACE_SYNC:
+		case EMUFS_TRACE_TRUNCATE:
+		case EMUFS_TRACE_FALLOCATE:
+		case EMUFS_TRACE_COPY_RANGE:
+			if(file_handle == -1)
+				return SKIPPED;
+			break;
+	}
+
+	switch(rec->op)
+	{
+		case EMUFS_TRACE_MKFS:
+			return new_mount(rec->handle, rec->type, rec->size);
+		case EMUFS_TRACE_OPEN_ROOT:
+			if(rec->handle < 0 || rec->handle >= MAX_REPLAY_MOUNTS)
+				return -1;
+			if(mount_map[rec->handle] == -1 && new_mount(rec->handle, fs_number, block_size) == -1)
+				return -1;
+			ret = open_root(mount_map[rec->handle]);
+			if(rec->result >= 0 && rec->result < MAX_DIR_HANDLES)
+				dir_map[rec->result] = ret;
+			return ret;
+		case EMUFS_TRACE_CHANGE_DIR:
+			return change_dir(dir_handle, rec->path);
+		case EMUFS_TRACE_OPEN_FILE:
+			ret = open_file(dir_handle, rec->path);
+			if(rec->result >= 0 && rec->result < MAX_FILE_HANDLES)
+				file_map[rec->result] = ret;
+			return ret;
+		case EMUFS_TRACE_CREATE:
+			return emufs_create(dir_handle, rec->path, rec->type);
+		case EMUFS_TRACE_DELETE:
+			return emufs_delete(dir_handle, rec->path);
+		case EMUFS_TRACE_CLOSE:
+			if(rec->type)
+			{
+				if(dir_handle != -1)
+					emufs_close(dir_handle, 1);
+				if(rec->handle >= 0 && rec->handle < MAX_DIR_HANDLES)
+					dir_map[rec->handle] = -1;
+			}
+			else
+			{
+				if(file_handle != -1)
+					emufs_close(file_handle, 0);
+				if(rec->handle >= 0 && rec->handle < MAX_FILE_HANDLES)
+					file_map[rec->handle] = -1;
+			}
+			return 0;
+		case EMUFS_TRACE_READ:
+			if(rec->size < 0 || rec->size > MAX_FILE_BYTES)
+				return -1;
+			return emufs_read(file_handle, data, rec->size);
+		case EMUFS_TRACE_WRITE:
+			if(rec->size < 0 || rec->size > MAX_FILE_BYTES)
+				return -1;
+			return emufs_write(file_handle, data, rec->size);
+		case EMUFS_TRACE_SEEK:
+			return emufs_seek(file_handle, rec->size);
+		case EMUFS_TRACE_SYNC:
+			return emufs_sync(file_handle);
+		case EMUFS_TRACE_TRUNCATE:
+			return emufs_truncate(file_handle, rec->size);
+		case EMUFS_TRACE_FALLOCATE:
+			return emufs_fallocate(file_handle, rec->size);
+		case EMUFS_TRACE_RENAME:
+			// The target follows the NUL of the source (empty if it did not fit)
+			if(strlen(rec->path) >= sizeof(rec->path) - 2)
+				return -1;
+			return emufs_rename(dir_handle, rec->path, rec->path + strlen(rec->path) + 1);
+		case EMUFS_TRACE_COPY_RANGE:
+			ret = map_handle(file_map, MAX_FILE_HANDLES, rec->dst_handle);
+			if(ret == -1)
+				return SKIPPED;
+			return emufs_copy_range(file_handle, ret, rec->size);
+	}
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	int max_speed = 0, verbose = 0, key = 1;
+	char *trace_name = NULL;
+	struct op_stats_t stats[TRACE_OPS];
+	struct emufs_trace_t rec;
+	long records = 0, mismatches = 0, skipped = 0;
+	long long first = -1, last = 0;
+	FILE *trace, *out;
+
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-x") == 0)
+			max_speed = 1;
+		else if(strcmp(argv[i], "-M") == 0)
+			ram = 1;
+		else if(strcmp(argv[i], "-v") == 0)
+			verbose = 1;
+		else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			fs_number = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			block_size = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			key = atoi(argv[++i]);
+		else if(argv[i][0] != '-' && !trace_name)
+			trace_name = argv[i];
+		else
+		{
+			trace_name = NULL;
+			break;
+		}
+	}
+	if(!trace_name || key <= 0)
+	{
+		fprintf(stderr, "Usage: %s [-x] [-M] [-f fs_number] [-b block size] [-k key] [-v] trace\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	trace = fopen(trace_name, "rb");
+	if(!trace)
+	{
+		perror(trace_name);
+		return EXIT_FAILURE;
+	}
+
+	// The file system's messages would drown the results
+	out = fdopen(dup(fileno(stdout)), "w");
+	if(!out || !freopen("/dev/null", "w", stdout))
+		return EXIT_FAILURE;
+	emufs_set_key(key);
+	memset(stats, 0, sizeof(stats));
+	memset(mount_map, -1, sizeof(mount_map));
+	memset(dir_map, -1, sizeof(dir_map));
+	memset(file_map, -1, sizeof(file_map));
+	for(int i=0; i<MAX_FILE_BYTES; i++)
+		data[i] = 'a' + i % 26;
+
+	long long start = now_ns();
+	while(fread(&rec, sizeof(rec), 1, trace) == 1)
+	{
+		if(rec.op == 0 || rec.op >= TRACE_OPS)
+			continue;
+		rec.path[sizeof(rec.path) - 1] = 0;
+		if(first == -1)
+			first = rec.timestamp_ns;
+		last = rec.timestamp_ns + rec.latency_ns;
+
+		// At the recorded pace, wait for the call's time (measured from the first record)
+		if(!max_speed)
+		{
+			long long wait = (rec.timestamp_ns - first) - (now_ns() - start);
+			if(wait > 0)
+			{
+				struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		long long t = now_ns();
+		int ret = replay(&rec);
+		long long latency = now_ns() - t;
+
+		struct op_stats_t *s = &stats[rec.op];
+		s->count++;
+		s->recorded_ns += rec.latency_ns;
+		s->replayed_ns += latency;
+		if(ret == SKIPPED)
+		{
+			s->mismatches++;
+			mismatches++;
+			skipped++;
+			if(verbose)
+				fprintf(out, "record %ld: %s(%d%s%s) skipped, handle not mapped\n", records, op_names[rec.op],
+						rec.handle, rec.path[0] ? ", " : "", rec.path);
+		}
+		else if((ret == -1) != (rec.result == -1))
+		{
+			s->mismatches++;
+			mismatches++;
+			if(verbose)
+				fprintf(out, "record %ld: %s(%d%s%s) returned %d, recorded %d\n", records, op_names[rec.op],
+						rec.handle, rec.path[0] ? ", " : "", rec.path, ret, rec.result);
+		}
+		records++;
+	}
+	double elapsed = now_ns() - start;
+	fclose(trace);
+
+	for(int i=0; i<MAX_REPLAY_MOUNTS; i++)
+		if(mount_map[i] != -1)
+		{
+			char device[24];
+			closedevice(mount_map[i]);
+			snprintf(device, sizeof(device), "replay%d.img", i);
+			unlink(device);
+		}
+
+	fprintf(out, "%-12s %8s %10s %14s %14s\n", "call", "count", "mismatch", "recorded us", "replayed us");
+	for(int i=1; i<TRACE_OPS; i++)
+		if(stats[i].count)
+			fprintf(out, "%-12s %8ld %10ld %14.2f %14.2f\n", op_names[i], stats[i].count, stats[i].mismatches,
+					stats[i].recorded_ns / stats[i].count / 1e3, stats[i].replayed_ns / stats[i].count / 1e3);
+	fprintf(out, "%ld calls, %ld mismatches (%ld skipped); recorded %.3f s, replayed in %.3f s\n", records, mismatches, skipped,
+			first == -1 ? 0 : (last - first) / 1e9, elapsed / 1e9);
+	fclose(out);
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,460 @@
+#include "emufs_disk.h"
+#include "emufs.h"
+#include "emufs_client.h"
+#include <poll.h>       // poll, to serve all the clients from one thread
+#include <signal.h>     // Clean unmount on SIGINT/SIGTERM
+
+/*
+	* EMUFS server: owns the mounts, their block caches and the handle tables, and serves
+	* the file system API to other processes over a Unix domain socket (protocol in emufs_client.h).
+	* All clients share the mounts, so a device opened twice is only read into one cache; it is
+	* unmounted when the last client that opened it closes it. Handles belong to the client that
+	* opened them.
+	*
+	* Usage: emufs_server [socket path]
+*/
+
+#define MAX_CLIENTS 16                                                  // Connections served at a time
+#define CLIENT_IN_BUF (sizeof(struct emufs_msg_t) + EMUFS_MAX_PAYLOAD)  // Room for the largest request
+
+// Structure to represent a connected client
+struct client_t
+{
+	int fd;                             // Socket (-1 = free slot)
+	char in[CLIENT_IN_BUF];             // Received bytes not executed yet
+	size_t in_len;
+	char *out;                          // Replies not sent yet
+	size_t out_len, out_sent, out_cap;
+	char *shm;                          // Shared data buffer (NULL = not attached)
+	int shm_fd;                         // Descriptor received for the shared buffer (-1 = none)
+	char file_owned[MAX_FILE_HANDLES];  // Handles opened by this client, closed when it leaves
+	char dir_owned[MAX_DIR_HANDLES];
+	char mount_owned[MAX_MOUNT_POINTS]; // Mounts opened by this client (one reference each)
+};
+
+static struct client_t clients[MAX_CLIENTS];
+static int mount_keys[MAX_MOUNT_POINTS];    // Key each mount was opened with (0 = none)
+static int mount_users[MAX_MOUNT_POINTS];   // Clients holding a reference to each mount
+static char data[EMUFS_MAX_PAYLOAD];        // Data of a read sent back in the reply
+static volatile sig_atomic_t stop = 0;
+
+
+/*-----------CLIENTS------------*/
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void take_handle(struct client_t *client, int handle, int type)
+{
+	// A handle belongs to the client that opened it last (a closed handle is reused)
+	for(int i=0; i<MAX_CLIENTS; i++)
+	{
+		if(type)
+			clients[i].dir_owned[handle] = 0;
+		else
+			clients[i].file_owned[handle] = 0;
+	}
+	if(type)
+		client->dir_owned[handle] = 1;
+	else
+		client->file_owned[handle] = 1;
+}
+
+static void take_mount(struct client_t *client, int mount_point)
+{
+	// A client holds one reference to each mount it opened, however many times it opened it
+	if(client->mount_owned[mount_point])
+		return;
+	client->mount_owned[mount_point] = 1;
+	mount_users[mount_point]++;
+}
+
+static void drop_client(struct client_t *client)
+{
+	/*
+		* Closes the handles the client left open (appends that cannot be written are dropped)
+		* and unmounts the mounts no other client holds
+	*/
+
+	for(int i=0; i<MAX_FILE_HANDLES; i++)
+		if(client->file_owned[i] && emufs_close(i, 0) == -1)
+			emufs_discard(i);
+	for(int i=0; i<MAX_DIR_HANDLES; i++)
+		if(client->dir_owned[i])
+			emufs_close(i, 1);
+	for(int i=0; i<MAX_MOUNT_POINTS; i++)
+	{
+		if(!client->mount_owned[i] || --mount_users[i] > 0)
+			continue;
+		// A mount that cannot be closed keeps its key, so it is still only shared with it
+		if(closedevice(i) != -1)
+			mount_keys[i] = 0;
+	}
+	if(client->shm)
+		munmap(client->shm, EMUFS_SHM_SIZE);
+	if(client->shm_fd != -1)
+		close(client->shm_fd);
+	close(client->fd);
+	free(client->out);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+	client->shm_fd = -1;
+}
+
+static int add_reply(struct client_t *client, struct emufs_msg_t *reply, const char *payload)
+{
+	// Appends a reply to the client's output; it is sent with the other replies of the batch
+	size_t need = client->out_len + sizeof(*reply) + reply->len;
+	if(need > client->out_cap)
+	{
+		size_t cap = client->out_cap ? client->out_cap : 4096;
+		while(cap < need)
+			cap *= 2;
+		char *out = (char*)realloc(client->out, cap);
+		if(!out)
+			return -1;
+		client->out = out;
+		client->out_cap = cap;
+	}
+	memcpy(client->out + client->out_len, reply, sizeof(*reply));
+	client->out_len += sizeof(*reply);
+	if(reply->len)
+		memcpy(client->out + client->out_len, payload, reply->len);
+	client->out_len += reply->len;
+	return 1;
+}
+
+
+/*-----------REQUESTS------------*/
+static int valid_mount(int mount_point)
+{
+	return mount_point >= 0 && mount_point < MAX_MOUNT_POINTS && mounts[mount_point].device_fd > 0;
+}
+
+static int execute(struct client_t *client, struct emufs_msg_t *req, char *payload, int *reply_len)
+{
+	/*
+		* Executes one request. A read without a shared buffer leaves its data in `data`
+		* and its length in reply_len.
+
+		* Return value: the call's return value (-1 for an invalid request)
+	*/
+
+	int *args = req->args;
+	int ret;
+
+	*reply_len = 0;
+
+	// Names and paths are NUL-terminated payloads
+	char *path = req->len > 0 && payload[req->len - 1] == 0 ? payload : NULL;
+	// Handles and mounts are only usable by the client that opened them
+	int file_ok = args[0] >= 0 && args[0] < MAX_FILE_HANDLES && client->file_owned[args[0]];
+	int dir_ok = args[0] >= 0 && args[0] < MAX_DIR_HANDLES && client->dir_owned[args[0]];
+	int mount_ok = valid_mount(args[0]) && client->mount_owned[args[0]];
+
+	switch(req->op)
+	{
+		case EMUFS_REQ_OPEN_DEVICE:
+			if(!path)
+				return -1;
+			// A device mounted already is shared, together with its cache, with clients that give its key
+			for(int i=0; i<MAX_MOUNT_POINTS; i++)
+				if(valid_mount(i) && strcmp(mounts[i].device_name, path) == 0)
+				{
+					if(mount_keys[i] && args[1] != mount_keys[i])
+						return -1;
+					take_mount(client, i);
+					return i;
+				}
+			// Without a key an encrypted device fails to open, the console is never asked
+			emufs_set_key(args[1] > 0 ? args[1] : -1);
+			ret = opendevice(path, args[0]);
+			emufs_set_key(0);
+			if(ret != -1)
+			{
+				mount_keys[ret] = args[1];
+				take_mount(client, ret);
+			}
+			return ret;
+
+		case EMUFS_REQ_CLOSE_DEVICE:
+			if(!mount_ok)
+				return -1;
+			// Only the last client using the mount unmounts it
+			if(mount_users[args[0]] == 1 && closedevice(args[0]) == -1)
+				return -1;
+			client->mount_owned[args[0]] = 0;
+			if(--mount_users[args[0]] == 0)
+				mount_keys[args[0]] = 0;
+			return 1;
+
+		case EMUFS_REQ_MKFS:
+			// The key of an encrypted file system comes with the device, never from the console
+			if(!mount_ok || (args[1] == EMUFS_ENCRYPTED && mount_keys[args[0]] <= 0))
+				return -1;
+			emufs_set_key(mount_keys[args[0]]);
+			ret = create_file_system(args[0], args[1], args[2]);
+			emufs_set_key(0);
+			return ret;
+
+		case EMUFS_REQ_OPEN_ROOT:
+			if(!mount_ok)
+				return -1;
+			ret = open_root(args[0]);
+			if(ret != -1)
+				take_handle(client, ret, 1);
+			return ret;
+
+		case EMUFS_REQ_CHANGE_DIR:
+			return dir_ok && path ? change_dir(args[0], path) : -1;
+
+		case EMUFS_REQ_OPEN_FILE:
+			if(!dir_ok || !path)
+				return -1;
+			ret = open_file(args[0], path);
+			if(ret != -1)
+				take_handle(client, ret, 0);
+			return ret;
+
+		case EMUFS_REQ_CREATE:
+			return dir_ok && path ? emufs_create(args[0], path, args[1]) : -1;
+
+		case EMUFS_REQ_DELETE:
+			return dir_ok && path ? emufs_delete(args[0], path) : -1;
+
+		case EMUFS_REQ_CLOSE:
+			if(!(args[1] ? dir_ok : file_ok))
+				return -1;
+			if(emufs_close(args[0], args[1]) == -1)
+				return -1;
+			if(args[1])
+				client->dir_owned[args[0]] = 0;
+			else
+				client->file_owned[args[0]] = 0;
+			return 1;
+
+		case EMUFS_REQ_READ:
+			if(!file_ok || args[1] < 0 || args[1] > EMUFS_MAX_PAYLOAD)
+				return -1;
+			if(args[2] >= 0)
+			{
+				// Straight into the client's shared buffer
+				if(!client->shm || args[2] > EMUFS_SHM_SIZE - args[1])
+					return -1;
+				return emufs_read(args[0], client->shm + args[2], args[1]);
+			}
+			ret = emufs_read(args[0], data, args[1]);
+			if(ret != -1)
+				*reply_len = args[1];
+			return ret;
+
+		case EMUFS_REQ_WRITE:
+			if(!file_ok || args[1] < 0)
+				return -1;
+			if(args[2] >= 0)
+			{
+				if(!client->shm || args[1] > EMUFS_SHM_SIZE || args[2] > EMUFS_SHM_SIZE - args[1])
+					return -1;
+				return emufs_write(args[0], client->shm + args[2], args[1]);
+			}
+			if(args[1] != req->len)
+				return -1;
+			return emufs_write(args[0], payload, args[1]);
+
+		case EMUFS_REQ_SEEK:
+			return file_ok ? emufs_seek(args[0], args[1]) : -1;
+
+		case EMUFS_REQ_SYNC:
+			return file_ok ? emufs_sync(args[0]) : -1;
+
+		case EMUFS_REQ_ATTACH_SHM:
+			if(client->shm_fd == -1)
+				return -1;
+			if(client->shm)
+				munmap(client->shm, EMUFS_SHM_SIZE);
+			client->shm = mmap(NULL, EMUFS_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, client->shm_fd, 0);
+			close(client->shm_fd);
+			client->shm_fd = -1;
+			if(client->shm == MAP_FAILED)
+			{
+				client->shm = NULL;
+				return -1;
+			}
+			return 1;
+	}
+
+	printf("Error: Unknown request %d \n", req->op);
+	return -1;
+}
+
+static int receive(struct client_t *client)
+{
+	/*
+		* Reads what the client sent, executes every complete request in order and
+		* queues the replies, so a pipelined batch is answered with one write
+
+		* Return value: -1, connection closed or protocol error
+						 1, success
+	*/
+
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { client->in + client->in_len, sizeof(client->in) - client->in_len };
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	n = recvmsg(client->fd, &mh, 0);
+	if(n <= 0)
+		return -1;
+	client->in_len += n;
+
+	// A descriptor passed along is the shared buffer of the EMUFS_REQ_ATTACH_SHM request
+	for(cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			if(client->shm_fd != -1)
+				close(client->shm_fd);
+			memcpy(&client->shm_fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+
+	size_t done = 0;
+	while(client->in_len - done >= sizeof(struct emufs_msg_t))
+	{
+		struct emufs_msg_t req, reply;
+		memcpy(&req, client->in + done, sizeof(req));
+		if(req.len < 0 || req.len > EMUFS_MAX_PAYLOAD)
+			return -1;
+		if(client->in_len - done < sizeof(req) + req.len)
+			break;
+
+		int reply_len;
+		reply.op = req.op;
+		reply.id = req.id;
+		reply.args[0] = execute(client, &req, client->in + done + sizeof(req), &reply_len);
+		reply.args[1] = reply.args[2] = 0;
+		reply.len = reply_len;
+		if(add_reply(client, &reply, data) == -1)
+			return -1;
+		done += sizeof(req) + req.len;
+	}
+	memmove(client->in, client->in + done, client->in_len - done);
+	client->in_len -= done;
+	return 1;
+}
+
+static int send_replies(struct client_t *client)
+{
+	// Sends as much of the queued replies as the socket takes without blocking
+	while(client->out_sent < client->out_len)
+	{
+		ssize_t n = send(client->fd, client->out + client->out_sent, client->out_len - client->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		if(n <= 0)
+			return -1;
+		client->out_sent += n;
+	}
+	client->out_len = client->out_sent = 0;
+	return 1;
+}
+
+
+/*-----------SERVER------------*/
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : EMUFS_SOCKET;
+	struct sockaddr_un addr;
+	struct pollfd fds[MAX_CLIENTS + 1];
+	int listen_fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("Error: Socket path too long \n");
+		return EXIT_FAILURE;
+	}
+	for(int i=0; i<MAX_CLIENTS; i++)
+	{
+		clients[i].fd = -1;
+		clients[i].shm_fd = -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, MAX_CLIENTS) == -1)
+	{
+		perror("Failed to open the server socket");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("EMUFS server listening on %s \n", path);
+	fflush(stdout);
+
+	while(!stop)
+	{
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for(int i=0; i<MAX_CLIENTS; i++)
+		{
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN | (clients[i].out_len ? POLLOUT : 0);
+			fds[i + 1].revents = 0;
+		}
+		if(poll(fds, MAX_CLIENTS + 1, -1) == -1)
+			continue;   // interrupted by a signal
+
+		if(fds[0].revents & POLLIN)
+		{
+			int fd = accept(listen_fd, NULL, NULL);
+			int slot = -1;
+			for(int i=0; i<MAX_CLIENTS && fd != -1; i++)
+				if(clients[i].fd == -1)
+				{
+					slot = i;
+					break;
+				}
+			if(slot == -1 && fd != -1)
+				close(fd);  // too many clients
+			else if(slot != -1)
+				clients[slot].fd = fd;
+		}
+
+		for(int i=0; i<MAX_CLIENTS; i++)
+		{
+			struct client_t *client = &clients[i];
+			short ev = fds[i + 1].revents;
+			if(client->fd == -1 || fds[i + 1].fd != client->fd || !ev)
+				continue;
+			if((ev & (POLLIN | POLLHUP | POLLERR)) && receive(client) == -1)
+			{
+				drop_client(client);
+				continue;
+			}
+			if(send_replies(client) == -1)
+				drop_client(client);
+		}
+	}
+
+	// Pending writes reach the devices before the server goes away
+	for(int i=0; i<MAX_CLIENTS; i++)
+		if(clients[i].fd != -1)
+			drop_client(&clients[i]);
+	for(int i=0; i<MAX_MOUNT_POINTS; i++)
+		if(valid_mount(i))
+			closedevice(i);
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,186 @@
+#include "emufs_span.h"
+
+#ifdef EMUFS_SPANS
+#include <pthread.h>    // Registration of the thread buffers
+#include <stdatomic.h>  // Recording flag and thread ids
+#include <unistd.h>     // getpid
+
+struct span_event_t
+{
+	const char *name;
+	long long start_ns;         // Since emufs_span_start
+	long long duration_ns;
+	int depth;                  // Open spans around it
+};
+
+struct span_buffer_t
+{
+	int tid;                    // Thread id shown in the trace (1, 2, ... in order of the first span)
+	int depth;                  // Open spans
+	int count;                  // Recorded spans
+	long dropped;               // Spans lost to a full buffer
+	struct
+	{
+		const char *name;
+		long long start_ns;
+	} open[EMUFS_SPAN_DEPTH];
+	struct span_event_t events[EMUFS_SPAN_EVENTS];
+	struct span_buffer_t *next;
+};
+
+static atomic_int recording;
+static atomic_int next_tid;
+static long long epoch_ns;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct span_buffer_t *buffers;       // Buffers of every thread that recorded (kept until exit)
+static __thread struct span_buffer_t *thread_buffer;
+
+
+static long long span_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct span_buffer_t* get_buffer(void)
+{
+	// The calling thread's buffer; registered on its first span
+	if(thread_buffer)
+		return thread_buffer;
+	struct span_buffer_t *buffer = (struct span_buffer_t*)calloc(1, sizeof(struct span_buffer_t));
+	if(!buffer)
+		return NULL;
+	buffer->tid = atomic_fetch_add(&next_tid, 1) + 1;
+	pthread_mutex_lock(&buffers_lock);
+	buffer->next = buffers;
+	buffers = buffer;
+	pthread_mutex_unlock(&buffers_lock);
+	thread_buffer = buffer;
+	return buffer;
+}
+
+int emufs_span_begin(const char *name)
+{
+	if(!atomic_load_explicit(&recording, memory_order_relaxed))
+		return -1;
+
+	struct span_buffer_t *buffer = get_buffer();
+	if(!buffer || buffer->depth == EMUFS_SPAN_DEPTH)
+		return -1;
+	buffer->open[buffer->depth].name = name;
+	buffer->open[buffer->depth].start_ns = span_clock();
+	return buffer->depth++;
+}
+
+void emufs_span_end(int *span)
+{
+	struct span_buffer_t *buffer = thread_buffer;
+
+	if(*span < 0 || !buffer)
+		return;
+
+	// Spans close in reverse order, so this one is the innermost open span
+	buffer->depth = *span;
+	if(buffer->count == EMUFS_SPAN_EVENTS)
+	{
+		buffer->dropped++;
+		return;
+	}
+	struct span_event_t *event = &buffer->events[buffer->count++];
+	event->name = buffer->open[*span].name;
+	event->start_ns = buffer->open[*span].start_ns - epoch_ns;
+	event->duration_ns = span_clock() - buffer->open[*span].start_ns;
+	event->depth = *span;
+}
+
+int emufs_span_start(void)
+{
+	pthread_mutex_lock(&buffers_lock);
+	for(struct span_buffer_t *buffer = buffers; buffer; buffer = buffer->next)
+	{
+		buffer->count = 0;
+		buffer->dropped = 0;
+	}
+	pthread_mutex_unlock(&buffers_lock);
+	epoch_ns = span_clock();
+	atomic_store(&recording, 1);
+	return 1;
+}
+
+void emufs_span_stop(void)
+{
+	atomic_store(&recording, 0);
+}
+
+int emufs_span_write(const char *path)
+{
+	/*
+		* Writes {"traceEvents": [...]} with one complete ("X") event per span;
+		* timestamps and durations are in microseconds, as the format wants
+
+		* Return value: -1,				error
+						 span count,	success
+	*/
+
+	FILE *out = fopen(path, "w");
+	int written = 0;
+
+	if(!out)
+		return -1;
+	fprintf(out, "{\"traceEvents\": [");
+	pthread_mutex_lock(&buffers_lock);
+	for(struct span_buffer_t *buffer = buffers; buffer; buffer = buffer->next)
+	{
+		for(int i=0; i<buffer->count; i++)
+		{
+			struct span_event_t *event = &buffer->events[i];
+			fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"emufs\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+					"\"pid\": %d, \"tid\": %d, \"args\": {\"depth\": %d}}",
+					written ? "," : "", event->name, event->start_ns / 1e3, event->duration_ns / 1e3,
+					(int)getpid(), buffer->tid, event->depth);
+			written++;
+		}
+		if(buffer->dropped)
+			fprintf(stderr, "Warning: %ld spans of thread %d dropped (buffer full)\n", buffer->dropped, buffer->tid);
+		buffer->count = 0;
+		buffer->dropped = 0;
+	}
+	pthread_mutex_unlock(&buffers_lock);
+	fprintf(out, "\n], \"displayTimeUnit\": \"ns\"}\n");
+	if(fclose(out) != 0)
+		return -1;
+	return written;
+}
+
+#else
+
+// Trace points compiled out
+
+int emufs_span_start(void)
+{
+	return -1;
+}
+
+void emufs_span_stop(void)
+{
+}
+
+int emufs_span_write(const char *path)
+{
+	(void)path;
+	return -1;
+}
+
+int emufs_span_begin(const char *name)
+{
+	(void)name;
+	return -1;
+}
+
+void emufs_span_end(int *span)
+{
+	(void)span;
+}
+
+#endif
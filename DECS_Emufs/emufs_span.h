@@ -0,0 +1,37 @@
+#include <stdio.h>      // Standard I/O functions
+#include <stdlib.h>     // General utility functions
+#include <string.h>     // String manipulation functions
+#include <time.h>       // Span timestamps
+
+#define EMUFS_SPAN_EVENTS 65536     // Spans a thread can record before further ones are dropped
+#define EMUFS_SPAN_DEPTH 32         // Deepest nesting of open spans in a thread
+
+/*
+	* Span tracing. EMUFS_SPAN("name") at the top of a block opens a span that is closed when
+	* the block is left (by any return). Spans nest, are recorded into per-thread buffers and
+	* are exported as Chrome trace-event JSON (chrome://tracing, Perfetto).
+	*
+	* The trace points are compiled in only with -DEMUFS_SPANS; otherwise EMUFS_SPAN expands
+	* to nothing and the functions below do nothing (emufs_span_start returns -1).
+*/
+#ifdef EMUFS_SPANS
+#define EMUFS_SPAN(name) int emufs_span_ __attribute__((cleanup(emufs_span_end), unused)) = emufs_span_begin(name)
+#else
+#define EMUFS_SPAN(name)
+#endif
+
+// Function to start recording spans (earlier, unexported spans are discarded)
+// Returns 1 on success or -1 if the trace points are not compiled in.
+int emufs_span_start(void);
+
+// Function to stop recording spans; the recorded ones can still be exported
+void emufs_span_stop(void);
+
+// Function to write the recorded spans of every thread to `path` as Chrome trace-event JSON and clear them
+// The other threads must not be inside a traced call. Returns the number of spans written or -1 on error.
+int emufs_span_write(const char *path);
+
+// Functions behind EMUFS_SPAN: open a span named `name` (a string constant) and close it
+// emufs_span_begin returns the span's token (-1 = not recorded); emufs_span_end takes a pointer to it
+int emufs_span_begin(const char *name);
+void emufs_span_end(int *span);
@@ -1,2 +1,9 @@
-gcc UI.c emufs_disk.c emufs_ops.c -o UI.out
-./UI.out 
\ No newline at end of file
+gcc -pthread UI.c emufs_disk.c emufs_ops.c emufs_span.c emufs_log.c -o UI.out
+gcc emufs_server.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_server.out
+gcc emufs_batch.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_batch.out
+gcc emufs_bench.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_bench.out
+gcc -pthread emufs_load.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_load.out
+gcc emufs_replay.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_replay.out
+gcc -pthread emufs_import.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_import.out
+gcc emufs_export.c emufs_disk.c emufs_ops.c emufs_span.c -o emufs_export.out
+./UI.out